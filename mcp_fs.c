@@ -2,6 +2,64 @@
 #include <string.h>
 #include <stdbool.h>
 #include <limits.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC32C_X86
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM
+#endif
+
+#if defined(MFS_THREAD_SAFE) && (defined(MFS_STATS) || defined(MFS_TRACE))
+#error "the statistics and trace are kept by one thread at a time"
+#endif
+
+#ifdef MFS_STATS
+#ifndef MFS_STATS_CYCLES
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define MFS_STATS_CYCLES() __rdtsc()
+#else
+#define MFS_STATS_CYCLES() 0
+#endif
+#endif
+#endif
+
+#if defined(MFS_STATS) || defined(MFS_THREAD_SAFE)
+/* the public functions are defined under these names and wrapped at the
+   end of the file to be counted and timed, or locked */
+#define mfs_file_count mfs_file_count_unwrapped
+#define mfs_free_space mfs_free_space_unwrapped
+#define mfs_list_files mfs_list_files_unwrapped
+#define mfs_list_files_info mfs_list_files_info_unwrapped
+#define mfs_stat mfs_stat_unwrapped
+#define mfs_delete mfs_delete_unwrapped
+#define mfs_open mfs_open_unwrapped
+#define mfs_read mfs_read_unwrapped
+#define mfs_seek mfs_seek_unwrapped
+#define mfs_pread mfs_pread_unwrapped
+#define mfs_reserve mfs_reserve_unwrapped
+#define mfs_compress mfs_compress_unwrapped
+#define mfs_write mfs_write_unwrapped
+#define mfs_close mfs_close_unwrapped
+#define mfs_fopen mfs_fopen_unwrapped
+#define mfs_fread mfs_fread_unwrapped
+#define mfs_fwrite mfs_fwrite_unwrapped
+#define mfs_fclose mfs_fclose_unwrapped
+#define mfs_fseek mfs_fseek_unwrapped
+#define mfs_fpread mfs_fpread_unwrapped
+#define mfs_fskip_index mfs_fskip_index_unwrapped
+#define mfs_freserve mfs_freserve_unwrapped
+#define mfs_fcompress mfs_fcompress_unwrapped
+#define mfs_fstaging mfs_fstaging_unwrapped
+#endif
+
+#if defined(MFS_STATS) || defined(MFS_TRACE)
+/* wrapped to mount with callbacks that count and trace */
+#define mfs_mount mfs_mount_unwrapped
+#elif defined(MFS_THREAD_SAFE)
+#define mfs_mount mfs_mount_unwrapped
+#endif
 
 /*
 
@@ -24,18 +82,106 @@ data : u8[]
 unoccupied data bytes : i32
 next block idx or checksum : u32
 
+
+The checksum is FNV-1a over the whole chain but the final 4 bytes. It is
+CRC32C instead when bit 30 of prefer_if_older differs from bit 31, which
+is never the case for -1 or a block index.
+
+A file can go on in segments, chains that start like a file with its
+name. When bit 29 of prefer_if_older differs from bit 31 the chain is
+a segment and prefer_if_older is the first block of the file or segment
+it goes on after. Appending writes a new segment after the last one, or
+copies the last segment into a new one when it is short. Of the segments
+that go on after the same block and are younger than it, the youngest
+counts. A segment is committed once its final block is written.
+
+When bit 28 of prefer_if_older differs from bit 31 the data of the chain
+is compressed. Each block's data is then its literal bytes, followed by
+tokens read from the end of the data back towards the literals. Matches
+copy earlier literals of the same block, so a block is decoded without
+the ones before it. The tokens of a full block end with a 0 token unless
+they meet the literals. A file and its segments are all compressed or
+all not.
+
+literals : u8[]
+0 token or unused : u8[]
+tokens, last first : u8[]
+
+token : u8. 1 to 127, a literal run of that many bytes
+        0x80 | (length - 4), a match, below which are
+match distance back from the end of the literals so far : u16, high byte first
+
+When bit 27 of prefer_if_older differs from bit 31 the final block of the
+chain keeps the size and CRC32C of the contents of the whole file, with
+the segments before it, in the last 8 of its unoccupied data bytes when
+there are that many.
+
+size : u32
+contents CRC32C : u32
+
 */
 
 #define CHECKSUM_INIT_VAL 2166136261u
+#define PREFER_CRC32C_BIT 0x40000000
+#define PREFER_SEGMENT_BIT 0x20000000
+#define PREFER_COMPRESSED_BIT 0x10000000
+#define PREFER_INFO_BIT 0x08000000
+/* appending copies a last segment of at most this many blocks */
+#define APPEND_COPY_BLOCK_COUNT 4
 
 #define SET_NEEDS_REMOUNT_THEN_RETURN(mfs, retval) do {mfs->needs_remount = true; return retval;} while(0)
-#define SET_FILE_CLOSED_THEN_RETURN(mfs, retval) do {mfs->open_file_mode = -1; return retval;} while(0)
+#define SET_FILE_CLOSED_THEN_RETURN(mfs, file, retval) do {file_forget(mfs, file); return retval;} while(0)
+
+#ifdef MFS_THREAD_SAFE
+/* remounting while holding the lock shared. the call is made again holding it exclusive */
+#define LOCK_UPGRADE_NEEDED -1100
+#define STATE_LOCK(mfs) pthread_mutex_lock(&((mfs_t *) (mfs))->state_lock)
+#define STATE_UNLOCK(mfs) pthread_mutex_unlock(&((mfs_t *) (mfs))->state_lock)
+#else
+#define STATE_LOCK(mfs) ((void) 0)
+#define STATE_UNLOCK(mfs) ((void) 0)
+#endif
+
+#ifdef MFS_STATS
+/* counters are bumped from functions that otherwise only read `mfs` */
+#define STATS_ADD(mfs, field, n) (((mfs_t *) (mfs))->stats.field += (n))
+#define STATS_PURPOSE(mfs, purpose) (((mfs_t *) (mfs))->stats_purpose = (purpose))
+#else
+#define STATS_ADD(mfs, field, n) ((void) (mfs))
+#define STATS_PURPOSE(mfs, purpose) ((void) 0)
+#endif
+
+#ifdef MFS_TRACE
+#define TRACE(mfs, event, phase, block_index, count) trace_record((const mfs_t *) (mfs), event, phase, block_index, count)
+
+static void trace_record(const mfs_t * mfs, int event, int phase, int block_index, int count)
+{
+    const mfs_conf_t * user_conf = mfs->user_conf;
+    if(!user_conf->trace_entry_count) return;
+    mfs_t * m = (mfs_t *) mfs;
+    mfs_trace_entry_t * entry = &user_conf->trace_entries[m->trace_next];
+    entry->time = user_conf->trace_clock(user_conf->cb_ctx);
+    entry->event = event;
+    entry->phase = phase;
+    entry->count = count;
+    entry->block_index = block_index;
+    if(++m->trace_next == user_conf->trace_entry_count) {
+        m->trace_next = 0;
+        m->trace_wrapped = true;
+    }
+}
+#else
+#define TRACE(mfs, event, phase, block_index, count) ((void) 0)
+#endif
 
 enum {
     FILE_START_BLOCKS,
     OCCUPIED_BLOCKS,
+    SEGMENT_START_BLOCKS,
+    CONTINUED_BLOCKS, /* first blocks of files and segments that a segment goes on after */
     SCRATCH_1,
-    SCRATCH_2
+    SCRATCH_2,
+    BIT_BUF_COUNT
 };
 
 static void set_bit(uint8_t * bit_buf, unsigned bit_index)
@@ -53,498 +199,4324 @@ static void clear_bit(uint8_t * bit_buf, unsigned bit_index)
     bit_buf[bit_index / 8] &= ~(1 << (bit_index % 8));
 }
 
-static bool and_any(const uint8_t * buf_1, const uint8_t * buf_2, size_t n)
+/*
+
+Summarized bit buffers
+
+Each bit buffer of mfs_t is followed by two summaries with a bit for
+each of its 64 bit words. One is set when the word has any bit set, the
+other when it has all of them set. Sweeps only visit the words that can
+matter, so they cost what is set rather than the size of the volume.
+Words are little endian so the bytes are what the checkpoint stores.
+
+bits : u64[word_count]
+any set : u64[summary_word_count]
+all set : u64[summary_word_count]
+
+*/
+
+static int summary_word_count(int block_count)
 {
-    for(size_t i = 0; i < n; i++) {
-        if(buf_1[i] & buf_2[i]) {
-            return true;
-        }
-    }
-    return false;
+    return (MFS_BIT_WORD_COUNT(block_count) - 1) / 64 + 1;
 }
 
-static uint32_t checksum_update(uint32_t hash, const uint8_t * data, int len)
+static uint64_t load_word(const uint8_t * bytes, int word_index)
 {
-    for(int i = 0; i < len; i++) {
-        hash ^= data[i];
-        hash *= 16777619u;
-    }
-    return hash;
+    uint64_t word;
+    memcpy(&word, bytes + word_index * 8, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
 }
 
-static int scan_file(const mfs_t * mfs, int * end_index_dst, int block_index, uint8_t * scratch_bit_buf)
+static void store_word(uint8_t * bytes, int word_index, uint64_t word)
 {
-    int res;
-    const mfs_conf_t * conf = mfs->conf;
-
-    memset(scratch_bit_buf, 0, MFS_BIT_BUF_SIZE_BYTES(conf->block_count));
-    uint32_t running_checksum = CHECKSUM_INIT_VAL;
-
-    int current_block_index = block_index;
-    while(1) {
-        res = conf->read_block(conf->cb_ctx, current_block_index, mfs->block_buf);
-        if(res) return res;
-        set_bit(scratch_bit_buf, current_block_index);
-        *end_index_dst = current_block_index;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(bytes + word_index * 8, &word, 8);
+}
 
-        int32_t unoccupied_data_bytes;
-        memcpy(&unoccupied_data_bytes, mfs->block_buf + (conf->block_size - 8), 4);
-        bool has_next_block = unoccupied_data_bytes < 0;
-        uint32_t next_block_or_target_checksum;
-        memcpy(&next_block_or_target_checksum, mfs->block_buf + (conf->block_size - 4), 4);
-        if(!has_next_block) {
-            running_checksum = checksum_update(running_checksum, mfs->block_buf, conf->block_size - 4);
-            if(running_checksum != next_block_or_target_checksum) {
-                *end_index_dst = -1;
-            }
-            return 0;
-        }
-        if(next_block_or_target_checksum >= conf->block_count
-            || get_bit(scratch_bit_buf, next_block_or_target_checksum)) {
-            *end_index_dst = -1;
-            return 0;
-        }
-        running_checksum = checksum_update(running_checksum, mfs->block_buf, conf->block_size);
-        current_block_index = next_block_or_target_checksum;
+/* of a word that is not 0 */
+static int lowest_bit(uint64_t word)
+{
+#ifdef __GNUC__
+    return __builtin_ctzll(word);
+#else
+    int i = 0;
+    while(!(word & 1)) {
+        word >>= 1;
+        i++;
     }
+    return i;
+#endif
 }
 
-static int mount_inner(mfs_t * mfs, int file_initial_idx)
+static int bit_count(uint64_t word)
 {
-    int res;
-    const mfs_conf_t * conf = mfs->conf;
+#ifdef __GNUC__
+    return __builtin_popcountll(word);
+#else
+    int count = 0;
+    for(; word; word &= word - 1) count++;
+    return count;
+#endif
+}
 
-    int file_end_idx_this;
-    res = scan_file(mfs, &file_end_idx_this, file_initial_idx, mfs->bit_bufs[SCRATCH_1]);
-    if(res) return res;
-    if(file_end_idx_this < 0
-        || and_any(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_1],
-            MFS_BIT_BUF_SIZE_BYTES(conf->block_count))) {
-        return 0;
-    }
+static uint8_t * summary_any(const uint8_t * bit_buf, int block_count)
+{
+    return (uint8_t *) bit_buf + MFS_BIT_WORD_COUNT(block_count) * 8;
+}
 
-    res = conf->read_block(conf->cb_ctx, file_initial_idx, mfs->block_buf);
-    if(res) return res;
+static uint8_t * summary_all(const uint8_t * bit_buf, int block_count)
+{
+    return summary_any(bit_buf, block_count) + summary_word_count(block_count) * 8;
+}
 
-    uint32_t birthday_this;
-    memcpy(&birthday_this, mfs->block_buf, 4);
+/* word `word_index` was changed */
+static void summary_update(uint8_t * bit_buf, int block_count, int word_index)
+{
+    uint64_t word = load_word(bit_buf, word_index);
+    uint64_t mask = (uint64_t) 1 << (word_index % 64);
+    uint8_t * any = summary_any(bit_buf, block_count);
+    uint8_t * all = summary_all(bit_buf, block_count);
+    uint64_t summary = load_word(any, word_index / 64);
+    store_word(any, word_index / 64, word ? summary | mask : summary & ~mask);
+    summary = load_word(all, word_index / 64);
+    store_word(all, word_index / 64, word == UINT64_MAX ? summary | mask : summary & ~mask);
+}
 
-    int32_t preferred_if_older;
-    memcpy(&preferred_if_older, mfs->block_buf + 4, 4);
-    if(preferred_if_older < 0) {
-        goto label_end_success;
+static void summary_rebuild(uint8_t * bit_buf, int block_count)
+{
+    memset(summary_any(bit_buf, block_count), 0, summary_word_count(block_count) * 16);
+    for(int i = 0; i < MFS_BIT_WORD_COUNT(block_count); i++) {
+        if(load_word(bit_buf, i)) summary_update(bit_buf, block_count, i);
     }
+}
 
-    int file_end_idx_other;
-    res = scan_file(mfs, &file_end_idx_other, preferred_if_older, mfs->bit_bufs[SCRATCH_2]);
-    if(res) return res;
-    if(file_end_idx_other < 0
-        || and_any(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_2],
-            MFS_BIT_BUF_SIZE_BYTES(conf->block_count))) {
-        goto label_end_success;
-    }
+static void bits_set(uint8_t * bit_buf, int block_count, unsigned bit_index)
+{
+    set_bit(bit_buf, bit_index);
+    summary_update(bit_buf, block_count, bit_index / 64);
+}
 
-    res = conf->read_block(conf->cb_ctx, preferred_if_older, mfs->block_buf);
-    if(res) return res;
+static void bits_clear(uint8_t * bit_buf, int block_count, unsigned bit_index)
+{
+    clear_bit(bit_buf, bit_index);
+    summary_update(bit_buf, block_count, bit_index / 64);
+}
 
-    uint32_t birthday_other;
-    memcpy(&birthday_other, mfs->block_buf, 4);
-    if(birthday_other <= birthday_this) {
-        return 0;
+/* clear a bit buffer, only touching its words that have bits set */
+static void bits_zero(uint8_t * bit_buf, int block_count)
+{
+    uint8_t * any = summary_any(bit_buf, block_count);
+    for(int i = 0; i < summary_word_count(block_count); i++) {
+        for(uint64_t summary = load_word(any, i); summary; summary &= summary - 1) {
+            store_word(bit_buf, i * 64 + lowest_bit(summary), 0);
+        }
     }
+    memset(any, 0, summary_word_count(block_count) * 16);
+}
 
-label_end_success:
-    if(birthday_this > mfs->youngest) mfs->youngest = birthday_this;
-    set_bit(mfs->bit_bufs[FILE_START_BLOCKS], file_initial_idx);
-    mfs->file_count += 1;
-    int bit_buf_len = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
-    for(int i = 0; i < bit_buf_len; i++) {
-        mfs->bit_bufs[OCCUPIED_BLOCKS][i] |= mfs->bit_bufs[SCRATCH_1][i];
+/* the first word from `word_index` on that has its summary bit set in
+   `summary`, or clear with `invert`. -1 if there is none */
+static int summary_next(const uint8_t * summary, int block_count, int word_index, bool invert)
+{
+    int word_count = MFS_BIT_WORD_COUNT(block_count);
+    for(int i = word_index / 64; i < summary_word_count(block_count); i++) {
+        uint64_t word = load_word(summary, i);
+        if(invert) word = ~word;
+        if(i == word_index / 64) word &= UINT64_MAX << (word_index % 64);
+        if(word) {
+            int found = i * 64 + lowest_bit(word);
+            return found < word_count ? found : -1;
+        }
     }
-    return 0;
+    return -1;
 }
 
-int mfs_mount(mfs_t * mfs, const mfs_conf_t * conf)
+/* the first set bit from `from` on, or -1 */
+static int bits_next_set(const uint8_t * bit_buf, int block_count, int from)
 {
-    int res;
-
-    if(conf->block_size < (4 + 4 + 1 + 1 + 4 + 4)
-       || conf->block_count < 1) {
-        return MFS_BAD_BLOCK_CONFIG_ERROR;
+    if(from >= block_count) return -1;
+    int word_index = from / 64;
+    uint64_t word = load_word(bit_buf, word_index) & (UINT64_MAX << (from % 64));
+    if(!word) {
+        word_index = summary_next(summary_any(bit_buf, block_count), block_count, word_index + 1, false);
+        if(word_index < 0) return -1;
+        word = load_word(bit_buf, word_index);
     }
+    return word_index * 64 + lowest_bit(word);
+}
 
-    int bit_buf_size = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
-
-    mfs->conf = conf;
-
-    mfs->block_buf = conf->aligned_aux_memory;
-    uint8_t * aux_mem_u8 = conf->aligned_aux_memory;
-    aux_mem_u8 += conf->block_size;
-    for(int i = 0; i < 4; i++) {
-        mfs->bit_bufs[i] = aux_mem_u8;
-        aux_mem_u8 += bit_buf_size;
+/* the first clear bit in [from, to), or -1 */
+static int bits_next_clear(const uint8_t * bit_buf, int block_count, int from, int to)
+{
+    if(from >= to) return -1;
+    int word_index = from / 64;
+    uint64_t word = ~load_word(bit_buf, word_index) & (UINT64_MAX << (from % 64));
+    if(!word) {
+        word_index = summary_next(summary_all(bit_buf, block_count), block_count, word_index + 1, true);
+        if(word_index < 0) return -1;
+        word = ~load_word(bit_buf, word_index);
     }
+    int i = word_index * 64 + lowest_bit(word);
+    return i < to ? i : -1;
+}
 
-    mfs->file_count = 0;
-    mfs->youngest = 0;
-    mfs->open_file_mode = -1;
-    mfs->needs_remount = false;
-
-    memset(mfs->bit_bufs[FILE_START_BLOCKS], 0, bit_buf_size);
-    memset(mfs->bit_bufs[OCCUPIED_BLOCKS], 0, bit_buf_size);
-
-    for(int file_initial_idx = 0; file_initial_idx < conf->block_count; file_initial_idx++) {
-        res = mount_inner(mfs, file_initial_idx);
-        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res); /* a convenience for internal callers */
+/* the first of at least `run` clear bits in a row from `from` on, or -1 */
+static int bits_clear_run(const uint8_t * bit_buf, int block_count, int from, int run)
+{
+    while(1) {
+        int start = bits_next_clear(bit_buf, block_count, from, block_count);
+        if(start < 0) return -1;
+        int end = bits_next_set(bit_buf, block_count, start);
+        if(end < 0) end = block_count;
+        if(end - start >= run) return start;
+        from = end;
     }
-
-    return 0;
 }
 
-int mfs_file_count(mfs_t * mfs)
+static int bits_count(const uint8_t * bit_buf, int block_count)
 {
-    int res;
+    int count = 0;
+    const uint8_t * any = summary_any(bit_buf, block_count);
+    for(int i = 0; i < summary_word_count(block_count); i++) {
+        for(uint64_t summary = load_word(any, i); summary; summary &= summary - 1) {
+            count += bit_count(load_word(bit_buf, i * 64 + lowest_bit(summary)));
+        }
+    }
+    return count;
+}
 
-    if(mfs->needs_remount) if((res = mfs_mount(mfs, mfs->conf))) return res;
+/* loop over the indexes of the words that may have bits set in both */
+#define FOR_EACH_WORD_SET_IN_BOTH(bit_buf_1, bit_buf_2, block_count, word_index) \
+    for(int summary_index_ = 0; summary_index_ < summary_word_count(block_count); summary_index_++) \
+        for(uint64_t summary_ = load_word(summary_any(bit_buf_1, block_count), summary_index_) \
+                                & load_word(summary_any(bit_buf_2, block_count), summary_index_); \
+            summary_ && ((word_index = summary_index_ * 64 + lowest_bit(summary_)), true); \
+            summary_ &= summary_ - 1)
 
-    if(mfs->open_file_mode != -1) {
-        if(mfs->open_file_mode == MFS_MODE_WRITE) mfs->needs_remount = true;
-        mfs->open_file_mode = -1;
-        return MFS_WRONG_MODE_ERROR;
+static bool bits_and_any(const uint8_t * bit_buf_1, const uint8_t * bit_buf_2, int block_count)
+{
+    int i;
+    FOR_EACH_WORD_SET_IN_BOTH(bit_buf_1, bit_buf_2, block_count, i) {
+        if(load_word(bit_buf_1, i) & load_word(bit_buf_2, i)) return true;
     }
-
-    return mfs->file_count;
+    return false;
 }
 
-int mfs_list_files(mfs_t * mfs, void * list_file_cb_ctx, void (*list_file_cb)(void *, const char *))
+static void bits_or(uint8_t * dst, const uint8_t * src, int block_count)
 {
-    int res;
-
-    if(mfs->needs_remount) if((res = mfs_mount(mfs, mfs->conf))) return res;
+    const uint8_t * any = summary_any(src, block_count);
+    for(int i = 0; i < summary_word_count(block_count); i++) {
+        for(uint64_t summary = load_word(any, i); summary; summary &= summary - 1) {
+            int word_index = i * 64 + lowest_bit(summary);
+            store_word(dst, word_index, load_word(dst, word_index) | load_word(src, word_index));
+            summary_update(dst, block_count, word_index);
+        }
+    }
+}
 
-    if(mfs->open_file_mode != -1) {
-        if(mfs->open_file_mode == MFS_MODE_WRITE) mfs->needs_remount = true;
-        mfs->open_file_mode = -1;
-        return MFS_WRONG_MODE_ERROR;
+/* free the blocks set in `bit_buf` */
+static void blocks_release(mfs_t * mfs, const uint8_t * bit_buf)
+{
+    int block_count = mfs->conf->block_count;
+    uint8_t * occupied = mfs->bit_bufs[OCCUPIED_BLOCKS];
+    int i;
+    FOR_EACH_WORD_SET_IN_BOTH(occupied, bit_buf, block_count, i) {
+        uint64_t word = load_word(occupied, i);
+        uint64_t freed = word & load_word(bit_buf, i);
+        if(!freed) continue;
+        store_word(occupied, i, word & ~freed);
+        summary_update(occupied, block_count, i);
+        mfs->free_block_count += bit_count(freed);
+        if(mfs->free_hint > i * 64) mfs->free_hint = i * 64;
     }
+}
 
-    const mfs_conf_t * conf = mfs->conf;
+/* the first block of a file from `from` on, or -1 */
+static int next_file_start(const mfs_t * mfs, int from)
+{
+    return bits_next_set(mfs->bit_bufs[FILE_START_BLOCKS], mfs->conf->block_count, from);
+}
 
-    int files_left = mfs->file_count;
-    for(int i = 0; files_left; i++) {
-        if(!get_bit(mfs->bit_bufs[FILE_START_BLOCKS], i)) {
-            continue;
+static bool file_is_open(const mfs_t * mfs, const mfs_file_t * file)
+{
+    bool found = false;
+    STATE_LOCK(mfs);
+    for(const mfs_file_t * open_file = mfs->open_files; open_file; open_file = open_file->next_open) {
+        if(open_file == file) {
+            found = true;
+            break;
         }
-        res = conf->read_block(conf->cb_ctx, i, mfs->block_buf);
-        if(res) return res;
-        list_file_cb(list_file_cb_ctx, (char *) mfs->block_buf + 8);
-        files_left--;
     }
+    STATE_UNLOCK(mfs);
+    return found;
+}
 
-    return 0;
+/* wait for the started writes of a file being written */
+static int file_write_join(const mfs_conf_t * conf, mfs_file_t * file)
+{
+    if(!conf->write_block_start) return 0;
+    while(file->writes_done != file->writes_started) conf->write_wait(conf->cb_ctx);
+    return file->write_error;
 }
 
-int mfs_delete(mfs_t * mfs, const char * name)
+static void file_forget(mfs_t * mfs, mfs_file_t * file)
 {
-    int res;
+    if(file->mode == MFS_MODE_WRITE) {
+        file_write_join(mfs->conf, file);
+        mfs->reserved_block_count -= file->reserved_blocks;
+        file->reserved_blocks = 0;
+    }
+    /* others look at the mode of open files */
+    STATE_LOCK(mfs);
+    file->mode = -1;
+    for(mfs_file_t ** link = &mfs->open_files; *link; link = &(*link)->next_open) {
+        if(*link == file) {
+            *link = file->next_open;
+            break;
+        }
+    }
+    STATE_UNLOCK(mfs);
+}
 
-    if(mfs->needs_remount) if((res = mfs_mount(mfs, mfs->conf))) return res;
+/* a name can be open for reading by many or for writing by one.
+   names are told apart by hash, so a collision is merely conservative */
+static bool name_busy(const mfs_t * mfs, uint32_t name_hash, bool writing)
+{
+    bool busy = false;
+    STATE_LOCK(mfs);
+    for(const mfs_file_t * open_file = mfs->open_files; open_file; open_file = open_file->next_open) {
+        if(open_file->name_hash == name_hash
+           && (writing || open_file->mode == MFS_MODE_WRITE)) {
+            busy = true;
+            break;
+        }
+    }
+    STATE_UNLOCK(mfs);
+    return busy;
+}
 
-    if(mfs->open_file_mode != -1) {
-        if(mfs->open_file_mode == MFS_MODE_WRITE) mfs->needs_remount = true;
-        mfs->open_file_mode = -1;
-        return MFS_WRONG_MODE_ERROR;
+static uint32_t checksum_update(uint32_t hash, const uint8_t * data, int len)
+{
+    for(int i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    const mfs_conf_t * conf = mfs->conf;
-    int i;
+/* process globals. set up once, through pthread_once with MFS_THREAD_SAFE */
+static uint32_t crc32c_table[8][256];
+static bool crc32c_ready;
+#ifdef CRC32C_X86
+static bool crc32c_have_hw;
+#endif
 
-    int name_len = strlen(name);
-    if(name_len > conf->block_size - (4 + 4 + 1 + 4 + 4)
-       || name_len < 1) {
-        return MFS_FILE_NAME_BAD_LEN_ERROR;
+static void crc32c_init(void)
+{
+    for(int i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for(int j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+        crc32c_table[0][i] = crc;
     }
-
-    int files_left = mfs->file_count;
-    for(i = 0; files_left; i++) {
-        if(!get_bit(mfs->bit_bufs[FILE_START_BLOCKS], i)) {
-            continue;
+    for(int i = 0; i < 256; i++) {
+        for(int j = 1; j < 8; j++) {
+            crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
         }
-        res = conf->read_block(conf->cb_ctx, i, mfs->block_buf);
-        if(res) return res;
+    }
+#ifdef CRC32C_X86
+    crc32c_have_hw = __builtin_cpu_supports("sse4.2");
+#endif
+    crc32c_ready = true;
+}
 
-        if(0 == strcmp(name, (char *) mfs->block_buf + 8)) {
-            break;
-        }
+#ifdef MFS_THREAD_SAFE
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#define CRC32C_INIT() pthread_once(&crc32c_once, crc32c_init)
+#else
+#define CRC32C_INIT() do {if(!crc32c_ready) crc32c_init();} while(0)
+#endif
 
-        files_left--;
+/* slicing-by-8 */
+static uint32_t crc32c_soft(uint32_t crc, const uint8_t * data, int len)
+{
+    for(; len >= 8; len -= 8, data += 8) {
+        crc ^= data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+        crc = crc32c_table[7][crc & 0xff] ^ crc32c_table[6][(crc >> 8) & 0xff]
+              ^ crc32c_table[5][(crc >> 16) & 0xff] ^ crc32c_table[4][crc >> 24]
+              ^ crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]]
+              ^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
     }
+    for(; len; len--) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data++) & 0xff];
+    return crc;
+}
 
-    if(!files_left) {
-        return MFS_FILE_NOT_FOUND_ERROR;
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * data, int len)
+{
+#ifdef __x86_64__
+    uint64_t crc_64 = crc;
+    for(; len >= 8; len -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc_64 = _mm_crc32_u64(crc_64, word);
     }
-    int delete_file_page_1 = i;
+    crc = crc_64;
+#endif
+    for(; len; len--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
 
-    clear_bit(mfs->bit_bufs[FILE_START_BLOCKS], delete_file_page_1);
+#ifdef CRC32C_ARM
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t * data, int len)
+{
+    for(; len >= 8; len -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for(; len; len--) crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#endif
 
-    uint32_t birthday;
-    memcpy(&birthday, mfs->block_buf, 4);
-    if(birthday == mfs->youngest) mfs->youngest--;
+static uint32_t crc32c_update(uint32_t crc, const uint8_t * data, int len)
+{
+    CRC32C_INIT();
+    crc = ~crc;
+#if defined(CRC32C_X86)
+    crc = crc32c_have_hw ? crc32c_hw(crc, data, len) : crc32c_soft(crc, data, len);
+#elif defined(CRC32C_ARM)
+    crc = crc32c_hw(crc, data, len);
+#else
+    crc = crc32c_soft(crc, data, len);
+#endif
+    return ~crc;
+}
 
-    int end_idx;
-    res = scan_file(mfs, &end_idx, delete_file_page_1, mfs->bit_bufs[SCRATCH_1]);
-    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-    if(end_idx < 0) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_INTERNAL_ASSERTION_ERROR);
+static bool prefer_is_crc32c(int32_t prefer_if_older)
+{
+    return ((uint32_t) prefer_if_older >> 30 & 1) != (uint32_t) prefer_if_older >> 31;
+}
 
-    int bit_buf_len = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
-    for(i = 0; i < bit_buf_len; i++) {
-        mfs->bit_bufs[OCCUPIED_BLOCKS][i] &= ~mfs->bit_bufs[SCRATCH_1][i];
-    }
+static bool prefer_is_segment(int32_t prefer_if_older)
+{
+    return ((uint32_t) prefer_if_older >> 29 & 1) != (uint32_t) prefer_if_older >> 31;
+}
 
-    /* clobber the first page */
-    memset(mfs->block_buf, 0xff, conf->block_size);
-    res = conf->write_block(conf->cb_ctx, delete_file_page_1, mfs->block_buf);
-    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-    res = conf->read_block(conf->cb_ctx, delete_file_page_1, mfs->block_buf);
-    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-    for(i = 0; i < conf->block_size; i++) {
-        if(mfs->block_buf[i] != 0xff) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
-    }
+static bool prefer_is_compressed(int32_t prefer_if_older)
+{
+    return ((uint32_t) prefer_if_older >> 28 & 1) != (uint32_t) prefer_if_older >> 31;
+}
 
-    mfs->file_count -= 1;
+static bool prefer_is_info(int32_t prefer_if_older)
+{
+    return ((uint32_t) prefer_if_older >> 27 & 1) != (uint32_t) prefer_if_older >> 31;
+}
 
-    return 0;
+static int32_t prefer_decode(int32_t prefer_if_older)
+{
+    int32_t decoded = prefer_if_older;
+    if(prefer_is_crc32c(prefer_if_older)) decoded ^= PREFER_CRC32C_BIT;
+    if(prefer_is_segment(prefer_if_older)) decoded ^= PREFER_SEGMENT_BIT;
+    if(prefer_is_compressed(prefer_if_older)) decoded ^= PREFER_COMPRESSED_BIT;
+    if(prefer_is_info(prefer_if_older)) decoded ^= PREFER_INFO_BIT;
+    return decoded;
 }
 
-int mfs_open(mfs_t * mfs, const char * name, mfs_mode_t mode)
+/* the checksum of a file's chain, chosen by its first block */
+static uint32_t chain_checksum_init(bool crc32c)
 {
-    int res;
+    return crc32c ? 0 : CHECKSUM_INIT_VAL;
+}
 
-    if(mfs->needs_remount) if((res = mfs_mount(mfs, mfs->conf))) return res;
+static uint32_t chain_checksum_update(const mfs_t * mfs, bool crc32c, uint32_t checksum, const uint8_t * data, int len)
+{
+    STATS_ADD(mfs, bytes_checksummed, len);
+    return crc32c ? crc32c_update(checksum, data, len) : checksum_update(checksum, data, len);
+}
 
-    if(mfs->open_file_mode != -1) {
-        if(mfs->open_file_mode == MFS_MODE_WRITE) mfs->needs_remount = true;
-        mfs->open_file_mode = -1;
-        return MFS_WRONG_MODE_ERROR;
-    }
+static bool header_crc32c(const uint8_t * block)
+{
+    int32_t prefer_if_older;
+    memcpy(&prefer_if_older, block + 4, 4);
+    return prefer_is_crc32c(prefer_if_older);
+}
 
-    const mfs_conf_t * conf = mfs->conf;
-    int i;
+static bool header_compressed(const uint8_t * block)
+{
+    int32_t prefer_if_older;
+    memcpy(&prefer_if_older, block + 4, 4);
+    return prefer_is_compressed(prefer_if_older);
+}
 
-    int name_len = strlen(name);
-    if(name_len > conf->block_size - (4 + 4 + 1 + 1 + 4 + 4)
-       || name_len < 1) {
-        return MFS_FILE_NAME_BAD_LEN_ERROR;
+#define TOKEN_MATCH 0x80
+#define TOKEN_MIN_MATCH 4
+#define TOKEN_MAX_LITERALS 127
+#define TOKEN_MAX_MATCH (127 + TOKEN_MIN_MATCH)
+
+/* the decoded bytes of the token below `*tokens` in a compressed block
+   whose literals so far end at `*literals`, moving both past it. 0 after
+   the last token, -1 for one that does not fit */
+static int token_decode(const uint8_t * block, int data_start, int * literals, int * tokens, int * src_dst)
+{
+    if(*tokens <= *literals || !block[*tokens - 1]) return 0;
+    int token = block[*tokens - 1];
+    if(token < TOKEN_MATCH) {
+        *src_dst = *literals;
+        *literals += token;
+        *tokens -= 1;
+        return *literals > *tokens ? -1 : token;
     }
+    if(*tokens - 3 < *literals) return -1;
+    int len = (token & ~TOKEN_MATCH) + TOKEN_MIN_MATCH;
+    *src_dst = *literals - (block[*tokens - 2] | block[*tokens - 3] << 8);
+    *tokens -= 3;
+    return *src_dst < data_start || *src_dst + len > *literals ? -1 : len;
+}
 
-    int files_left = mfs->file_count;
-    for(i = 0; files_left; i++) {
-        if(!get_bit(mfs->bit_bufs[FILE_START_BLOCKS], i)) {
-            continue;
-        }
-        res = conf->read_block(conf->cb_ctx, i, mfs->block_buf);
-        if(res) return res;
+/*
 
-        if(0 == strcmp(name, (char *) mfs->block_buf + 8)) {
-            break;
-        }
+Block cache
 
-        files_left--;
-    }
+Whole blocks read by block_get, least recently used replaced first.
+Writes go to the device and drop the cached copy, so what is read back
+to verify a write always comes from the device.
 
-    if(mode == MFS_MODE_READ) {
-        if(!files_left) {
-            return MFS_FILE_NOT_FOUND_ERROR;
-        }
+blocks : u8[block_size][block_cache_block_count]
+padding to a multiple of 4 : u8[]
+block index or -1 : i32[block_cache_block_count]
+last used : u32[block_cache_block_count]
+hits : u32
+misses : u32
+clock : u32
+
+*/
+
+static int32_t * cache_indexes(const mfs_conf_t * conf)
+{
+    int blocks_size = conf->block_size * conf->block_cache_block_count;
+    return (int32_t *) ((uint8_t *) conf->block_cache_memory + (blocks_size + 3) / 4 * 4);
+}
+
+static uint32_t * cache_last_used(const mfs_conf_t * conf)
+{
+    return (uint32_t *) (cache_indexes(conf) + conf->block_cache_block_count);
+}
+
+static uint32_t * cache_counters(const mfs_conf_t * conf)
+{
+    return cache_last_used(conf) + conf->block_cache_block_count;
+}
+
+static void cache_clear(const mfs_conf_t * conf)
+{
+    memset(cache_indexes(conf), 0xff, conf->block_cache_block_count * 4);
+    memset(cache_last_used(conf), 0, conf->block_cache_block_count * 4);
+}
+
+static void cache_drop(const mfs_conf_t * conf, int block_index, int block_count)
+{
+    if(!conf->block_cache_memory) return;
+    int32_t * indexes = cache_indexes(conf);
+    for(int i = 0; i < conf->block_cache_block_count; i++) {
+        if(indexes[i] >= block_index && indexes[i] < block_index + block_count) indexes[i] = -1;
     }
-    else {
-        mfs->open_file_match_index = files_left ? i : -1;
-        for(i = 0; i < conf->block_count; i++) {
-            if(!get_bit(mfs->bit_bufs[OCCUPIED_BLOCKS], i)) break;
-        }
-        if(i == conf->block_count) {
-            return MFS_NO_SPACE_ERROR;
-        }
-        set_bit(mfs->bit_bufs[OCCUPIED_BLOCKS], i);
-        set_bit(mfs->bit_bufs[FILE_START_BLOCKS], i);
-        if(mfs->youngest == UINT32_MAX) {
-            SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_BIRTHDAY_LIMIT_REACHED_ERROR);
+}
+
+/* the cached copy of a block, or NULL */
+static const uint8_t * cache_find(const mfs_conf_t * conf, int block_index)
+{
+    int32_t * indexes = cache_indexes(conf);
+    uint32_t * counters = cache_counters(conf);
+    for(int i = 0; i < conf->block_cache_block_count; i++) {
+        if(indexes[i] == block_index) {
+            cache_last_used(conf)[i] = ++counters[2];
+            counters[0] += 1;
+            return (uint8_t *) conf->block_cache_memory + i * conf->block_size;
         }
-        mfs->youngest += 1;
-        memcpy(mfs->block_buf, &mfs->youngest, 4);
-        memcpy(mfs->block_buf + 4, &mfs->open_file_match_index, 4);
-        strcpy((char *) mfs->block_buf + 8, name);
-        mfs->writer_checksum = checksum_update(CHECKSUM_INIT_VAL, mfs->block_buf, 8 + name_len + 1);
-        mfs->open_file_block = i;
-        mfs->open_file_first_block = i;
     }
+    counters[1] += 1;
+    return NULL;
+}
 
-    mfs->open_file_block_cursor = 8 + name_len + 1;
+static int cache_read(const mfs_conf_t * conf, int block_index, const uint8_t ** block_dst)
+{
+    int res;
+    int32_t * indexes = cache_indexes(conf);
+    uint32_t * last_used = cache_last_used(conf);
+
+    int victim = 0;
+    for(int i = 1; i < conf->block_cache_block_count && indexes[victim] != -1; i++) {
+        if(indexes[i] == -1 || last_used[i] < last_used[victim]) victim = i;
+    }
 
-    mfs->open_file_mode = mode;
+    uint8_t * block = (uint8_t *) conf->block_cache_memory + victim * conf->block_size;
+    indexes[victim] = -1;
+    res = conf->read_block(conf->cb_ctx, block_index, block);
+    if(res) return res;
+    indexes[victim] = block_index;
+    last_used[victim] = ++cache_counters(conf)[2];
+    *block_dst = block;
     return 0;
 }
 
-int mfs_read(mfs_t * mfs, uint8_t * dst, int size)
+/* a block's contents, mapped, cached or read into `block_buf` */
+static int block_get(const mfs_conf_t * conf, int block_index, uint8_t * block_buf, const uint8_t ** block_dst)
 {
-    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+    if(conf->map_block) {
+        *block_dst = conf->map_block(conf->cb_ctx, block_index);
+        return 0;
+    }
+    if(conf->block_cache_memory) {
+        *block_dst = cache_find(conf, block_index);
+        if(*block_dst) return 0;
+        return cache_read(conf, block_index, block_dst);
+    }
+    *block_dst = block_buf;
+    return conf->read_block(conf->cb_ctx, block_index, block_buf);
+}
 
-    if(mfs->open_file_mode != MFS_MODE_READ) {
-        if(mfs->open_file_mode == MFS_MODE_WRITE) mfs->needs_remount = true;
-        return MFS_WRONG_MODE_ERROR;
+/*
+
+Chain links
+
+The block that follows each block, so that the blocks of a file can be
+found without reading them. Noted from every trailer that is read anyway
+and by writers as they go. A committed file's blocks are never
+rewritten, so what is noted for them stays true.
+
+The last block of a chain can instead note the segment that goes on
+after the chain, flagged with CHAIN_SEGMENT. That is only noted while
+every link from the first block of the chain is known, so that whoever
+replaces the segment can find the note.
+
+next block, CHAIN_SEGMENT | segment, CHAIN_END or CHAIN_UNKNOWN : u32[block_count]
+
+*/
+
+#define CHAIN_SEGMENT 0x80000000u
+#define CHAIN_END (UINT32_MAX - 1)
+#define CHAIN_UNKNOWN UINT32_MAX
+
+static bool chain_is_segment(uint32_t next)
+{
+    return next >= CHAIN_SEGMENT && next < CHAIN_END;
+}
+
+/* readers note links as they go, alongside each other with MFS_THREAD_SAFE */
+static void chain_note(const mfs_conf_t * conf, int block_index, uint32_t next)
+{
+    if(!conf->chain_aux_memory) return;
+#ifdef MFS_THREAD_SAFE
+    __atomic_store_n((uint32_t *) conf->chain_aux_memory + block_index, next, __ATOMIC_RELAXED);
+#else
+    ((uint32_t *) conf->chain_aux_memory)[block_index] = next;
+#endif
+}
+
+static uint32_t chain_get(const mfs_conf_t * conf, int block_index)
+{
+#ifdef MFS_THREAD_SAFE
+    return __atomic_load_n((const uint32_t *) conf->chain_aux_memory + block_index, __ATOMIC_RELAXED);
+#else
+    return ((const uint32_t *) conf->chain_aux_memory)[block_index];
+#endif
+}
+
+static void chain_note_trailer(const mfs_conf_t * conf, int block_index, const uint8_t * trailer)
+{
+    int32_t unoccupied_data_bytes;
+    memcpy(&unoccupied_data_bytes, trailer, 4);
+    uint32_t next_block_index;
+    memcpy(&next_block_index, trailer + 4, 4);
+    if(unoccupied_data_bytes >= 0) {
+        if(conf->chain_aux_memory && chain_is_segment(chain_get(conf, block_index))) return;
+        chain_note(conf, block_index, CHAIN_END);
+    }
+    else if(next_block_index < (uint32_t) conf->block_count) chain_note(conf, block_index, next_block_index);
+}
+
+/* the last block of a chain when all of its links are known, otherwise -1 */
+static int chain_tail(const mfs_conf_t * conf, int block_index)
+{
+    if(!conf->chain_aux_memory) return -1;
+    for(int i = 0; i < conf->block_count; i++) {
+        uint32_t next = chain_get(conf, block_index);
+        if(next == CHAIN_UNKNOWN) return -1;
+        if(next == CHAIN_END || chain_is_segment(next)) return block_index;
+        block_index = next;
     }
+    return -1;
+}
 
+static int scan_file_untraced(const mfs_t * mfs, int * end_index_dst, int block_index, uint8_t * scratch_bit_buf,
+                              uint8_t * block_buf)
+{
     int res;
     const mfs_conf_t * conf = mfs->conf;
 
-    int total_read = 0;
+    bits_zero(scratch_bit_buf, conf->block_count);
+    bool crc32c = false;
+    uint32_t running_checksum = 0;
+
+    int current_block_index = block_index;
+    while(1) {
+        const uint8_t * block;
+        res = block_get(conf, current_block_index, block_buf, &block);
+        if(res) return res;
+        if(current_block_index == block_index) {
+            crc32c = header_crc32c(block);
+            running_checksum = chain_checksum_init(crc32c);
+        }
+        bits_set(scratch_bit_buf, conf->block_count, current_block_index);
+        *end_index_dst = current_block_index;
+        chain_note_trailer(conf, current_block_index, block + (conf->block_size - 8));
 
-    while(size) {
         int32_t unoccupied_data_bytes;
-        memcpy(&unoccupied_data_bytes, mfs->block_buf + (conf->block_size - 8), 4);
+        memcpy(&unoccupied_data_bytes, block + (conf->block_size - 8), 4);
         bool has_next_block = unoccupied_data_bytes < 0;
-        if(has_next_block) unoccupied_data_bytes = 0;
+        uint32_t next_block_or_target_checksum;
+        memcpy(&next_block_or_target_checksum, block + (conf->block_size - 4), 4);
+        if(!has_next_block) {
+            running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size - 4);
+            if(running_checksum != next_block_or_target_checksum) {
+                *end_index_dst = -1;
+            }
+            return 0;
+        }
+        if(next_block_or_target_checksum >= conf->block_count
+            || get_bit(scratch_bit_buf, next_block_or_target_checksum)) {
+            *end_index_dst = -1;
+            return 0;
+        }
+        running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size);
+        current_block_index = next_block_or_target_checksum;
+    }
+}
 
-        int block_len_remaining = conf->block_size - mfs->open_file_block_cursor - unoccupied_data_bytes - 8;
+static int scan_file(const mfs_t * mfs, int * end_index_dst, int block_index, uint8_t * scratch_bit_buf,
+                     uint8_t * block_buf)
+{
+    TRACE(mfs, MFS_TRACE_SCAN_FILE, MFS_TRACE_BEGIN, block_index, 0);
+    int res = scan_file_untraced(mfs, end_index_dst, block_index, scratch_bit_buf, block_buf);
+    TRACE(mfs, MFS_TRACE_SCAN_FILE, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
 
-        if(!block_len_remaining) {
-            if(!has_next_block) {
-                break;
-            }
+/* the header and name of a first block. only as far as the name goes
+   is read when the backend can read ranges */
+static int read_name(const mfs_conf_t * conf, int block_index, uint8_t * block_buf, const uint8_t ** block_dst)
+{
+    int res;
 
-            uint32_t new_block_idx;
-            memcpy(&new_block_idx, mfs->block_buf + (conf->block_size - 4), 4);
+    if(!conf->read_range || conf->map_block) return block_get(conf, block_index, block_buf, block_dst);
+    if(conf->block_cache_memory) {
+        *block_dst = cache_find(conf, block_index);
+        if(*block_dst) return 0;
+    }
+
+    *block_dst = block_buf;
 
-            res = conf->read_block(conf->cb_ctx, new_block_idx, mfs->block_buf);
-            if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, res);
+    int limit = conf->block_size - 8;
+    int have = 0;
+    int want = 8 + 32;
+    while(1) {
+        if(want > limit) want = limit;
+        res = conf->read_range(conf->cb_ctx, block_index, have, want - have, block_buf + have);
+        if(res) return res;
+        int name_have = have > 8 ? have : 8;
+        if(want == limit || memchr(block_buf + name_have, '\0', want - name_have)) return 0;
+        have = want;
+        want *= 2;
+    }
+}
 
-            mfs->open_file_block_cursor = 0;
+/* the blocks of a file known to be intact, into `scratch_bit_buf`. none are
+   read when the chain links are known. only the trailers are read when the
+   backend can read ranges */
+static int file_blocks(const mfs_t * mfs, int block_index, uint8_t * scratch_bit_buf, uint8_t * block_buf)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
 
-            memcpy(&unoccupied_data_bytes, mfs->block_buf + (conf->block_size - 8), 4);
-            if(unoccupied_data_bytes < 0) unoccupied_data_bytes = 0;
-            block_len_remaining = conf->block_size  - unoccupied_data_bytes - 8;
+    if(conf->chain_aux_memory) {
+        bits_zero(scratch_bit_buf, conf->block_count);
+        uint32_t current_block_index = block_index;
+        uint32_t next;
+        while((next = chain_get(conf, current_block_index)) != CHAIN_UNKNOWN) {
+            bits_set(scratch_bit_buf, conf->block_count, current_block_index);
+            if(next == CHAIN_END || chain_is_segment(next)) return 0;
+            current_block_index = next;
+            if(get_bit(scratch_bit_buf, current_block_index)) return MFS_INTERNAL_ASSERTION_ERROR;
         }
+    }
 
-        int copy_amount = block_len_remaining < size ? block_len_remaining : size;
+    if(!conf->read_range && !conf->map_block) {
+        int end_index;
+        res = scan_file(mfs, &end_index, block_index, scratch_bit_buf, block_buf);
+        if(res) return res;
+        return end_index < 0 ? MFS_INTERNAL_ASSERTION_ERROR : 0;
+    }
 
-        memcpy(dst, &mfs->block_buf[mfs->open_file_block_cursor], copy_amount);
+    bits_zero(scratch_bit_buf, conf->block_count);
+    while(1) {
+        bits_set(scratch_bit_buf, conf->block_count, block_index);
+        const uint8_t * trailer = block_buf + (conf->block_size - 8);
+        if(conf->map_block) {
+            trailer = (const uint8_t *) conf->map_block(conf->cb_ctx, block_index) + (conf->block_size - 8);
+        }
+        else {
+            res = conf->read_range(conf->cb_ctx, block_index, conf->block_size - 8, 8, block_buf + (conf->block_size - 8));
+            if(res) return res;
+        }
+        chain_note_trailer(conf, block_index, trailer);
+        int32_t unoccupied_data_bytes;
+        memcpy(&unoccupied_data_bytes, trailer, 4);
+        if(unoccupied_data_bytes >= 0) return 0;
+        uint32_t next_block_index;
+        memcpy(&next_block_index, trailer + 4, 4);
+        if(next_block_index >= (uint32_t) conf->block_count || get_bit(scratch_bit_buf, next_block_index)) {
+            return MFS_INTERNAL_ASSERTION_ERROR;
+        }
+        block_index = next_block_index;
+    }
+}
 
-        size -= copy_amount;
-        dst += copy_amount;
-        mfs->open_file_block_cursor += copy_amount;
-        total_read += copy_amount;
+/* the block after `block_index` in a chain known to be intact, or -1 after
+   its last block */
+static int chain_next(const mfs_conf_t * conf, int block_index, uint8_t * block_buf, int * next_dst)
+{
+    int res;
+
+    if(conf->chain_aux_memory) {
+        uint32_t next = chain_get(conf, block_index);
+        if(next == CHAIN_END || chain_is_segment(next)) {
+            *next_dst = -1;
+            return 0;
+        }
+        if(next != CHAIN_UNKNOWN) {
+            *next_dst = next;
+            return 0;
+        }
     }
 
-    return total_read;
+    const uint8_t * trailer;
+    if(conf->read_range && !conf->map_block) {
+        res = conf->read_range(conf->cb_ctx, block_index, conf->block_size - 8, 8, block_buf + (conf->block_size - 8));
+        if(res) return res;
+        trailer = block_buf + (conf->block_size - 8);
+    }
+    else {
+        const uint8_t * block;
+        res = block_get(conf, block_index, block_buf, &block);
+        if(res) return res;
+        trailer = block + (conf->block_size - 8);
+    }
+    chain_note_trailer(conf, block_index, trailer);
+    int32_t unoccupied_data_bytes;
+    memcpy(&unoccupied_data_bytes, trailer, 4);
+    uint32_t next_block_index;
+    memcpy(&next_block_index, trailer + 4, 4);
+    *next_dst = unoccupied_data_bytes < 0 ? (int) next_block_index : -1;
+    return 0;
 }
 
-int mfs_write(mfs_t * mfs, const uint8_t * src, int size)
+/* whether a chain known to be intact has at most APPEND_COPY_BLOCK_COUNT blocks */
+static int chain_is_short(const mfs_conf_t * conf, int block_index, uint8_t * block_buf, bool * short_dst)
 {
-    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+    int res;
 
-    if(mfs->open_file_mode != MFS_MODE_WRITE) {
-        SET_FILE_CLOSED_THEN_RETURN(mfs, MFS_WRONG_MODE_ERROR);
+    for(int i = 0; i < APPEND_COPY_BLOCK_COUNT; i++) {
+        res = chain_next(conf, block_index, block_buf, &block_index);
+        if(res) return res;
+        if(block_index < 0) {
+            *short_dst = true;
+            return 0;
+        }
     }
+    *short_dst = false;
+    return 0;
+}
 
-    int res;
-    const mfs_conf_t * conf = mfs->conf;
+/*
 
-    int write_size_left = size;
+Segments
 
-    while(write_size_left) {
-        int block_len_remaining = conf->block_size - mfs->open_file_block_cursor - 8;
+A file's segments are found from its first block by the chain link
+noted after the last block of each chain or, when that is not known,
+by reading the first blocks of all segments.
 
-        if(!block_len_remaining) {
-            uint32_t i;
-            for(i = 0; i < conf->block_count; i++) {
-                if(!get_bit(mfs->bit_bufs[OCCUPIED_BLOCKS], i)) break;
-            }
-            if(i == conf->block_count) {
-                SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_NO_SPACE_ERROR);
-            }
-            set_bit(mfs->bit_bufs[OCCUPIED_BLOCKS], i);
+*/
 
-            int32_t unoccupied_data_bytes = -1;
-            memcpy(mfs->block_buf + (conf->block_size - 8), &unoccupied_data_bytes, 4);
-            memcpy(mfs->block_buf + (conf->block_size - 4), &i, 4);
-            mfs->writer_checksum = checksum_update(mfs->writer_checksum, mfs->block_buf + (conf->block_size - 8), 8);
+/* the segment that goes on after the file or segment starting at
+   `block_index`, or -1 */
+static int segment_next(const mfs_t * mfs, int block_index, uint8_t * block_buf, int * next_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
 
-            res = conf->write_block(conf->cb_ctx, mfs->open_file_block, mfs->block_buf);
-            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    *next_dst = -1;
+    if(!get_bit(mfs->bit_bufs[CONTINUED_BLOCKS], block_index)) return 0;
 
-            mfs->open_file_block_cursor = 0;
-            mfs->open_file_block = i;
-            block_len_remaining = conf->block_size - 8;
+    int tail = chain_tail(conf, block_index);
+    if(tail >= 0) {
+        uint32_t next = chain_get(conf, tail);
+        if(chain_is_segment(next)) {
+            *next_dst = next & ~CHAIN_SEGMENT;
+            return 0;
         }
+    }
 
-        int copy_amount = block_len_remaining < write_size_left ? block_len_remaining : write_size_left;
+    const uint8_t * segment_start = mfs->bit_bufs[SEGMENT_START_BLOCKS];
+    for(int i = bits_next_set(segment_start, conf->block_count, 0); i >= 0;
+        i = bits_next_set(segment_start, conf->block_count, i + 1)) {
+        const uint8_t * block;
+        res = read_name(conf, i, block_buf, &block);
+        if(res) return res;
+        int32_t prefer_if_older;
+        memcpy(&prefer_if_older, block + 4, 4);
+        if(prefer_decode(prefer_if_older) == block_index) {
+            *next_dst = i;
+            if(tail >= 0) chain_note(conf, tail, CHAIN_SEGMENT | i);
+            return 0;
+        }
+    }
+    return MFS_INTERNAL_ASSERTION_ERROR;
+}
+
+/* the last segment of the file `name` starting at `block_index`, or the
+   file itself, and the file or segment it goes on after, or -1 */
+static int segment_last(const mfs_t * mfs, int block_index, const char * name, uint8_t * block_buf,
+                        int * last_dst, int * continued_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    const uint8_t * continued = mfs->bit_bufs[CONTINUED_BLOCKS];
 
-        mfs->writer_checksum = checksum_update(mfs->writer_checksum, src, copy_amount);
-        memcpy(mfs->block_buf + mfs->open_file_block_cursor, src, copy_amount);
+    *last_dst = block_index;
+    *continued_dst = -1;
+    if(!get_bit(continued, block_index)) return 0;
 
-        write_size_left -= copy_amount;
-        src += copy_amount;
-        mfs->open_file_block_cursor += copy_amount;
+    /* segments have the name of their file, so one pass finds the last */
+    if(!conf->chain_aux_memory) {
+        const uint8_t * segment_start = mfs->bit_bufs[SEGMENT_START_BLOCKS];
+        for(int i = bits_next_set(segment_start, conf->block_count, 0); i >= 0;
+            i = bits_next_set(segment_start, conf->block_count, i + 1)) {
+            if(get_bit(continued, i)) continue;
+            const uint8_t * block;
+            res = read_name(conf, i, block_buf, &block);
+            if(res) return res;
+            if(strcmp(name, (const char *) block + 8)) continue;
+            int32_t prefer_if_older;
+            memcpy(&prefer_if_older, block + 4, 4);
+            *last_dst = i;
+            *continued_dst = prefer_decode(prefer_if_older);
+            return 0;
+        }
+        return MFS_INTERNAL_ASSERTION_ERROR;
     }
 
-    return size;
+    while(get_bit(continued, *last_dst)) {
+        int next;
+        res = segment_next(mfs, *last_dst, block_buf, &next);
+        if(res) return res;
+        *continued_dst = *last_dst;
+        *last_dst = next;
+    }
+    return 0;
 }
 
-int mfs_close(mfs_t * mfs)
+/* free the segments of the file starting at `block_index` */
+static int segments_release(mfs_t * mfs, int block_index, uint8_t * block_buf)
 {
-    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
 
-    if(mfs->open_file_mode == -1) {
-        return MFS_WRONG_MODE_ERROR;
+    while(1) {
+        int next;
+        res = segment_next(mfs, block_index, block_buf, &next);
+        if(res) return res;
+        bits_clear(mfs->bit_bufs[CONTINUED_BLOCKS], conf->block_count, block_index);
+        if(next < 0) return 0;
+        bits_clear(mfs->bit_bufs[SEGMENT_START_BLOCKS], conf->block_count, next);
+        res = file_blocks(mfs, next, mfs->bit_bufs[SCRATCH_1], block_buf);
+        if(res) return res;
+        blocks_release(mfs, mfs->bit_bufs[SCRATCH_1]);
+        block_index = next;
     }
+}
+
+/*
+
+File info
+
+The size and CRC32C of the contents of each file, by its first block,
+when file_info_aux_memory is given. Found the first time they are asked
+for, then kept by whoever writes the file. Mount forgets them. Files
+written with file_info_aux_memory keep them in their final block too,
+which is read alone when chain_aux_memory knows where it is. Otherwise
+the whole file is read.
 
+size or FILE_INFO_UNKNOWN, checksum : u32[block_count][2]
+
+*/
+
+#define FILE_INFO_UNKNOWN UINT32_MAX
+
+static uint32_t * file_info_slot(const mfs_conf_t * conf, int block_index)
+{
+    if(!conf->file_info_aux_memory) return NULL;
+    return (uint32_t *) conf->file_info_aux_memory + block_index * 2;
+}
+
+/* the info kept in the final block of the intact file starting at
+   `block_index`. `*found_dst` is false when there is none or the links
+   to that block are not all known */
+static int file_info_stored(mfs_t * mfs, int block_index, uint8_t * block_buf, mfs_file_info_t * info_dst, bool * found_dst)
+{
     int res;
     const mfs_conf_t * conf = mfs->conf;
 
-    if(mfs->open_file_mode == MFS_MODE_WRITE) {
-        int32_t unoccupied_data_bytes = conf->block_size - mfs->open_file_block_cursor - 8;
-        memset(mfs->block_buf + mfs->open_file_block_cursor, 0xff, unoccupied_data_bytes);
-        memcpy(mfs->block_buf + (conf->block_size - 8), &unoccupied_data_bytes, 4);
-        mfs->writer_checksum = checksum_update(mfs->writer_checksum, mfs->block_buf + mfs->open_file_block_cursor, unoccupied_data_bytes + 4);
-        memcpy(mfs->block_buf + (conf->block_size - 4), &mfs->writer_checksum, 4);
+    *found_dst = false;
+    int segment = block_index;
+    int tail = chain_tail(conf, segment);
+    while(tail >= 0 && get_bit(mfs->bit_bufs[CONTINUED_BLOCKS], segment)) {
+        uint32_t next = chain_get(conf, tail);
+        if(!chain_is_segment(next)) return 0;
+        segment = next & ~CHAIN_SEGMENT;
+        tail = chain_tail(conf, segment);
+    }
+    if(tail < 0) return 0;
 
-        res = conf->write_block(conf->cb_ctx, mfs->open_file_block, mfs->block_buf);
-        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    STATS_PURPOSE(mfs, MFS_IO_LOOKUP);
+    const uint8_t * block;
+    res = block_get(conf, segment, block_buf, &block);
+    if(res) return res;
+    int32_t prefer_if_older;
+    memcpy(&prefer_if_older, block + 4, 4);
+    if(!prefer_is_info(prefer_if_older)) return 0;
+    if(tail != segment) {
+        res = block_get(conf, tail, block_buf, &block);
+        if(res) return res;
+    }
+    int32_t unoccupied_data_bytes;
+    memcpy(&unoccupied_data_bytes, block + (conf->block_size - 8), 4);
+    uint32_t info[2];
+    memcpy(info, block + (conf->block_size - 16), 8);
+    if(unoccupied_data_bytes < 8 || info[0] == FILE_INFO_UNKNOWN) return 0;
 
-        int end_index;
-        res = scan_file(mfs, &end_index, mfs->open_file_first_block, mfs->bit_bufs[SCRATCH_1]);
-        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-        if(end_index < 0) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
+    info_dst->size = info[0];
+    info_dst->checksum = info[1];
+    *found_dst = true;
+    return 0;
+}
 
-        if(mfs->open_file_match_index != -1) {
-            clear_bit(mfs->bit_bufs[FILE_START_BLOCKS], mfs->open_file_match_index);
+/* the info of the intact file starting at `block_index`. its blocks and
+   those of its segments are read when it is not known */
+static int file_info_get(mfs_t * mfs, int block_index, uint8_t * block_buf, mfs_file_info_t * info_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
 
-            res = scan_file(mfs, &end_index, mfs->open_file_match_index, mfs->bit_bufs[SCRATCH_1]);
-            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-            if(end_index < 0) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_INTERNAL_ASSERTION_ERROR);
+    uint32_t * slot = file_info_slot(conf, block_index);
+    if(slot && slot[0] != FILE_INFO_UNKNOWN) {
+        info_dst->size = slot[0];
+        info_dst->checksum = slot[1];
+        return 0;
+    }
 
-            int bit_buf_len = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
-            for(int i = 0; i < bit_buf_len; i++) {
-                mfs->bit_bufs[OCCUPIED_BLOCKS][i] &= ~mfs->bit_bufs[SCRATCH_1][i];
-            }
+    bool found;
+    res = file_info_stored(mfs, block_index, block_buf, info_dst, &found);
+    if(res) return res;
+    if(found) {
+        if(slot) {
+            slot[0] = info_dst->size;
+            slot[1] = info_dst->checksum;
+        }
+        return 0;
+    }
 
-            /* clobber the first page */
-            memset(mfs->block_buf, 0xff, conf->block_size);
-            res = conf->write_block(conf->cb_ctx, mfs->open_file_match_index, mfs->block_buf);
-            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-            res = conf->read_block(conf->cb_ctx, mfs->open_file_match_index, mfs->block_buf);
-            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
-            for(int i = 0; i < conf->block_size; i++) {
-                if(mfs->block_buf[i] != 0xff) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
+    STATS_PURPOSE(mfs, MFS_IO_DATA);
+    int size = 0;
+    uint32_t checksum = 0;
+    int segment = block_index;
+    while(segment >= 0) {
+        int current_block_index = segment;
+        const uint8_t * block;
+        res = block_get(conf, current_block_index, block_buf, &block);
+        if(res) return res;
+        bool compressed = header_compressed(block);
+        int data_start = 8 + strlen((const char *) block + 8) + 1;
+        while(1) {
+            chain_note_trailer(conf, current_block_index, block + (conf->block_size - 8));
+            int32_t unoccupied_data_bytes;
+            memcpy(&unoccupied_data_bytes, block + (conf->block_size - 8), 4);
+            uint32_t next_block_index;
+            memcpy(&next_block_index, block + (conf->block_size - 4), 4);
+            int data_end = conf->block_size - 8 - (unoccupied_data_bytes < 0 ? 0 : unoccupied_data_bytes);
+            if(compressed) {
+                int literals = data_start;
+                int tokens = data_end;
+                while(1) {
+                    int src;
+                    int len = token_decode(block, data_start, &literals, &tokens, &src);
+                    if(len < 0) return MFS_INTERNAL_ASSERTION_ERROR;
+                    if(!len) break;
+                    checksum = crc32c_update(checksum, block + src, len);
+                    size += len;
+                }
             }
+            else {
+                checksum = crc32c_update(checksum, block + data_start, data_end - data_start);
+                size += data_end - data_start;
+            }
+            if(unoccupied_data_bytes >= 0) break;
+            if(next_block_index >= (uint32_t) conf->block_count) return MFS_INTERNAL_ASSERTION_ERROR;
+            current_block_index = next_block_index;
+            res = block_get(conf, current_block_index, block_buf, &block);
+            if(res) return res;
+            data_start = 0;
         }
-        else {
-            mfs->file_count += 1;
-        }
+        res = segment_next(mfs, segment, block_buf, &segment);
+        if(res) return res;
     }
 
-    mfs->open_file_mode = -1;
-
+    info_dst->size = size;
+    info_dst->checksum = checksum;
+    if(slot) {
+        slot[0] = size;
+        slot[1] = checksum;
+    }
     return 0;
 }
 
+/*
+
+Name index
+
+A hash table from name hash to file start block, chained through the
+file start blocks. It is filled at mount from the blocks that were
+read anyway or, after a checkpoint mount, on the first lookup.
+
+bucket heads : u32[block_count]
+next in bucket : u32[block_count]
+name hashes : u32[block_count]
+
+*/
+
+#define INDEX_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t * buckets;
+    uint32_t * nexts;
+    uint32_t * hashes;
+} name_index_t;
+
+static void name_index_get(const mfs_t * mfs, name_index_t * index)
+{
+    const mfs_conf_t * conf = mfs->conf;
+
+    index->buckets = conf->name_index_aux_memory;
+    index->nexts = index->buckets + conf->block_count;
+    index->hashes = index->nexts + conf->block_count;
+}
+
+static uint32_t name_hash(const mfs_conf_t * conf, const uint8_t * first_block)
+{
+    const uint8_t * name = first_block + 8;
+    /* no further than the name field can go */
+    int name_len = 0;
+    while(name_len < conf->block_size - (8 + 8) && name[name_len]) name_len++;
+    return checksum_update(CHECKSUM_INIT_VAL, name, name_len);
+}
+
+/* remember the name hash of a block read at mount */
+static void name_index_note(const mfs_t * mfs, int block_index, const uint8_t * first_block)
+{
+    if(!mfs->conf->name_index_aux_memory) return;
+    name_index_t index;
+    name_index_get(mfs, &index);
+    index.hashes[block_index] = name_hash(mfs->conf, first_block);
+}
+
+static void name_index_insert(mfs_t * mfs, int block_index, uint32_t hash)
+{
+    if(!mfs->name_index_ready) return;
+    name_index_t index;
+    name_index_get(mfs, &index);
+    uint32_t * bucket = &index.buckets[hash % mfs->conf->block_count];
+    index.hashes[block_index] = hash;
+    index.nexts[block_index] = *bucket;
+    *bucket = block_index;
+}
+
+static void name_index_remove(mfs_t * mfs, int block_index)
+{
+    if(!mfs->name_index_ready) return;
+    name_index_t index;
+    name_index_get(mfs, &index);
+    uint32_t * link = &index.buckets[index.hashes[block_index] % mfs->conf->block_count];
+    while(*link != (uint32_t) block_index) {
+        if(*link == INDEX_NONE) return;
+        link = &index.nexts[*link];
+    }
+    *link = index.nexts[block_index];
+}
+
+/* from the hashes noted at mount, or by reading every file start */
+static int name_index_build(mfs_t * mfs, uint8_t * block_buf, bool hashes_noted)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    if(!conf->name_index_aux_memory) return 0;
+    name_index_t index;
+    name_index_get(mfs, &index);
+
+    for(int i = 0; i < conf->block_count; i++) {
+        index.buckets[i] = INDEX_NONE;
+    }
+    mfs->name_index_ready = true;
+
+    for(int i = next_file_start(mfs, 0); i >= 0; i = next_file_start(mfs, i + 1)) {
+        if(!hashes_noted) {
+            const uint8_t * block;
+            res = read_name(conf, i, block_buf, &block);
+            if(res) {
+                mfs->name_index_ready = false;
+                return res;
+            }
+            index.hashes[i] = name_hash(conf, block);
+        }
+        name_index_insert(mfs, i, index.hashes[i]);
+    }
+
+    return 0;
+}
+
+/* find the file called `name` and get its first block, in `block_buf`
+   unless it is mapped. -1 if there is none */
+static int find_file(mfs_t * mfs, const char * name, uint8_t * block_buf, int * index_dst,
+                     const uint8_t ** block_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    const uint8_t * block;
+    bool whole_blocks = !conf->read_range || conf->map_block;
+
+    STATS_PURPOSE(mfs, MFS_IO_LOOKUP);
+
+    *index_dst = -1;
+
+    if(!conf->name_index_aux_memory) {
+        for(int i = next_file_start(mfs, 0); i >= 0; i = next_file_start(mfs, i + 1)) {
+            res = read_name(conf, i, block_buf, &block);
+            if(res) return res;
+
+            if(0 == strcmp(name, (const char *) block + 8)) {
+                *index_dst = i;
+                *block_dst = block;
+                if(whole_blocks) return 0;
+                return block_get(conf, i, block_buf, block_dst);
+            }
+        }
+        return 0;
+    }
+
+    if(!mfs->name_index_ready) {
+        res = name_index_build(mfs, block_buf, false);
+        if(res) return res;
+    }
+
+    name_index_t index;
+    name_index_get(mfs, &index);
+    uint32_t hash = checksum_update(CHECKSUM_INIT_VAL, (const uint8_t *) name, strlen(name));
+
+    /* the lowest matching block, like the plain search finds */
+    uint32_t found = INDEX_NONE;
+    uint32_t last_read = INDEX_NONE;
+    for(uint32_t i = index.buckets[hash % conf->block_count]; i != INDEX_NONE; i = index.nexts[i]) {
+        if(index.hashes[i] != hash || i >= found) continue;
+        res = read_name(conf, i, block_buf, &block);
+        if(res) return res;
+        last_read = i;
+        if(0 == strcmp(name, (const char *) block + 8)) found = i;
+    }
+    if(found == INDEX_NONE) return 0;
+
+    *index_dst = found;
+    *block_dst = block;
+    if(last_read == found && whole_blocks) return 0;
+    return block_get(conf, found, block_buf, block_dst);
+}
+
+static int mount_inner(mfs_t * mfs, int file_initial_idx)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    int file_end_idx_this;
+    res = scan_file(mfs, &file_end_idx_this, file_initial_idx, mfs->bit_bufs[SCRATCH_1], mfs->block_buf);
+    if(res) return res;
+    if(file_end_idx_this < 0) return 0;
+
+    const uint8_t * block;
+    res = block_get(conf, file_initial_idx, mfs->block_buf, &block);
+    if(res) return res;
+
+    uint32_t birthday_this;
+    memcpy(&birthday_this, block, 4);
+    int32_t preferred_if_older;
+    memcpy(&preferred_if_older, block + 4, 4);
+
+    /* segments are settled once all files are. any intact one is younger
+       than the blocks it could be mistaken to go on after */
+    if(prefer_is_segment(preferred_if_older)) {
+        if(birthday_this > mfs->youngest) mfs->youngest = birthday_this;
+        bits_set(mfs->bit_bufs[SEGMENT_START_BLOCKS], conf->block_count, file_initial_idx);
+        return 0;
+    }
+
+    if(bits_and_any(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_1], conf->block_count)) return 0;
+
+    name_index_note(mfs, file_initial_idx, block);
+    preferred_if_older = prefer_decode(preferred_if_older);
+    if(preferred_if_older < 0) {
+        goto label_end_success;
+    }
+
+    int file_end_idx_other;
+    res = scan_file(mfs, &file_end_idx_other, preferred_if_older, mfs->bit_bufs[SCRATCH_2], mfs->block_buf);
+    if(res) return res;
+    if(file_end_idx_other < 0
+        || bits_and_any(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_2], conf->block_count)) {
+        goto label_end_success;
+    }
+
+    res = block_get(conf, preferred_if_older, mfs->block_buf, &block);
+    if(res) return res;
+
+    uint32_t birthday_other;
+    memcpy(&birthday_other, block, 4);
+    if(birthday_other <= birthday_this) {
+        return 0;
+    }
+
+label_end_success:
+    if(birthday_this > mfs->youngest) mfs->youngest = birthday_this;
+    bits_set(mfs->bit_bufs[FILE_START_BLOCKS], conf->block_count, file_initial_idx);
+    mfs->file_count += 1;
+    bits_or(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_1], conf->block_count);
+    return 0;
+}
+
+/* settle a candidate segment from `candidates`, a bit buffer of the intact
+   segments not yet settled. `*taken_dst` is set when it is taken */
+static int mount_segment(mfs_t * mfs, int segment_initial_idx, uint8_t * candidates, bool * taken_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * segment_start = mfs->bit_bufs[SEGMENT_START_BLOCKS];
+
+    const uint8_t * block;
+    res = block_get(conf, segment_initial_idx, mfs->block_buf, &block);
+    if(res) return res;
+    uint32_t birthday_this;
+    memcpy(&birthday_this, block, 4);
+    int32_t continued;
+    memcpy(&continued, block + 4, 4);
+    continued = prefer_decode(continued);
+
+    if(continued < 0 || continued >= conf->block_count) goto label_end_dead;
+    /* it may yet go on after a segment that is settled later */
+    if(!get_bit(mfs->bit_bufs[FILE_START_BLOCKS], continued) && !get_bit(segment_start, continued)) return 0;
+
+    res = block_get(conf, continued, mfs->block_buf, &block);
+    if(res) return res;
+    uint32_t birthday_continued;
+    memcpy(&birthday_continued, block, 4);
+    if(birthday_this <= birthday_continued) goto label_end_dead;
+
+    res = file_blocks(mfs, segment_initial_idx, mfs->bit_bufs[SCRATCH_1], mfs->block_buf);
+    if(res) return res;
+    if(bits_and_any(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_1], conf->block_count)) {
+        goto label_end_dead;
+    }
+
+    /* the youngest segment after a block counts */
+    if(get_bit(mfs->bit_bufs[CONTINUED_BLOCKS], continued)) {
+        int other;
+        for(other = bits_next_set(segment_start, conf->block_count, 0); other >= 0;
+            other = bits_next_set(segment_start, conf->block_count, other + 1)) {
+            res = block_get(conf, other, mfs->block_buf, &block);
+            if(res) return res;
+            int32_t other_continued;
+            memcpy(&other_continued, block + 4, 4);
+            if(prefer_decode(other_continued) == continued) break;
+        }
+        if(other < 0) return MFS_INTERNAL_ASSERTION_ERROR;
+        uint32_t birthday_other;
+        memcpy(&birthday_other, block, 4);
+        if(birthday_other >= birthday_this || get_bit(mfs->bit_bufs[CONTINUED_BLOCKS], other)) goto label_end_dead;
+
+        bits_clear(segment_start, conf->block_count, other);
+        for(int i = other; i >= 0; ) {
+            bits_clear(mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, i);
+            res = chain_next(conf, i, mfs->block_buf, &i);
+            if(res) return res;
+        }
+    }
+
+    bits_set(segment_start, conf->block_count, segment_initial_idx);
+    bits_set(mfs->bit_bufs[CONTINUED_BLOCKS], conf->block_count, continued);
+    bits_or(mfs->bit_bufs[OCCUPIED_BLOCKS], mfs->bit_bufs[SCRATCH_1], conf->block_count);
+    *taken_dst = true;
+
+label_end_dead:
+    bits_clear(candidates, conf->block_count, segment_initial_idx);
+    return 0;
+}
+
+/* the intact segments found by `mount_inner` are taken in passes, since a
+   segment can only be taken after what it goes on after */
+static int mount_segments(mfs_t * mfs)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * candidates = mfs->bit_bufs[SCRATCH_2];
+
+    memcpy(candidates, mfs->bit_bufs[SEGMENT_START_BLOCKS], MFS_BIT_BUF_STRIDE(conf->block_count));
+    bits_zero(mfs->bit_bufs[SEGMENT_START_BLOCKS], conf->block_count);
+
+    bool taken = true;
+    while(taken) {
+        taken = false;
+        for(int i = bits_next_set(candidates, conf->block_count, 0); i >= 0;
+            i = bits_next_set(candidates, conf->block_count, i + 1)) {
+            res = mount_segment(mfs, i, candidates, &taken);
+            if(res) return res;
+        }
+    }
+    return 0;
+}
+
+/*
+
+Single pass mount
+
+Every block is read once, in chain order where possible, recording
+its next index (links), and its header fields in case it is a file
+start. A chain is checksummed while it is walked from its first block.
+A walk that runs into the chain of an earlier walk either inherits its
+structural outcome or, when the earlier walk's checksum did not match,
+re-reads that chain to finish its own checksum. Blocks in the middle of
+a failed walk that look like file starts are checksummed the same way.
+Files written with the first-free allocator never need either re-read.
+Finally the file starts are resolved in block order exactly like
+`mount_inner` does, and the segments like `mount_segments` does, by
+following the links instead of reading.
+
+With MFS_FLAG_LAZY_VERIFY nothing is checksummed. Every block that
+looks like a file start and whose chain ends properly is a candidate.
+Only candidates whose chains share blocks with other candidates are
+checksummed, since the resolution order could otherwise let a broken
+chain displace a good one. The others are accepted unverified and are
+checksummed when first opened.
+
+*/
+
+#define LINK_END UINT32_MAX
+
+enum {
+    MOUNT_VISITED,
+    MOUNT_WALK,
+    MOUNT_GOOD,
+    MOUNT_BAD,
+    MOUNT_VALID,
+    MOUNT_MAY_START,
+    MOUNT_UNVERIFIED, /* outlives the mount */
+    MOUNT_BIT_BUF_COUNT
+};
+
+typedef struct {
+    uint32_t * links;
+    uint32_t * birthdays;
+    int32_t * prefer_if_olders;
+    uint8_t * bit_bufs[MOUNT_BIT_BUF_COUNT];
+    int staged_first;
+    int staged_count;
+} mount_graph_t;
+
+static void mount_graph_get(const mfs_t * mfs, mount_graph_t * graph)
+{
+    const mfs_conf_t * conf = mfs->conf;
+
+    graph->links = conf->mount_aux_memory;
+    graph->birthdays = graph->links + conf->block_count;
+    graph->prefer_if_olders = (int32_t *) (graph->birthdays + conf->block_count);
+    uint8_t * aux_mem_u8 = (uint8_t *) (graph->prefer_if_olders + conf->block_count);
+    for(int i = 0; i < MOUNT_BIT_BUF_COUNT; i++) {
+        graph->bit_bufs[i] = aux_mem_u8;
+        aux_mem_u8 += MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
+    }
+    graph->staged_count = 0;
+}
+
+/* get a block, through the staging memory when the backend can read
+   runs. with `structure_only`, the contents between the name and the
+   trailer may be left out */
+static int mount_read_block(const mfs_t * mfs, mount_graph_t * graph, uint32_t block_index, bool structure_only,
+                            const uint8_t ** block_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    if(conf->map_block || !conf->read_blocks || !conf->aligned_staging_memory) {
+        if(!structure_only || !conf->read_range || conf->map_block) {
+            return block_get(conf, block_index, mfs->block_buf, block_dst);
+        }
+        res = read_name(conf, block_index, mfs->block_buf, block_dst);
+        if(res) return res;
+        return conf->read_range(conf->cb_ctx, block_index, conf->block_size - 8, 8,
+                                mfs->block_buf + (conf->block_size - 8));
+    }
+
+    if((int) block_index < graph->staged_first
+       || (int) block_index >= graph->staged_first + graph->staged_count) {
+        int count = conf->block_count - block_index;
+        if(count > conf->staging_block_count) count = conf->staging_block_count;
+        res = conf->read_blocks(conf->cb_ctx, block_index, count, conf->aligned_staging_memory);
+        if(res) return res;
+        graph->staged_first = block_index;
+        graph->staged_count = count;
+    }
+    *block_dst = (const uint8_t *) conf->aligned_staging_memory + (block_index - graph->staged_first) * conf->block_size;
+    return 0;
+}
+
+static bool block_may_be_file_start(const mfs_conf_t * conf, const uint8_t * block)
+{
+    int32_t prefer_if_older;
+    memcpy(&prefer_if_older, block + 4, 4);
+    prefer_if_older = prefer_decode(prefer_if_older);
+    if(prefer_if_older < -1 || prefer_if_older >= conf->block_count) return false;
+    if(block[8] == '\0') return false;
+    return memchr(block + 9, '\0', conf->block_size - (9 + 8)) != NULL;
+}
+
+static int rescan_chain(const mfs_t * mfs, mount_graph_t * graph, bool crc32c, uint32_t running_checksum,
+                        uint32_t block_index, bool * valid_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    while(1) {
+        const uint8_t * block;
+        res = mount_read_block(mfs, graph, block_index, false, &block);
+        if(res) return res;
+        if(graph->links[block_index] == LINK_END) {
+            uint32_t target_checksum;
+            memcpy(&target_checksum, block + (conf->block_size - 4), 4);
+            running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size - 4);
+            *valid_dst = running_checksum == target_checksum;
+            return 0;
+        }
+        running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size);
+        block_index = graph->links[block_index];
+    }
+}
+
+static void mark_chain_good(const mount_graph_t * graph, uint32_t block_index)
+{
+    while(!get_bit(graph->bit_bufs[MOUNT_GOOD], block_index)) {
+        set_bit(graph->bit_bufs[MOUNT_GOOD], block_index);
+        if(graph->links[block_index] == LINK_END) break;
+        block_index = graph->links[block_index];
+    }
+}
+
+static int mount_walk(mfs_t * mfs, mount_graph_t * graph, uint32_t start_index, bool lazy)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    bool crc32c = false;
+    uint32_t running_checksum = 0;
+    bool start_valid = false;
+    bool bad = false;
+
+    uint32_t current_block_index = start_index;
+    while(1) {
+        if(current_block_index >= conf->block_count
+           || get_bit(graph->bit_bufs[MOUNT_WALK], current_block_index)) {
+            bad = true;
+            break;
+        }
+        if(get_bit(graph->bit_bufs[MOUNT_VISITED], current_block_index)) {
+            if(get_bit(graph->bit_bufs[MOUNT_BAD], current_block_index)) {
+                bad = true;
+            }
+            else if(!lazy
+                    && get_bit(graph->bit_bufs[MOUNT_MAY_START], start_index)
+                    && !get_bit(graph->bit_bufs[MOUNT_GOOD], current_block_index)) {
+                res = rescan_chain(mfs, graph, crc32c, running_checksum, current_block_index, &start_valid);
+                if(res) return res;
+            }
+            break;
+        }
+
+        /* a chain that cannot start a file is only needed for its shape */
+        bool structure_only = lazy || (current_block_index != start_index
+                                       && !get_bit(graph->bit_bufs[MOUNT_MAY_START], start_index));
+        const uint8_t * block;
+        res = mount_read_block(mfs, graph, current_block_index, structure_only, &block);
+        if(res) return res;
+        set_bit(graph->bit_bufs[MOUNT_VISITED], current_block_index);
+        set_bit(graph->bit_bufs[MOUNT_WALK], current_block_index);
+        memcpy(&graph->birthdays[current_block_index], block, 4);
+        memcpy(&graph->prefer_if_olders[current_block_index], block + 4, 4);
+        if(current_block_index == start_index) {
+            crc32c = header_crc32c(block);
+            running_checksum = chain_checksum_init(crc32c);
+        }
+        if(block_may_be_file_start(conf, block)) {
+            set_bit(graph->bit_bufs[MOUNT_MAY_START], current_block_index);
+            name_index_note(mfs, current_block_index, block);
+        }
+        bool hashing = !lazy && get_bit(graph->bit_bufs[MOUNT_MAY_START], start_index);
+
+        int32_t unoccupied_data_bytes;
+        memcpy(&unoccupied_data_bytes, block + (conf->block_size - 8), 4);
+        uint32_t next_block_or_target_checksum;
+        memcpy(&next_block_or_target_checksum, block + (conf->block_size - 4), 4);
+        if(unoccupied_data_bytes >= 0) {
+            graph->links[current_block_index] = LINK_END;
+            if(hashing) {
+                running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size - 4);
+                start_valid = running_checksum == next_block_or_target_checksum;
+            }
+            break;
+        }
+        graph->links[current_block_index] = next_block_or_target_checksum;
+        if(hashing) {
+            running_checksum = chain_checksum_update(mfs, crc32c, running_checksum, block, conf->block_size);
+        }
+        current_block_index = next_block_or_target_checksum;
+    }
+
+    if(start_valid) {
+        set_bit(graph->bit_bufs[MOUNT_VALID], start_index);
+        mark_chain_good(graph, start_index);
+    }
+
+    /* settle the blocks of this walk */
+    current_block_index = start_index;
+    while(current_block_index < conf->block_count
+          && get_bit(graph->bit_bufs[MOUNT_WALK], current_block_index)) {
+        clear_bit(graph->bit_bufs[MOUNT_WALK], current_block_index);
+        if(bad) {
+            set_bit(graph->bit_bufs[MOUNT_BAD], current_block_index);
+        }
+        else if(lazy) {
+            if(get_bit(graph->bit_bufs[MOUNT_MAY_START], current_block_index)) {
+                set_bit(graph->bit_bufs[MOUNT_VALID], current_block_index);
+            }
+        }
+        else if(current_block_index != start_index
+                && get_bit(graph->bit_bufs[MOUNT_MAY_START], current_block_index)
+                && !get_bit(graph->bit_bufs[MOUNT_GOOD], current_block_index)) {
+            bool valid;
+            bool other_crc32c = prefer_is_crc32c(graph->prefer_if_olders[current_block_index]);
+            res = rescan_chain(mfs, graph, other_crc32c, chain_checksum_init(other_crc32c), current_block_index, &valid);
+            if(res) return res;
+            if(valid) {
+                set_bit(graph->bit_bufs[MOUNT_VALID], current_block_index);
+                mark_chain_good(graph, current_block_index);
+            }
+        }
+        if(graph->links[current_block_index] == LINK_END) break;
+        current_block_index = graph->links[current_block_index];
+    }
+
+    return 0;
+}
+
+static void chain_set_bits(const mount_graph_t * graph, uint8_t * bit_buf, int block_count, uint32_t block_index)
+{
+    while(1) {
+        bits_set(bit_buf, block_count, block_index);
+        if(graph->links[block_index] == LINK_END) return;
+        block_index = graph->links[block_index];
+    }
+}
+
+static void chain_clear_bits(const mount_graph_t * graph, uint8_t * bit_buf, int block_count, uint32_t block_index)
+{
+    while(1) {
+        bits_clear(bit_buf, block_count, block_index);
+        if(graph->links[block_index] == LINK_END) return;
+        block_index = graph->links[block_index];
+    }
+}
+
+static bool chain_any_bits(const mount_graph_t * graph, const uint8_t * bit_buf, uint32_t block_index)
+{
+    while(1) {
+        if(get_bit(bit_buf, block_index)) return true;
+        if(graph->links[block_index] == LINK_END) return false;
+        block_index = graph->links[block_index];
+    }
+}
+
+/* checksum the candidates that share blocks and the segments. the rest
+   are left unverified */
+static int mount_lazy_settle(mfs_t * mfs, mount_graph_t * graph)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * taken = graph->bit_bufs[MOUNT_WALK];
+    uint8_t * shared = graph->bit_bufs[MOUNT_GOOD];
+
+    for(int i = 0; i < conf->block_count; i++) {
+        if(!get_bit(graph->bit_bufs[MOUNT_VALID], i)) continue;
+        uint32_t block_index = i;
+        while(1) {
+            set_bit(get_bit(taken, block_index) ? shared : taken, block_index);
+            if(graph->links[block_index] == LINK_END) break;
+            block_index = graph->links[block_index];
+        }
+    }
+
+    for(int i = 0; i < conf->block_count; i++) {
+        if(!get_bit(graph->bit_bufs[MOUNT_VALID], i)) continue;
+        if(!prefer_is_segment(graph->prefer_if_olders[i]) && !chain_any_bits(graph, shared, i)) {
+            set_bit(graph->bit_bufs[MOUNT_UNVERIFIED], i);
+            continue;
+        }
+        bool valid;
+        bool crc32c = prefer_is_crc32c(graph->prefer_if_olders[i]);
+        res = rescan_chain(mfs, graph, crc32c, chain_checksum_init(crc32c), i, &valid);
+        if(res) return res;
+        if(!valid) clear_bit(graph->bit_bufs[MOUNT_VALID], i);
+    }
+
+    return 0;
+}
+
+/* settle the segments like `mount_segments` does. the prefer_if_older of
+   a file or segment that is taken becomes the segment taken after it */
+static void mount_graph_segments(mfs_t * mfs, mount_graph_t * graph)
+{
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * valid = graph->bit_bufs[MOUNT_VALID];
+    uint8_t * segment_start = mfs->bit_bufs[SEGMENT_START_BLOCKS];
+    uint8_t * continued_blocks = mfs->bit_bufs[CONTINUED_BLOCKS];
+
+    /* any intact segment is younger than the blocks it could be mistaken to go on after */
+    for(int i = 0; i < conf->block_count; i++) {
+        if(get_bit(valid, i) && prefer_is_segment(graph->prefer_if_olders[i])
+           && graph->birthdays[i] > mfs->youngest) {
+            mfs->youngest = graph->birthdays[i];
+        }
+    }
+
+    bool taken = true;
+    while(taken) {
+        taken = false;
+        for(int i = 0; i < conf->block_count; i++) {
+            if(!get_bit(valid, i) || !prefer_is_segment(graph->prefer_if_olders[i])) continue;
+            int32_t continued = prefer_decode(graph->prefer_if_olders[i]);
+            if(continued < 0) {
+                clear_bit(valid, i);
+                continue;
+            }
+            if(!get_bit(mfs->bit_bufs[FILE_START_BLOCKS], continued) && !get_bit(segment_start, continued)) continue;
+            if(graph->birthdays[i] <= graph->birthdays[continued]
+               || chain_any_bits(graph, mfs->bit_bufs[OCCUPIED_BLOCKS], i)) {
+                clear_bit(valid, i);
+                continue;
+            }
+            int32_t other = graph->prefer_if_olders[continued];
+            if(other >= 0) {
+                if(graph->birthdays[other] >= graph->birthdays[i] || get_bit(continued_blocks, other)) {
+                    clear_bit(valid, i);
+                    continue;
+                }
+                bits_clear(segment_start, conf->block_count, other);
+                chain_clear_bits(graph, mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, other);
+                clear_bit(valid, other);
+            }
+            bits_set(segment_start, conf->block_count, i);
+            bits_set(continued_blocks, conf->block_count, continued);
+            chain_set_bits(graph, mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, i);
+            graph->prefer_if_olders[continued] = i;
+            graph->prefer_if_olders[i] = -1;
+            taken = true;
+        }
+    }
+}
+
+static int mount_graph(mfs_t * mfs, bool lazy)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    mount_graph_t graph;
+    mount_graph_get(mfs, &graph);
+    for(int i = 0; i < MOUNT_BIT_BUF_COUNT; i++) {
+        memset(graph.bit_bufs[i], 0, MFS_BIT_BUF_SIZE_BYTES(conf->block_count));
+    }
+
+    for(int i = 0; i < conf->block_count; i++) {
+        if(get_bit(graph.bit_bufs[MOUNT_VISITED], i)) continue;
+        res = mount_walk(mfs, &graph, i, lazy);
+        if(res) return res;
+    }
+
+    if(lazy) {
+        res = mount_lazy_settle(mfs, &graph);
+        if(res) return res;
+    }
+
+    for(int i = 0; i < conf->block_count; i++) {
+        if(!get_bit(graph.bit_bufs[MOUNT_VALID], i)
+           || prefer_is_segment(graph.prefer_if_olders[i])
+           || chain_any_bits(&graph, mfs->bit_bufs[OCCUPIED_BLOCKS], i)) {
+            continue;
+        }
+        int32_t preferred_if_older = prefer_decode(graph.prefer_if_olders[i]);
+        if(preferred_if_older >= 0
+           && get_bit(graph.bit_bufs[MOUNT_VALID], preferred_if_older)
+           && !chain_any_bits(&graph, mfs->bit_bufs[OCCUPIED_BLOCKS], preferred_if_older)
+           && graph.birthdays[preferred_if_older] <= graph.birthdays[i]) {
+            continue;
+        }
+        if(graph.birthdays[i] > mfs->youngest) mfs->youngest = graph.birthdays[i];
+        bits_set(mfs->bit_bufs[FILE_START_BLOCKS], conf->block_count, i);
+        mfs->file_count += 1;
+        chain_set_bits(&graph, mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, i);
+        /* from here on, the segment taken after it */
+        graph.prefer_if_olders[i] = -1;
+    }
+
+    mount_graph_segments(mfs, &graph);
+
+    if(conf->chain_aux_memory) {
+        const uint8_t * occupied = mfs->bit_bufs[OCCUPIED_BLOCKS];
+        for(int i = bits_next_set(occupied, conf->block_count, 0); i >= 0;
+            i = bits_next_set(occupied, conf->block_count, i + 1)) {
+            chain_note(conf, i, graph.links[i] == LINK_END ? CHAIN_END : graph.links[i]);
+        }
+        const uint8_t * continued = mfs->bit_bufs[CONTINUED_BLOCKS];
+        for(int i = bits_next_set(continued, conf->block_count, 0); i >= 0;
+            i = bits_next_set(continued, conf->block_count, i + 1)) {
+            uint32_t tail = i;
+            while(graph.links[tail] != LINK_END) tail = graph.links[tail];
+            chain_note(conf, tail, CHAIN_SEGMENT | graph.prefer_if_olders[i]);
+        }
+    }
+
+    /* the graph's bit buffers are not summarized. a word at a time */
+    uint8_t * unverified = graph.bit_bufs[MOUNT_UNVERIFIED];
+    int bit_buf_len = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
+    int i = 0;
+    for(; i + 8 <= bit_buf_len; i += 8) {
+        store_word(unverified + i, 0, load_word(unverified + i, 0) & load_word(mfs->bit_bufs[FILE_START_BLOCKS] + i, 0));
+    }
+    for(; i < bit_buf_len; i++) unverified[i] &= mfs->bit_bufs[FILE_START_BLOCKS][i];
+
+    return 0;
+}
+
+static uint8_t * unverified_bit_buf(const mfs_t * mfs)
+{
+    if(!mfs->conf->mount_aux_memory) return NULL;
+    mount_graph_t graph;
+    mount_graph_get(mfs, &graph);
+    return graph.bit_bufs[MOUNT_UNVERIFIED];
+}
+
+/*
+
+Checkpoint
+
+Stored in the last blocks of the volume as one byte stream.
+
+magic : u32
+block count : i32
+generation : u32
+youngest : u32
+file count : i32
+checksum : u32
+file start blocks : bit buf
+occupied blocks : bit buf
+segment start blocks : bit buf
+continued blocks : bit buf
+unverified file start blocks : bit buf
+
+It is trusted at mount. Before anything is written that could change
+what a full scan finds, the first checkpoint block is overwritten
+without the magic, and the checkpoint is written again once the
+operation is complete. The first block is written last so a torn
+checkpoint is never valid.
+
+*/
+
+#define CHECKPOINT_MAGIC 0x6d667363u
+#define CHECKPOINT_HEADER_SIZE 24
+
+static void checkpoint_header_get(const mfs_t * mfs, uint8_t * header)
+{
+    uint32_t magic = CHECKPOINT_MAGIC;
+    memcpy(header, &magic, 4);
+    memcpy(header + 4, &mfs->conf->block_count, 4);
+    memcpy(header + 8, &mfs->checkpoint_generation, 4);
+    memcpy(header + 12, &mfs->youngest, 4);
+    memcpy(header + 16, &mfs->file_count, 4);
+}
+
+static uint32_t checkpoint_checksum(const mfs_t * mfs, const uint8_t * header)
+{
+    int bit_buf_size = MFS_BIT_BUF_SIZE_BYTES(mfs->conf->block_count);
+    uint32_t checksum = checksum_update(CHECKSUM_INIT_VAL, header, 20);
+    checksum = checksum_update(checksum, mfs->bit_bufs[FILE_START_BLOCKS], bit_buf_size);
+    checksum = checksum_update(checksum, mfs->bit_bufs[OCCUPIED_BLOCKS], bit_buf_size);
+    checksum = checksum_update(checksum, mfs->bit_bufs[SEGMENT_START_BLOCKS], bit_buf_size);
+    checksum = checksum_update(checksum, mfs->bit_bufs[CONTINUED_BLOCKS], bit_buf_size);
+    const uint8_t * unverified = unverified_bit_buf(mfs);
+    for(int i = 0; i < bit_buf_size; i++) {
+        uint8_t byte = unverified ? unverified[i] : 0;
+        checksum = checksum_update(checksum, &byte, 1);
+    }
+    return checksum;
+}
+
+/* copy between the checkpoint stream and the block at stream offset `block_offset`.
+   false if there are unverified files but nowhere to keep track of them */
+static bool checkpoint_block_copy(mfs_t * mfs, uint8_t * block_buf, int block_offset, bool to_block)
+{
+    const mfs_conf_t * conf = mfs->conf;
+    int bit_buf_size = MFS_BIT_BUF_SIZE_BYTES(conf->block_count);
+
+    uint8_t * bit_bufs[5] = {
+        mfs->bit_bufs[FILE_START_BLOCKS],
+        mfs->bit_bufs[OCCUPIED_BLOCKS],
+        mfs->bit_bufs[SEGMENT_START_BLOCKS],
+        mfs->bit_bufs[CONTINUED_BLOCKS],
+        unverified_bit_buf(mfs)
+    };
+    for(int i = 0; i < 5; i++) {
+        int stream_offset = CHECKPOINT_HEADER_SIZE + i * bit_buf_size;
+        int begin = stream_offset > block_offset ? stream_offset : block_offset;
+        int end = stream_offset + bit_buf_size;
+        if(end > block_offset + conf->block_size) end = block_offset + conf->block_size;
+        if(begin >= end) continue;
+        uint8_t * block_part = block_buf + (begin - block_offset);
+        if(!bit_bufs[i]) {
+            if(!to_block) for(int j = 0; j < end - begin; j++) if(block_part[j]) return false;
+            continue;
+        }
+        if(to_block) memcpy(block_part, bit_bufs[i] + (begin - stream_offset), end - begin);
+        else memcpy(bit_bufs[i] + (begin - stream_offset), block_part, end - begin);
+    }
+    return true;
+}
+
+static int checkpoint_load(mfs_t * mfs, bool * loaded_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    int first_block = conf->block_count - mfs->checkpoint_block_count;
+
+    *loaded_dst = false;
+
+    uint8_t header[CHECKPOINT_HEADER_SIZE];
+    for(int i = 0; i < mfs->checkpoint_block_count; i++) {
+        const uint8_t * block;
+        res = block_get(conf, first_block + i, mfs->block_buf, &block);
+        if(res) return res;
+        if(i == 0) {
+            memcpy(header, block, CHECKPOINT_HEADER_SIZE);
+            uint32_t magic;
+            int32_t block_count;
+            memcpy(&magic, header, 4);
+            memcpy(&block_count, header + 4, 4);
+            if(magic != CHECKPOINT_MAGIC || block_count != conf->block_count) return 0;
+        }
+        if(!checkpoint_block_copy(mfs, (uint8_t *) block, i * conf->block_size, false)) return 0;
+    }
+
+    uint32_t checksum;
+    memcpy(&checksum, header + 20, 4);
+    if(checksum != checkpoint_checksum(mfs, header)) return 0;
+
+    memcpy(&mfs->checkpoint_generation, header + 8, 4);
+    memcpy(&mfs->youngest, header + 12, 4);
+    memcpy(&mfs->file_count, header + 16, 4);
+    mfs->checkpoint_clean = true;
+    *loaded_dst = true;
+    return 0;
+}
+
+static int checkpoint_save(mfs_t * mfs, uint8_t * block_buf)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    int first_block = conf->block_count - mfs->checkpoint_block_count;
+
+    if(!mfs->checkpoint_block_count || mfs->checkpoint_clean) return 0;
+
+    /* blocks of files still being written are not on the volume for a
+       scan to find. the last writer to close saves */
+    for(const mfs_file_t * open_file = mfs->open_files; open_file; open_file = open_file->next_open) {
+        if(open_file->mode == MFS_MODE_WRITE) return 0;
+    }
+
+    mfs->checkpoint_generation += 1;
+    uint8_t header[CHECKPOINT_HEADER_SIZE];
+    checkpoint_header_get(mfs, header);
+    uint32_t checksum = checkpoint_checksum(mfs, header);
+    memcpy(header + 20, &checksum, 4);
+
+    for(int i = mfs->checkpoint_block_count - 1; i >= 0; i--) {
+        memset(block_buf, 0, conf->block_size);
+        if(i == 0) memcpy(block_buf, header, CHECKPOINT_HEADER_SIZE);
+        checkpoint_block_copy(mfs, block_buf, i * conf->block_size, true);
+        cache_drop(conf, first_block + i, 1);
+        res = conf->write_block(conf->cb_ctx, first_block + i, block_buf);
+        if(res) return res;
+    }
+
+    mfs->checkpoint_clean = true;
+    return 0;
+}
+
+static int checkpoint_invalidate(mfs_t * mfs, uint8_t * block_buf)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    if(!mfs->checkpoint_block_count || !mfs->checkpoint_clean) return 0;
+
+    /* any first block without the magic will do. borrow block_buf */
+    uint32_t saved;
+    memcpy(&saved, block_buf, 4);
+    memset(block_buf, 0, 4);
+    cache_drop(conf, conf->block_count - mfs->checkpoint_block_count, 1);
+    res = conf->write_block(conf->cb_ctx, conf->block_count - mfs->checkpoint_block_count, block_buf);
+    memcpy(block_buf, &saved, 4);
+    if(res) return res;
+
+    mfs->checkpoint_clean = false;
+    return 0;
+}
+
+/* `verify_all` skips the checkpoint and checksums every file */
+static int mount_volume(mfs_t * mfs, const mfs_conf_t * conf, bool verify_all)
+{
+    int res;
+
+    if(conf->block_size < (4 + 4 + 1 + 1 + 4 + 4)
+       || conf->block_count < 1
+       || conf->block_count > PREFER_INFO_BIT
+       || (int64_t) conf->block_count * (conf->block_size - 8) > INT_MAX
+       || (conf->aligned_staging_memory && conf->staging_block_count < 1)
+       || (conf->block_cache_memory && conf->block_cache_block_count < 1)
+#ifdef MFS_THREAD_SAFE
+       || (conf->aligned_reader_memory && (conf->reader_buffer_count < 1 || conf->reader_buffer_count > 32))
+#endif
+       || ((conf->flags & MFS_FLAG_VERIFY_TRAILER) && (conf->flags & MFS_FLAG_VERIFY_WRITES))) {
+        return MFS_BAD_BLOCK_CONFIG_ERROR;
+    }
+
+    mfs->conf = conf;
+
+    mfs->block_buf = conf->aligned_aux_memory;
+    uint8_t * aux_mem_u8 = conf->aligned_aux_memory;
+    aux_mem_u8 += conf->block_size;
+    for(int i = 0; i < BIT_BUF_COUNT; i++) {
+        mfs->bit_bufs[i] = aux_mem_u8;
+        aux_mem_u8 += MFS_BIT_BUF_STRIDE(conf->block_count);
+    }
+    memset(mfs->bit_bufs[0], 0, MFS_BIT_BUF_STRIDE(conf->block_count) * BIT_BUF_COUNT);
+
+    mfs->file_count = 0;
+    mfs->youngest = 0;
+    mfs->needs_remount = false;
+    mfs->file.mode = -1;
+    mfs->open_files = NULL;
+    mfs->checkpoint_block_count = 0;
+    mfs->checkpoint_clean = false;
+    mfs->checkpoint_generation = 0;
+    mfs->name_index_ready = false;
+    if(conf->chain_aux_memory) memset(conf->chain_aux_memory, 0xff, conf->block_count * 4);
+    if(conf->file_info_aux_memory) memset(conf->file_info_aux_memory, 0xff, conf->block_count * 8);
+    if(conf->block_cache_memory) cache_clear(conf);
+
+    if(conf->flags & MFS_FLAG_CHECKPOINT) {
+        mfs->checkpoint_block_count = MFS_CHECKPOINT_BLOCK_COUNT(conf->block_size, conf->block_count);
+        if(conf->block_size < CHECKPOINT_HEADER_SIZE
+           || mfs->checkpoint_block_count >= conf->block_count) {
+            return MFS_BAD_BLOCK_CONFIG_ERROR;
+        }
+        if(!verify_all) {
+            bool loaded;
+            res = checkpoint_load(mfs, &loaded);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            for(int i = FILE_START_BLOCKS; i <= CONTINUED_BLOCKS; i++) {
+                summary_rebuild(mfs->bit_bufs[i], conf->block_count);
+            }
+            if(loaded) return 0;
+            mfs->youngest = 0;
+            mfs->file_count = 0;
+            for(int i = FILE_START_BLOCKS; i <= CONTINUED_BLOCKS; i++) {
+                bits_zero(mfs->bit_bufs[i], conf->block_count);
+            }
+        }
+    }
+
+    if(conf->mount_aux_memory) {
+        res = mount_graph(mfs, !verify_all && (conf->flags & MFS_FLAG_LAZY_VERIFY));
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    }
+    else {
+        for(int file_initial_idx = 0; file_initial_idx < conf->block_count; file_initial_idx++) {
+            res = mount_inner(mfs, file_initial_idx);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res); /* a convenience for internal callers */
+        }
+        res = mount_segments(mfs);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    }
+
+    res = name_index_build(mfs, NULL, true);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+    if(mfs->checkpoint_block_count) {
+        int first_block = conf->block_count - mfs->checkpoint_block_count;
+        if(bits_next_set(mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, first_block) >= 0) {
+            /* a file lives where the checkpoint would go */
+            mfs->checkpoint_block_count = 0;
+            return 0;
+        }
+        for(int i = first_block; i < conf->block_count; i++) {
+            bits_set(mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count, i);
+        }
+        res = checkpoint_save(mfs, mfs->block_buf);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    }
+
+    return 0;
+}
+
+static int mount(mfs_t * mfs, const mfs_conf_t * conf, bool verify_all)
+{
+    STATS_PURPOSE(mfs, MFS_IO_MOUNT);
+    TRACE(mfs, MFS_TRACE_MOUNT, MFS_TRACE_BEGIN, -1, 0);
+    int res = mount_volume(mfs, conf, verify_all);
+    TRACE(mfs, MFS_TRACE_MOUNT, MFS_TRACE_END, -1, res != 0);
+    if(res) return res;
+
+    mfs->free_block_count = conf->block_count - bits_count(mfs->bit_bufs[OCCUPIED_BLOCKS], conf->block_count);
+    mfs->reserved_block_count = 0;
+    mfs->free_hint = 0;
+
+    return 0;
+}
+
+int mfs_mount(mfs_t * mfs, const mfs_conf_t * conf)
+{
+    if(conf->block_cache_memory && conf->block_cache_block_count > 0) {
+        memset(cache_counters(conf), 0, 12);
+    }
+    return mount(mfs, conf, false);
+}
+
+void mfs_block_cache_counts(const mfs_t * mfs, uint32_t * hits_dst, uint32_t * misses_dst)
+{
+    if(!mfs->conf->block_cache_memory) {
+        *hits_dst = 0;
+        *misses_dst = 0;
+        return;
+    }
+    *hits_dst = cache_counters(mfs->conf)[0];
+    *misses_dst = cache_counters(mfs->conf)[1];
+}
+
+/* the open files are discarded. their started writes must finish first */
+static int remount(mfs_t * mfs, bool verify_all)
+{
+#ifdef MFS_THREAD_SAFE
+    if(!mfs->exclusive) return LOCK_UPGRADE_NEEDED;
+#endif
+    STATS_ADD(mfs, remounts, 1);
+    TRACE(mfs, MFS_TRACE_REMOUNT, MFS_TRACE_BEGIN, -1, 0);
+    for(mfs_file_t * open_file = mfs->open_files; open_file; open_file = open_file->next_open) {
+        if(open_file->mode == MFS_MODE_WRITE) file_write_join(mfs->conf, open_file);
+    }
+    int res = mount(mfs, mfs->conf, verify_all);
+    TRACE(mfs, MFS_TRACE_REMOUNT, MFS_TRACE_END, -1, res != 0);
+    return res;
+}
+
+/* checksum a file found by a lazy mount and get its first block again
+   into `*block`. when it is broken, what a full scan would have found is
+   mounted instead and `*remounted_dst` is set */
+static int verify_file(mfs_t * mfs, int block_index, uint8_t * block_buf, const uint8_t ** block,
+                       bool * remounted_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * unverified = unverified_bit_buf(mfs);
+
+    *remounted_dst = false;
+    if(!unverified || !get_bit(unverified, block_index)) return 0;
+
+    STATS_PURPOSE(mfs, MFS_IO_VERIFY);
+    int end_index;
+    res = scan_file(mfs, &end_index, block_index, mfs->bit_bufs[SCRATCH_1], block_buf);
+    if(res) return res;
+    if(end_index < 0) {
+        *remounted_dst = true;
+        return remount(mfs, true);
+    }
+    clear_bit(unverified, block_index);
+    return block_get(conf, block_index, block_buf, block);
+}
+
+int mfs_file_count(mfs_t * mfs)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return mfs->file_count;
+}
+
+int mfs_free_space(mfs_t * mfs)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    /* mount bounds a volume to INT_MAX bytes. saturate rather than overflow all the same */
+    int64_t free_bytes = (int64_t) (mfs->free_block_count - mfs->reserved_block_count) * (mfs->conf->block_size - 8);
+    return free_bytes > INT_MAX ? INT_MAX : (int) free_bytes;
+}
+
+static int list_files(const mfs_t * mfs, uint8_t * block_buf, void * list_file_cb_ctx,
+                      void (*list_file_cb)(void *, const char *))
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    STATS_PURPOSE(mfs, MFS_IO_LOOKUP);
+    for(int i = next_file_start(mfs, 0); i >= 0; i = next_file_start(mfs, i + 1)) {
+        const uint8_t * block;
+        res = read_name(conf, i, block_buf, &block);
+        if(res) return res;
+        list_file_cb(list_file_cb_ctx, (const char *) block + 8);
+    }
+
+    return 0;
+}
+
+int mfs_list_files(mfs_t * mfs, void * list_file_cb_ctx, void (*list_file_cb)(void *, const char *))
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return list_files(mfs, mfs->block_buf, list_file_cb_ctx, list_file_cb);
+}
+
+int mfs_list_files_info(mfs_t * mfs, void * list_file_cb_ctx,
+                        void (*list_file_cb)(void *, const char *, const mfs_file_info_t *))
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    const mfs_conf_t * conf = mfs->conf;
+
+    /* a broken file remounts, so they are all checked before any is listed */
+    for(int i = next_file_start(mfs, 0); i >= 0; i = next_file_start(mfs, i + 1)) {
+        const uint8_t * block;
+        bool remounted;
+        res = verify_file(mfs, i, mfs->block_buf, &block, &remounted);
+        if(res) return res;
+        if(remounted) return mfs_list_files_info(mfs, list_file_cb_ctx, list_file_cb);
+    }
+
+    for(int i = next_file_start(mfs, 0); i >= 0; i = next_file_start(mfs, i + 1)) {
+        mfs_file_info_t info;
+        res = file_info_get(mfs, i, mfs->block_buf, &info);
+        if(res) return res;
+        STATS_PURPOSE(mfs, MFS_IO_LOOKUP);
+        const uint8_t * block;
+        res = read_name(conf, i, mfs->block_buf, &block);
+        if(res) return res;
+        list_file_cb(list_file_cb_ctx, (const char *) block + 8, &info);
+    }
+
+    return 0;
+}
+
+int mfs_stat(mfs_t * mfs, const char * name, mfs_file_info_t * info_dst)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    const mfs_conf_t * conf = mfs->conf;
+
+    int name_len = strlen(name);
+    if(name_len > conf->block_size - (4 + 4 + 1 + 1 + 4 + 4)
+       || name_len < 1) {
+        return MFS_FILE_NAME_BAD_LEN_ERROR;
+    }
+
+    if(name_busy(mfs, checksum_update(CHECKSUM_INIT_VAL, (const uint8_t *) name, name_len), false)) {
+        return MFS_FILE_BUSY_ERROR;
+    }
+
+    int block_index;
+    const uint8_t * block;
+    res = find_file(mfs, name, mfs->block_buf, &block_index, &block);
+    if(res) return res;
+    if(block_index < 0) {
+        return MFS_FILE_NOT_FOUND_ERROR;
+    }
+
+    bool remounted;
+    res = verify_file(mfs, block_index, mfs->block_buf, &block, &remounted);
+    if(res) return res;
+    if(remounted) return mfs_stat(mfs, name, info_dst);
+
+    return file_info_get(mfs, block_index, mfs->block_buf, info_dst);
+}
+
+int mfs_delete(mfs_t * mfs, const char * name)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    const mfs_conf_t * conf = mfs->conf;
+    int i;
+
+    int name_len = strlen(name);
+    if(name_len > conf->block_size - (4 + 4 + 1 + 4 + 4)
+       || name_len < 1) {
+        return MFS_FILE_NAME_BAD_LEN_ERROR;
+    }
+
+    if(name_busy(mfs, checksum_update(CHECKSUM_INIT_VAL, (const uint8_t *) name, name_len), true)) {
+        return MFS_FILE_BUSY_ERROR;
+    }
+
+    int delete_file_page_1;
+    const uint8_t * block;
+    res = find_file(mfs, name, mfs->block_buf, &delete_file_page_1, &block);
+    if(res) return res;
+    if(delete_file_page_1 < 0) {
+        return MFS_FILE_NOT_FOUND_ERROR;
+    }
+
+    bool remounted;
+    res = verify_file(mfs, delete_file_page_1, mfs->block_buf, &block, &remounted);
+    if(res) return res;
+    if(remounted) return mfs_delete(mfs, name);
+
+    STATS_PURPOSE(mfs, MFS_IO_COMMIT);
+    res = checkpoint_invalidate(mfs, mfs->block_buf);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+    bits_clear(mfs->bit_bufs[FILE_START_BLOCKS], conf->block_count, delete_file_page_1);
+    name_index_remove(mfs, delete_file_page_1);
+
+    uint32_t birthday;
+    memcpy(&birthday, block, 4);
+    if(birthday == mfs->youngest) mfs->youngest--;
+
+    res = file_blocks(mfs, delete_file_page_1, mfs->bit_bufs[SCRATCH_1], mfs->block_buf);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+    blocks_release(mfs, mfs->bit_bufs[SCRATCH_1]);
+
+    res = segments_release(mfs, delete_file_page_1, mfs->block_buf);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+    /* clobber the first page */
+    memset(mfs->block_buf, 0xff, conf->block_size);
+    cache_drop(conf, delete_file_page_1, 1);
+    res = conf->write_block(conf->cb_ctx, delete_file_page_1, mfs->block_buf);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    res = block_get(conf, delete_file_page_1, mfs->block_buf, &block);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+    for(i = 0; i < conf->block_size; i++) {
+        if(block[i] != 0xff) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
+    }
+
+    mfs->file_count -= 1;
+
+    res = checkpoint_save(mfs, mfs->block_buf);
+    if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+    return 0;
+}
+
+/* the blocks a file being written would like in a row from its next one */
+static int file_run(const mfs_file_t * file)
+{
+    return file->reserved_blocks > file->staging_block_count ? file->reserved_blocks : file->staging_block_count;
+}
+
+/* the block after `after` when it is free, so that files are written in
+   runs of consecutive blocks. otherwise the start of the first free run
+   of `run` blocks, or failing that the next free one. -1 if none that is
+   not reserved for another file */
+static int alloc_block(mfs_t * mfs, mfs_file_t * file, int after, int run)
+{
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * occupied = mfs->bit_bufs[OCCUPIED_BLOCKS];
+
+    if(!file->reserved_blocks && mfs->free_block_count <= mfs->reserved_block_count) return -1;
+
+    int i = -1;
+    if(after + 1 < conf->block_count && !get_bit(occupied, after + 1)) i = after + 1;
+    /* every block before free_hint is occupied */
+    if(i < 0 && run > 1) i = bits_clear_run(occupied, conf->block_count, mfs->free_hint, run);
+    if(i < 0) i = bits_next_clear(occupied, conf->block_count, after + 1, conf->block_count);
+    if(i < 0) i = bits_next_clear(occupied, conf->block_count, mfs->free_hint, after + 1 < conf->block_count ? after + 1 : conf->block_count);
+    if(i < 0) return -1;
+
+    TRACE(mfs, MFS_TRACE_ALLOC, MFS_TRACE_INSTANT, i, 0);
+    bits_set(occupied, conf->block_count, i);
+    mfs->free_block_count--;
+    if(i == mfs->free_hint) mfs->free_hint++;
+    if(file->reserved_blocks) {
+        file->reserved_blocks--;
+        mfs->reserved_block_count--;
+    }
+    return i;
+}
+
+/* move the first block of a file being written, while nothing has gone
+   past it, to the start of a free run as long as the file would like */
+static void file_place_head(mfs_t * mfs, mfs_file_t * file)
+{
+    const mfs_conf_t * conf = mfs->conf;
+    uint8_t * occupied = mfs->bit_bufs[OCCUPIED_BLOCKS];
+    int head = file->block;
+    int run = file->reserved_blocks + 1 > file->staging_block_count ? file->reserved_blocks + 1 : file->staging_block_count;
+
+    if(run < 2 || head != file->first_block || file->writes_started) return;
+    int end = bits_next_set(occupied, conf->block_count, head + 1);
+    if((end < 0 ? conf->block_count : end) - head >= run) return;
+    int i = bits_clear_run(occupied, conf->block_count, mfs->free_hint, run);
+    if(i < 0) return;
+
+    TRACE(mfs, MFS_TRACE_ALLOC, MFS_TRACE_INSTANT, i, 0);
+    bits_set(occupied, conf->block_count, i);
+    if(i == mfs->free_hint) mfs->free_hint++;
+    bits_clear(occupied, conf->block_count, head);
+    if(head < mfs->free_hint) mfs->free_hint = head;
+    uint8_t * unverified = unverified_bit_buf(mfs);
+    if(unverified) clear_bit(unverified, i);
+    file->block = i;
+    file->first_block = i;
+    if(file->staged_first == head) file->staged_first = i;
+}
+
+/* make sure `size` more bytes can be written to a file being written */
+static int file_reserve(mfs_t * mfs, mfs_file_t * file, int size)
+{
+    int data_size = mfs->conf->block_size - 8;
+    int block_len_remaining = data_size - file->block_cursor;
+    if(file->compressed) {
+        /* at worst literal runs of every byte, each run taking a token, and a block ending a byte short */
+        data_size -= data_size / TOKEN_MAX_LITERALS + 2;
+        block_len_remaining -= block_len_remaining / TOKEN_MAX_LITERALS + 2;
+        if(block_len_remaining < 0) block_len_remaining = 0;
+    }
+    int needed = size <= block_len_remaining ? 0 : (size - block_len_remaining - 1) / data_size + 1;
+
+    int more = needed - file->reserved_blocks;
+    if(more > mfs->free_block_count - mfs->reserved_block_count) return MFS_NO_SPACE_ERROR;
+    file->reserved_blocks = needed;
+    mfs->reserved_block_count += more;
+    file_place_head(mfs, file);
+
+    return 0;
+}
+
+static void file_stage(const mfs_conf_t * conf, mfs_file_t * file, uint8_t * blocks, int block_count)
+{
+    if(blocks != file->block_buf) memcpy(blocks, file->block_buf, conf->block_size);
+    file->block_buf = blocks;
+    file->staging = blocks;
+    file->staging_block_count = block_count;
+    file->staged_first = file->block;
+    file->staged_count = 1;
+    file->readahead = block_count;
+}
+
+/* how many blocks from `block_index`, which a file being read goes on to
+   from `file->block`, to read into its staging. as far as the links known
+   in chain_aux_memory go on to the next block, or else a window that
+   halves each time the file jumps past what was read ahead and doubles
+   each time it goes on to the next block */
+static int file_readahead(const mfs_conf_t * conf, mfs_file_t * file, int block_index)
+{
+    int count = conf->block_count - block_index;
+    if(count > file->staging_block_count) count = file->staging_block_count;
+
+    if(conf->chain_aux_memory && chain_get(conf, block_index) != CHAIN_UNKNOWN) {
+        int run = 1;
+        while(run < count && chain_get(conf, block_index + run - 1) == (uint32_t) (block_index + run)) run++;
+        return run;
+    }
+
+    if(block_index == file->block + 1) {
+        file->readahead *= 2;
+        if(file->readahead > file->staging_block_count) file->readahead = file->staging_block_count;
+    }
+    else if(file->readahead > 1) file->readahead /= 2;
+    return count < file->readahead ? count : file->readahead;
+}
+
+/* load a block of a file being read, reading ahead into its staging */
+static int file_load(const mfs_conf_t * conf, mfs_file_t * file, int block_index)
+{
+    int res;
+
+    if(conf->map_block) {
+        /* never written through by a file being read */
+        file->block_buf = (uint8_t *) conf->map_block(conf->cb_ctx, block_index);
+        file->staged_first = block_index;
+        file->staged_count = 0;
+        return 0;
+    }
+
+    if(block_index < file->staged_first || block_index >= file->staged_first + file->staged_count) {
+        int count = conf->read_blocks ? file_readahead(conf, file, block_index) : 1;
+        if(count > 1) res = conf->read_blocks(conf->cb_ctx, block_index, count, file->staging);
+        else res = conf->read_block(conf->cb_ctx, block_index, file->staging);
+        if(res) return res;
+        file->staged_first = block_index;
+        file->staged_count = count;
+    }
+    file->block_buf = file->staging + (block_index - file->staged_first) * conf->block_size;
+    return 0;
+}
+
+/* start writing the current block of a file being written and move to its
+   next staging block, once the write that last used that one is done */
+static int file_write_start(const mfs_conf_t * conf, mfs_file_t * file)
+{
+    int res;
+
+    cache_drop(conf, file->block, 1);
+    res = conf->write_block_start(conf->cb_ctx, file->block, file->block_buf, file);
+    if(res) return res;
+    file->writes_started += 1;
+
+    int next = (file->block_buf - file->staging) / conf->block_size + 1;
+    if(next == file->staging_block_count) next = 0;
+    file->block_buf = file->staging + next * conf->block_size;
+    while(file->writes_started - file->writes_done >= file->staging_block_count) {
+        conf->write_wait(conf->cb_ctx);
+    }
+    return file->write_error;
+}
+
+/* read a run of blocks that was just written from `blocks` back over it.
+   `expected` is the CRC32C of what was written */
+static int readback(const mfs_t * mfs, int block_index, uint8_t * blocks, int block_count, uint32_t expected)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    STATS_PURPOSE(mfs, MFS_IO_VERIFY);
+    STATS_ADD(mfs, bytes_checksummed, block_count * conf->block_size);
+
+    uint32_t checksum = 0;
+    for(int i = 0; i < block_count; i++) {
+        const uint8_t * block;
+        res = block_get(conf, block_index + i, blocks + i * conf->block_size, &block);
+        if(res) return res;
+        checksum = crc32c_update(checksum, block, conf->block_size);
+    }
+    return checksum == expected ? 0 : MFS_READBACK_ERROR;
+}
+
+/* load a block of a file being read with range reads. its data goes
+   straight to `dst` instead when `size` covers all of it, and
+   `*direct_dst` is set to the amount */
+static int file_load_range(const mfs_conf_t * conf, mfs_file_t * file, int block_index,
+                           uint8_t * dst, int size, int * direct_dst)
+{
+    int res;
+
+    res = conf->read_range(conf->cb_ctx, block_index, conf->block_size - 8, 8,
+                           file->block_buf + (conf->block_size - 8));
+    if(res) return res;
+    int32_t unoccupied_data_bytes;
+    memcpy(&unoccupied_data_bytes, file->block_buf + (conf->block_size - 8), 4);
+    if(unoccupied_data_bytes < 0) unoccupied_data_bytes = 0;
+    int data_len = conf->block_size - 8 - unoccupied_data_bytes;
+
+    bool direct = size >= data_len;
+    if(data_len) {
+        res = conf->read_range(conf->cb_ctx, block_index, 0, data_len, direct ? dst : file->block_buf);
+        if(res) return res;
+    }
+    *direct_dst = direct ? data_len : 0;
+    /* block_buf only holds the trailer after a direct read */
+    file->staged_first = block_index;
+    file->staged_count = direct ? 0 : 1;
+    return 0;
+}
+
+/* write the held back blocks of a file being written, up to the current one */
+static int file_flush(const mfs_conf_t * conf, mfs_file_t * file)
+{
+    int res;
+
+    if(conf->write_block_start) {
+        res = file_write_start(conf, file);
+        if(res) return res;
+        res = file_write_join(conf, file);
+        file->block_buf = file->staging;
+        return res;
+    }
+
+    int count = (file->block_buf - file->staging) / conf->block_size + 1;
+    cache_drop(conf, file->staged_first, count);
+
+    if(count > 1 && conf->write_blocks) {
+        res = conf->write_blocks(conf->cb_ctx, file->staged_first, count, file->staging);
+        if(res) return res;
+    }
+    else {
+        for(int i = 0; i < count; i++) {
+            res = conf->write_block(conf->cb_ctx, file->staged_first + i, file->staging + i * conf->block_size);
+            if(res) return res;
+        }
+    }
+    file->block_buf = file->staging;
+    return 0;
+}
+
+/* go on to a new block of a file being written whose current block is full */
+static int file_advance(mfs_t * mfs, mfs_file_t * file)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    int i = alloc_block(mfs, file, file->block, file_run(file));
+    if(i < 0) return MFS_NO_SPACE_ERROR;
+
+    int32_t unoccupied_data_bytes = -1;
+    memcpy(file->block_buf + (conf->block_size - 8), &unoccupied_data_bytes, 4);
+    memcpy(file->block_buf + (conf->block_size - 4), &i, 4);
+    file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum, file->block_buf + (conf->block_size - 8), 8);
+    chain_note(conf, file->block, i);
+
+    int staged = (file->block_buf - file->staging) / conf->block_size + 1;
+    if(conf->write_block_start) {
+        res = file_write_start(conf, file);
+        if(res) return res;
+    }
+    else if(i == file->block + 1 && staged < file->staging_block_count) {
+        file->block_buf += conf->block_size;
+    }
+    else {
+        uint32_t expected = 0;
+        bool verify = conf->flags & MFS_FLAG_VERIFY_WRITES;
+        if(verify) expected = crc32c_update(0, file->staging, staged * conf->block_size);
+        res = file_flush(conf, file);
+        if(res) return res;
+        if(verify) {
+            res = readback(mfs, file->staged_first, file->staging, staged, expected);
+            if(res) return res;
+            STATS_PURPOSE(mfs, MFS_IO_DATA);
+        }
+        file->staged_first = i;
+    }
+
+    file->block_cursor = 0;
+    file->block = i;
+    return 0;
+}
+
+/* copy the data of the chain starting at `block_index`, which has the same
+   name, into a file being written that has written nothing yet */
+static int file_copy_chain(mfs_t * mfs, mfs_file_t * file, int block_index)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    bool crc32c = conf->flags & MFS_FLAG_CRC32C;
+
+    STATS_PURPOSE(mfs, MFS_IO_DATA);
+
+    while(1) {
+        if(file->block_cursor == conf->block_size - 8) {
+            res = file_advance(mfs, file);
+            if(res) return res;
+        }
+
+        /* the data lines up with where it goes since the headers match */
+        uint8_t header[8];
+        memcpy(header, file->block_buf, 8);
+        const uint8_t * block;
+        res = block_get(conf, block_index, file->block_buf, &block);
+        if(res) return res;
+        if(file->block_cursor && block == file->block_buf) memcpy(file->block_buf, header, 8);
+
+        int32_t unoccupied_data_bytes;
+        memcpy(&unoccupied_data_bytes, block + (conf->block_size - 8), 4);
+        uint32_t next_block_index;
+        memcpy(&next_block_index, block + (conf->block_size - 4), 4);
+        int data_end = conf->block_size - 8 - (unoccupied_data_bytes < 0 ? 0 : unoccupied_data_bytes);
+        if(block != file->block_buf) {
+            memcpy(file->block_buf + file->block_cursor, block + file->block_cursor, data_end - file->block_cursor);
+        }
+        /* the tokens of a compressed last block are moved before they are summed */
+        if(file->compressed && unoccupied_data_bytes >= 0) file->unsummed = file->block_cursor;
+        else {
+            file->writer_checksum = chain_checksum_update(mfs, crc32c, file->writer_checksum, file->block_buf + file->block_cursor,
+                                                          data_end - file->block_cursor);
+        }
+        file->block_cursor = data_end;
+
+        if(unoccupied_data_bytes >= 0) return 0;
+        block_index = next_block_index;
+    }
+}
+
+/* the tokens of the last block of a compressed segment just copied into
+   a file being written are moved back up to the end, so writing can go on */
+static int file_reopen_tokens(const mfs_conf_t * conf, mfs_file_t * file)
+{
+    int data_start = file->block == file->first_block ? file->header_size : 0;
+    int data_end = conf->block_size - 8;
+    int literals = data_start;
+    int tokens = file->block_cursor;
+    while(1) {
+        int src;
+        int len = token_decode(file->block_buf, data_start, &literals, &tokens, &src);
+        if(len < 0) return MFS_INTERNAL_ASSERTION_ERROR;
+        if(!len) break;
+    }
+    if(tokens != literals) return MFS_INTERNAL_ASSERTION_ERROR;
+    int token_len = file->block_cursor - literals;
+    memmove(file->block_buf + data_end - token_len, file->block_buf + literals, token_len);
+    file->block_cursor = literals;
+    file->tokens = data_end - token_len;
+    return 0;
+}
+
+static int file_open(mfs_t * mfs, mfs_file_t * file, const char * name, mfs_mode_t mode)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    int i;
+    int absorbed = -1;
+
+    int name_len = strlen(name);
+    if(name_len > conf->block_size - (4 + 4 + 1 + 1 + 4 + 4)
+       || name_len < 1) {
+        return MFS_FILE_NAME_BAD_LEN_ERROR;
+    }
+
+    uint32_t hash = checksum_update(CHECKSUM_INIT_VAL, (const uint8_t *) name, name_len);
+    if(name_busy(mfs, hash, mode != MFS_MODE_READ)) {
+        return MFS_FILE_BUSY_ERROR;
+    }
+
+    int match_index;
+    const uint8_t * block;
+    res = find_file(mfs, name, file->block_buf, &match_index, &block);
+    if(res) return res;
+
+    bool compressed = false;
+    if(match_index >= 0) {
+        bool remounted;
+        res = verify_file(mfs, match_index, file->block_buf, &block, &remounted);
+        if(res) return res;
+        if(remounted) return file_open(mfs, file, name, mode);
+        compressed = header_compressed(block);
+    }
+
+    if(mode == MFS_MODE_READ) {
+        if(match_index < 0) {
+            return MFS_FILE_NOT_FOUND_ERROR;
+        }
+        file->block = match_index;
+        file->first_block = match_index;
+        file->segment = match_index;
+        file->segment_offset = 0;
+    }
+    else {
+        /* a new segment goes on after the last one unless that is a
+           segment short enough to be copied into it instead */
+        int continued = -1;
+        if(mode == MFS_MODE_APPEND && match_index >= 0) {
+            int last;
+            res = segment_last(mfs, match_index, name, file->block_buf, &last, &continued);
+            if(res) return res;
+            bool is_short = false;
+            if(last != match_index) {
+                res = chain_is_short(conf, last, file->block_buf, &is_short);
+                if(res) return res;
+            }
+            if(is_short) absorbed = last;
+            else continued = last;
+        }
+
+        file->match_index = match_index;
+        file->continued = continued;
+        file->absorbed = absorbed;
+        /* an append goes on from the info of the file, when it is known */
+        file->content_size = conf->file_info_aux_memory ? 0 : -1;
+        file->content_checksum = 0;
+        if(mode == MFS_MODE_APPEND && match_index >= 0 && conf->file_info_aux_memory) {
+            const uint32_t * slot = file_info_slot(conf, match_index);
+            mfs_file_info_t info = {slot[0], slot[1]};
+            bool found = slot[0] != FILE_INFO_UNKNOWN;
+            if(!found) {
+                res = file_info_stored(mfs, match_index, file->block_buf, &info, &found);
+                if(res) return res;
+            }
+            file->content_size = found ? (int) info.size : -1;
+            file->content_checksum = info.checksum;
+        }
+        file->reserved_blocks = 0;
+        i = alloc_block(mfs, file, conf->block_count - 1, 1);
+        if(i < 0) {
+            return MFS_NO_SPACE_ERROR;
+        }
+        uint8_t * unverified = unverified_bit_buf(mfs);
+        if(unverified) clear_bit(unverified, i);
+        if(mfs->youngest == UINT32_MAX) {
+            SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_BIRTHDAY_LIMIT_REACHED_ERROR);
+        }
+        mfs->youngest += 1;
+        memcpy(file->block_buf, &mfs->youngest, 4);
+        bool crc32c = conf->flags & MFS_FLAG_CRC32C;
+        int32_t prefer_if_older = continued >= 0 ? continued ^ PREFER_SEGMENT_BIT : file->match_index;
+        if(crc32c) prefer_if_older ^= PREFER_CRC32C_BIT;
+        /* segments go on the way the file was written */
+        compressed = compressed && mode == MFS_MODE_APPEND;
+        if(compressed) prefer_if_older ^= PREFER_COMPRESSED_BIT;
+        if(file->content_size >= 0) prefer_if_older ^= PREFER_INFO_BIT;
+        memcpy(file->block_buf + 4, &prefer_if_older, 4);
+        strcpy((char *) file->block_buf + 8, name);
+        file->writer_checksum = chain_checksum_update(mfs, crc32c, chain_checksum_init(crc32c), file->block_buf, 8 + name_len + 1);
+        file->block = i;
+        file->first_block = i;
+    }
+
+    file->block_cursor = 8 + name_len + 1;
+    file->header_size = file->block_cursor;
+    file->block_number = 0;
+    file->skip_index = NULL;
+    file->compressed = compressed;
+    file->tokens = mode == MFS_MODE_READ ? -1 : conf->block_size - 8;
+    file->token_offset = 0;
+    file->stream_offset = 0;
+    file->match_table = NULL;
+    file->literal_token = -1;
+    file->unsummed = file->block_cursor;
+    file_stage(conf, file, file->block_buf, 1);
+    if(mode == MFS_MODE_READ && block != file->block_buf) {
+        /* a cached block can be replaced while the file is open */
+        if(conf->map_block) {
+            file->block_buf = (uint8_t *) block;
+            file->staged_count = 0;
+        }
+        else memcpy(file->block_buf, block, conf->block_size);
+    }
+    file->writes_started = 0;
+    file->writes_done = 0;
+    file->write_error = 0;
+    file->name_hash = hash;
+
+    file->mode = mode == MFS_MODE_APPEND ? MFS_MODE_WRITE : mode;
+    STATE_LOCK(mfs);
+    file->next_open = mfs->open_files;
+    mfs->open_files = file;
+    STATE_UNLOCK(mfs);
+
+    if(absorbed >= 0) {
+        res = file_copy_chain(mfs, file, absorbed);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+        if(compressed) {
+            res = file_reopen_tokens(conf, file);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+        }
+    }
+    return 0;
+}
+
+/* the block `block_number` of a file being read was just loaded */
+static void skip_index_note(mfs_file_t * file)
+{
+    if(!file->skip_index || file->segment != file->first_block || file->block_number % file->skip_stride) return;
+    int entry = file->block_number / file->skip_stride;
+    if(entry != file->skip_index_filled) return;
+
+    if(entry == file->skip_index_len) {
+        for(int i = 0; i * 2 < file->skip_index_len; i++) {
+            file->skip_index[i] = file->skip_index[i * 2];
+        }
+        file->skip_index_filled = (file->skip_index_len + 1) / 2;
+        file->skip_stride *= 2;
+        if(file->block_number % file->skip_stride) return;
+        entry = file->block_number / file->skip_stride;
+        if(entry != file->skip_index_filled) return;
+    }
+
+    file->skip_index[entry] = file->block;
+    file->skip_index_filled++;
+}
+
+static int file_offset(const mfs_conf_t * conf, const mfs_file_t * file)
+{
+    if(!file->block_number) return file->segment_offset + file->block_cursor - file->header_size;
+    return file->segment_offset
+           + (conf->block_size - 8 - file->header_size)
+           + (file->block_number - 1) * (conf->block_size - 8)
+           + file->block_cursor;
+}
+
+/* go on to the segment after the one being read, if any. the staging
+   blocks are borrowed to find it */
+static int file_next_segment(mfs_t * mfs, mfs_file_t * file, bool * moved_dst)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    *moved_dst = false;
+    int next;
+    res = segment_next(mfs, file->segment, file->staging, &next);
+    if(res) return res;
+    if(next < 0) return 0;
+
+    file->staged_count = 0;
+    file->segment_offset = file->compressed ? file->stream_offset : file_offset(conf, file);
+    res = file_load(conf, file, next);
+    if(res) return res;
+    file->segment = next;
+    file->block = next;
+    file->block_number = 0;
+    file->block_cursor = file->header_size;
+    file->tokens = -1;
+    file->token_offset = 0;
+    *moved_dst = true;
+    return 0;
+}
+
+/* the decoded bytes of a compressed file being read that are left in its
+   current token, moving on to the next token when there are none. 0 at
+   the end of the block's data */
+static int file_token(mfs_file_t * file, int data_end, int * src_dst)
+{
+    int data_start = file->block_number ? 0 : file->header_size;
+    if(file->tokens < 0) file->tokens = data_end;
+    while(1) {
+        int literals = file->block_cursor;
+        int tokens = file->tokens;
+        int len = token_decode(file->block_buf, data_start, &literals, &tokens, src_dst);
+        if(len <= 0) return len;
+        if(file->token_offset < len) {
+            *src_dst += file->token_offset;
+            return len - file->token_offset;
+        }
+        file->block_cursor = literals;
+        file->tokens = tokens;
+        file->token_offset = 0;
+    }
+}
+
+static int file_read(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    STATS_PURPOSE(mfs, MFS_IO_DATA);
+
+    int total_read = 0;
+
+    while(size) {
+        int32_t unoccupied_data_bytes;
+        memcpy(&unoccupied_data_bytes, file->block_buf + (conf->block_size - 8), 4);
+        bool has_next_block = unoccupied_data_bytes < 0;
+        if(has_next_block) unoccupied_data_bytes = 0;
+
+        int block_len_remaining = conf->block_size - file->block_cursor - unoccupied_data_bytes - 8;
+        int src = file->block_cursor;
+        if(file->compressed) {
+            block_len_remaining = file_token(file, conf->block_size - unoccupied_data_bytes - 8, &src);
+            if(block_len_remaining < 0) SET_FILE_CLOSED_THEN_RETURN(mfs, file, MFS_INTERNAL_ASSERTION_ERROR);
+        }
+
+        if(!block_len_remaining) {
+            chain_note_trailer(conf, file->block, file->block_buf + (conf->block_size - 8));
+            if(!has_next_block) {
+                bool moved;
+                res = file_next_segment(mfs, file, &moved);
+                if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+                if(moved) continue;
+                break;
+            }
+
+            uint32_t new_block_idx;
+            memcpy(&new_block_idx, file->block_buf + (conf->block_size - 4), 4);
+
+            int direct = 0;
+            if(conf->read_range && !conf->map_block && file->staging_block_count == 1 && !file->compressed) {
+                res = file_load_range(conf, file, new_block_idx, dst, size, &direct);
+            }
+            else {
+                res = file_load(conf, file, new_block_idx);
+            }
+            if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+
+            file->block_cursor = direct;
+            file->tokens = -1;
+            file->token_offset = 0;
+            file->block = new_block_idx;
+            file->block_number += 1;
+            skip_index_note(file);
+
+            size -= direct;
+            dst += direct;
+            total_read += direct;
+            continue;
+        }
+
+        int copy_amount = block_len_remaining < size ? block_len_remaining : size;
+
+        memcpy(dst, &file->block_buf[src], copy_amount);
+
+        size -= copy_amount;
+        dst += copy_amount;
+        if(file->compressed) {
+            file->token_offset += copy_amount;
+            file->stream_offset += copy_amount;
+        }
+        else file->block_cursor += copy_amount;
+        total_read += copy_amount;
+    }
+
+    return total_read;
+}
+
+/* where a compressed file's data goes is not known without decoding it,
+   so it is read through from the start or from where it is being read */
+static int file_seek_compressed(mfs_t * mfs, mfs_file_t * file, int offset)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    if(offset < file->stream_offset) {
+        file->staged_count = 0;
+        res = file_load(conf, file, file->first_block);
+        if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+        file->segment = file->first_block;
+        file->segment_offset = 0;
+        file->block = file->first_block;
+        file->block_number = 0;
+        file->block_cursor = file->header_size;
+        file->tokens = -1;
+        file->token_offset = 0;
+        file->stream_offset = 0;
+    }
+
+    uint8_t discard[64];
+    while(file->stream_offset < offset) {
+        int len = offset - file->stream_offset;
+        res = file_read(mfs, file, discard, len < (int) sizeof(discard) ? len : (int) sizeof(discard));
+        if(res < 0) return res;
+        if(!res) break;
+    }
+    return file->stream_offset;
+}
+
+static int file_seek(mfs_t * mfs, mfs_file_t * file, int offset)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    STATS_PURPOSE(mfs, MFS_IO_DATA);
+
+    if(offset < 0) offset = 0;
+    if(file->compressed) return file_seek_compressed(mfs, file, offset);
+
+    int block_data_size = conf->block_size - 8;
+    int first_block_data_size = block_data_size - file->header_size;
+
+    if(offset < file->segment_offset) {
+        file->segment = file->first_block;
+        file->segment_offset = 0;
+        file->staged_count = 0;
+        file->block = file->first_block;
+        file->block_number = 0;
+    }
+
+    if(!file->staged_count) {
+        res = file_load(conf, file, file->block);
+        if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+    }
+
+    while(1) {
+        int segment_offset = offset - file->segment_offset;
+        int target_number;
+        int target_cursor;
+        if(segment_offset < first_block_data_size) {
+            target_number = 0;
+            target_cursor = file->header_size + segment_offset;
+        }
+        else {
+            target_number = 1 + (segment_offset - first_block_data_size) / block_data_size;
+            target_cursor = (segment_offset - first_block_data_size) % block_data_size;
+        }
+
+        /* walk from the loaded block or the nearest known one before the target */
+        int from_number = 0;
+        uint32_t from_block = file->segment;
+        if(file->skip_index && file->segment == file->first_block) {
+            int entry = target_number / file->skip_stride;
+            if(entry >= file->skip_index_filled) entry = file->skip_index_filled - 1;
+            from_number = entry * file->skip_stride;
+            from_block = file->skip_index[entry];
+        }
+        if(file->block_number > target_number || file->block_number < from_number) {
+            res = file_load(conf, file, from_block);
+            if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+            file->block = from_block;
+            file->block_number = from_number;
+        }
+
+        int32_t unoccupied_data_bytes;
+        bool past_end = false;
+        while(file->block_number < target_number) {
+            chain_note_trailer(conf, file->block, file->block_buf + (conf->block_size - 8));
+            memcpy(&unoccupied_data_bytes, file->block_buf + (conf->block_size - 8), 4);
+            if(unoccupied_data_bytes >= 0) {
+                past_end = true;
+                break;
+            }
+
+            uint32_t new_block_idx;
+            memcpy(&new_block_idx, file->block_buf + (conf->block_size - 4), 4);
+
+            res = file_load(conf, file, new_block_idx);
+            if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+
+            file->block = new_block_idx;
+            file->block_number += 1;
+            skip_index_note(file);
+        }
+
+        memcpy(&unoccupied_data_bytes, file->block_buf + (conf->block_size - 8), 4);
+        if(unoccupied_data_bytes < 0) unoccupied_data_bytes = 0;
+        if(past_end || target_cursor > block_data_size - unoccupied_data_bytes) {
+            /* the rest is in the next segment, if any */
+            file->block_cursor = block_data_size - unoccupied_data_bytes;
+            bool moved;
+            res = file_next_segment(mfs, file, &moved);
+            if(res) SET_FILE_CLOSED_THEN_RETURN(mfs, file, res);
+            if(moved) continue;
+            target_cursor = block_data_size - unoccupied_data_bytes;
+        }
+        file->block_cursor = target_cursor;
+
+        return file_offset(conf, file);
+    }
+}
+
+/* add to the size and CRC32C kept in the final block */
+static void file_count_content(mfs_file_t * file, const uint8_t * src, int len)
+{
+    if(file->content_size < 0) return;
+    file->content_size += len;
+    file->content_checksum = crc32c_update(file->content_checksum, src, len);
+}
+
+/* write the current block of a file being written with the rest of its
+   data taken straight from `src`, which goes on into another block */
+static int file_write_iov(mfs_t * mfs, mfs_file_t * file, const uint8_t * src)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    int len = conf->block_size - file->block_cursor - 8;
+
+    int i = alloc_block(mfs, file, file->block, file_run(file));
+    if(i < 0) return MFS_NO_SPACE_ERROR;
+
+    uint8_t trailer[8];
+    int32_t unoccupied_data_bytes = -1;
+    memcpy(trailer, &unoccupied_data_bytes, 4);
+    memcpy(trailer + 4, &i, 4);
+    file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum, src, len);
+    file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum, trailer, 8);
+    file_count_content(file, src, len);
+    chain_note(conf, file->block, i);
+
+    mfs_iov_t iov[3];
+    int iov_count = 0;
+    if(file->block_cursor) iov[iov_count++] = (mfs_iov_t) {file->block_buf, file->block_cursor};
+    iov[iov_count++] = (mfs_iov_t) {src, len};
+    iov[iov_count++] = (mfs_iov_t) {trailer, 8};
+    cache_drop(conf, file->block, 1);
+    res = conf->write_block_iov(conf->cb_ctx, file->block, iov, iov_count);
+    if(res) return res;
+
+    if(conf->flags & MFS_FLAG_VERIFY_WRITES) {
+        uint32_t expected = 0;
+        for(int j = 0; j < iov_count; j++) expected = crc32c_update(expected, iov[j].base, iov[j].len);
+        res = readback(mfs, file->block, file->block_buf, 1, expected);
+        if(res) return res;
+        STATS_PURPOSE(mfs, MFS_IO_DATA);
+    }
+
+    file->block_cursor = 0;
+    file->block = i;
+    file->staged_first = i;
+    return 0;
+}
+
+/* the tokens of a compressed block being written are patched as they
+   go, so its data is only checksummed once the block is done */
+static void file_sum_tokens(mfs_t * mfs, mfs_file_t * file)
+{
+    const mfs_conf_t * conf = mfs->conf;
+    file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum,
+                                                  file->block_buf + file->unsummed, file->block_cursor - file->unsummed);
+    file->unsummed = file->block_cursor;
+}
+
+/* greedy. a match is looked for at each byte among the literals of the
+   block with the same first 4 bytes in the match table */
+static int file_write_compressed(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+    int data_end = conf->block_size - 8;
+
+    file_count_content(file, src, size);
+
+    int i = 0;
+    while(i < size) {
+        uint8_t * block = file->block_buf;
+        int literals = file->block_cursor;
+        int room = file->tokens - literals;
+
+        uint32_t * entry = NULL;
+        if(file->match_table && size - i >= TOKEN_MIN_MATCH) {
+            uint32_t word;
+            memcpy(&word, src + i, 4);
+            entry = &file->match_table[(uint64_t) (uint32_t) (word * 2654435761u) >> file->match_shift];
+            /* an entry from another block or file is no match, since the bytes are compared */
+            uint32_t position = *entry - file->match_base;
+            int match = position < (uint32_t) literals ? (int) position : -1;
+            int data_start = file->block == file->first_block ? file->header_size : 0;
+            if(room >= 3 && match >= data_start && literals - match <= 0xffff) {
+                int len = 0;
+                while(len < TOKEN_MAX_MATCH && i + len < size && match + len < literals && block[match + len] == src[i + len]) {
+                    len++;
+                }
+                if(len >= TOKEN_MIN_MATCH) {
+                    file->tokens -= 3;
+                    block[file->tokens + 2] = TOKEN_MATCH | (len - TOKEN_MIN_MATCH);
+                    block[file->tokens + 1] = (literals - match) & 0xff;
+                    block[file->tokens] = (literals - match) >> 8;
+                    file->literal_token = -1;
+                    i += len;
+                    continue;
+                }
+            }
+        }
+
+        bool run_open = file->literal_token >= 0 && block[file->literal_token] < TOKEN_MAX_LITERALS;
+        if(room < (run_open ? 1 : 2)) {
+            if(room) {
+                block[file->tokens - 1] = 0;
+                memset(block + literals, 0xff, room - 1);
+            }
+            file->block_cursor = data_end;
+            file_sum_tokens(mfs, file);
+            res = file_advance(mfs, file);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            file->unsummed = 0;
+            file->tokens = data_end;
+            file->literal_token = -1;
+            file->match_base += conf->block_size;
+            continue;
+        }
+
+        if(!run_open) {
+            file->literal_token = --file->tokens;
+            block[file->literal_token] = 0;
+        }
+        if(entry) *entry = file->match_base + literals;
+        block[file->block_cursor++] = src[i++];
+        block[file->literal_token]++;
+    }
+
+    return size;
+}
+
+/* the tokens of the last block of a compressed file being written are
+   moved down to the literals, so the block ends like any other file's */
+static void file_close_tokens(const mfs_conf_t * conf, mfs_file_t * file)
+{
+    int data_end = conf->block_size - 8;
+    memmove(file->block_buf + file->block_cursor, file->block_buf + file->tokens, data_end - file->tokens);
+    file->block_cursor += data_end - file->tokens;
+    file->tokens = data_end;
+}
+
+static int file_write(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    STATS_PURPOSE(mfs, MFS_IO_DATA);
+
+    if(file->compressed) return file_write_compressed(mfs, file, src, size);
+
+    int write_size_left = size;
+
+    while(write_size_left) {
+        int block_len_remaining = conf->block_size - file->block_cursor - 8;
+
+        if(!block_len_remaining) {
+            res = file_advance(mfs, file);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            block_len_remaining = conf->block_size - 8;
+        }
+
+        if(conf->write_block_iov && !conf->write_block_start && file->staging_block_count == 1
+           && write_size_left > block_len_remaining) {
+            res = file_write_iov(mfs, file, src);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            write_size_left -= block_len_remaining;
+            src += block_len_remaining;
+            continue;
+        }
+
+        int copy_amount = block_len_remaining < write_size_left ? block_len_remaining : write_size_left;
+
+        file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum, src, copy_amount);
+        file_count_content(file, src, copy_amount);
+        memcpy(file->block_buf + file->block_cursor, src, copy_amount);
+
+        write_size_left -= copy_amount;
+        src += copy_amount;
+        file->block_cursor += copy_amount;
+    }
+
+    return size;
+}
+
+static int file_close_untraced(mfs_t * mfs, mfs_file_t * file)
+{
+    int res;
+    const mfs_conf_t * conf = mfs->conf;
+
+    if(file->mode == MFS_MODE_WRITE) {
+        if(file->compressed) {
+            file_close_tokens(conf, file);
+            file_sum_tokens(mfs, file);
+        }
+        int32_t unoccupied_data_bytes = conf->block_size - file->block_cursor - 8;
+        memset(file->block_buf + file->block_cursor, 0xff, unoccupied_data_bytes);
+        if(file->content_size >= 0 && unoccupied_data_bytes >= 8) {
+            uint32_t info[2] = {file->content_size, file->content_checksum};
+            memcpy(file->block_buf + (conf->block_size - 16), info, 8);
+        }
+        memcpy(file->block_buf + (conf->block_size - 8), &unoccupied_data_bytes, 4);
+        file->writer_checksum = chain_checksum_update(mfs, conf->flags & MFS_FLAG_CRC32C, file->writer_checksum, file->block_buf + file->block_cursor, unoccupied_data_bytes + 4);
+        memcpy(file->block_buf + (conf->block_size - 4), &file->writer_checksum, 4);
+        chain_note(conf, file->block, CHAIN_END);
+
+        STATS_PURPOSE(mfs, MFS_IO_COMMIT);
+        TRACE(mfs, MFS_TRACE_CLOSE_INVALIDATE, MFS_TRACE_INSTANT, -1, 0);
+        res = checkpoint_invalidate(mfs, file->block_buf);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+        /* the blocks of an asynchronous writer were not read back as they went */
+        bool verify_writes = (conf->flags & MFS_FLAG_VERIFY_WRITES) && !conf->write_block_start;
+        bool verify_trailer = conf->flags & MFS_FLAG_VERIFY_TRAILER;
+        int staged = (file->block_buf - file->staging) / conf->block_size + 1;
+        uint8_t * final_block_buf = file->block_buf;
+        uint32_t expected = 0;
+        if(verify_writes) expected = crc32c_update(0, file->staging, staged * conf->block_size);
+        else if(verify_trailer) expected = crc32c_update(0, final_block_buf, conf->block_size);
+
+        STATS_PURPOSE(mfs, MFS_IO_DATA);
+        TRACE(mfs, MFS_TRACE_CLOSE_FLUSH, MFS_TRACE_INSTANT, -1, 0);
+        res = file_flush(conf, file);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+        TRACE(mfs, MFS_TRACE_CLOSE_VERIFY, MFS_TRACE_INSTANT, -1, 0);
+
+        if(verify_writes) {
+            res = readback(mfs, file->staged_first, file->staging, staged, expected);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+        }
+        else if(verify_trailer) {
+            res = readback(mfs, file->block, final_block_buf, 1, expected);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+        }
+        else {
+            STATS_PURPOSE(mfs, MFS_IO_VERIFY);
+            int end_index;
+            res = scan_file(mfs, &end_index, file->first_block, mfs->bit_bufs[SCRATCH_1], file->block_buf);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            if(end_index < 0) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
+        }
+        STATS_PURPOSE(mfs, MFS_IO_COMMIT);
+        TRACE(mfs, MFS_TRACE_CLOSE_COMMIT, MFS_TRACE_INSTANT, -1, 0);
+
+        /* only now, so that files being written are never listed or found */
+        if(file->continued >= 0) {
+            bits_set(mfs->bit_bufs[SEGMENT_START_BLOCKS], conf->block_count, file->first_block);
+            bits_set(mfs->bit_bufs[CONTINUED_BLOCKS], conf->block_count, file->continued);
+            int tail = chain_tail(conf, file->continued);
+            if(tail >= 0) chain_note(conf, tail, CHAIN_SEGMENT | file->first_block);
+
+            /* the older segment after the same block no longer counts */
+            if(file->absorbed >= 0) {
+                TRACE(mfs, MFS_TRACE_CLOSE_RELEASE, MFS_TRACE_INSTANT, file->absorbed, 0);
+                bits_clear(mfs->bit_bufs[SEGMENT_START_BLOCKS], conf->block_count, file->absorbed);
+                res = file_blocks(mfs, file->absorbed, mfs->bit_bufs[SCRATCH_1], file->block_buf);
+                if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+                blocks_release(mfs, mfs->bit_bufs[SCRATCH_1]);
+            }
+        }
+        else {
+            bits_set(mfs->bit_bufs[FILE_START_BLOCKS], conf->block_count, file->first_block);
+            name_index_insert(mfs, file->first_block, file->name_hash);
+        }
+
+        uint32_t * slot = file_info_slot(conf, file->continued >= 0 ? file->match_index : file->first_block);
+        if(slot) {
+            slot[0] = file->content_size >= 0 ? (uint32_t) file->content_size : FILE_INFO_UNKNOWN;
+            slot[1] = file->content_checksum;
+        }
+
+        if(file->continued < 0 && file->match_index != -1) {
+            TRACE(mfs, MFS_TRACE_CLOSE_RELEASE, MFS_TRACE_INSTANT, file->match_index, 0);
+            bits_clear(mfs->bit_bufs[FILE_START_BLOCKS], conf->block_count, file->match_index);
+            name_index_remove(mfs, file->match_index);
+
+            res = file_blocks(mfs, file->match_index, mfs->bit_bufs[SCRATCH_1], file->block_buf);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+            blocks_release(mfs, mfs->bit_bufs[SCRATCH_1]);
+
+            res = segments_release(mfs, file->match_index, file->block_buf);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+
+            /* clobber the first page */
+            memset(file->block_buf, 0xff, conf->block_size);
+            cache_drop(conf, file->match_index, 1);
+            res = conf->write_block(conf->cb_ctx, file->match_index, file->block_buf);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            const uint8_t * block;
+            res = block_get(conf, file->match_index, file->block_buf, &block);
+            if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+            for(int i = 0; i < conf->block_size; i++) {
+                if(block[i] != 0xff) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, MFS_READBACK_ERROR);
+            }
+        }
+        else if(file->continued < 0) {
+            mfs->file_count += 1;
+        }
+
+        file_forget(mfs, file);
+
+        TRACE(mfs, MFS_TRACE_CLOSE_CHECKPOINT, MFS_TRACE_INSTANT, -1, 0);
+        res = checkpoint_save(mfs, file->block_buf);
+        if(res) SET_NEEDS_REMOUNT_THEN_RETURN(mfs, res);
+        return 0;
+    }
+
+    file_forget(mfs, file);
+
+    return 0;
+}
+
+static int file_close(mfs_t * mfs, mfs_file_t * file)
+{
+    TRACE(mfs, MFS_TRACE_CLOSE, MFS_TRACE_BEGIN, file->first_block, 0);
+    int res = file_close_untraced(mfs, file);
+    TRACE(mfs, MFS_TRACE_CLOSE, MFS_TRACE_END, file->first_block, res != 0);
+    return res;
+}
+
+int mfs_open(mfs_t * mfs, const char * name, mfs_mode_t mode)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(mfs->file.mode != -1) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        file_forget(mfs, &mfs->file);
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    mfs->file.block_buf = mfs->block_buf;
+    res = file_open(mfs, &mfs->file, name, mode);
+    if(res) return res;
+
+    const mfs_conf_t * conf = mfs->conf;
+    if(conf->aligned_staging_memory) {
+        file_stage(conf, &mfs->file, conf->aligned_staging_memory, conf->staging_block_count);
+        if(mfs->file.mode == MFS_MODE_WRITE) file_place_head(mfs, &mfs->file);
+    }
+    return 0;
+}
+
+int mfs_read(mfs_t * mfs, uint8_t * dst, int size)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode != MFS_MODE_READ) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_read(mfs, &mfs->file, dst, size);
+}
+
+int mfs_seek(mfs_t * mfs, int offset)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode != MFS_MODE_READ) {
+        if(mfs->file.mode == MFS_MODE_WRITE) mfs->needs_remount = true;
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_seek(mfs, &mfs->file, offset);
+}
+
+int mfs_pread(mfs_t * mfs, uint8_t * dst, int size, int offset)
+{
+    int res = mfs_seek(mfs, offset);
+    if(res < 0) return res;
+
+    return file_read(mfs, &mfs->file, dst, size);
+}
+
+int mfs_reserve(mfs_t * mfs, int size)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode != MFS_MODE_WRITE || size < 0) {
+        SET_FILE_CLOSED_THEN_RETURN(mfs, &mfs->file, MFS_WRONG_MODE_ERROR);
+    }
+
+    return file_reserve(mfs, &mfs->file, size);
+}
+
+int mfs_write(mfs_t * mfs, const uint8_t * src, int size)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode != MFS_MODE_WRITE) {
+        SET_FILE_CLOSED_THEN_RETURN(mfs, &mfs->file, MFS_WRONG_MODE_ERROR);
+    }
+
+    return file_write(mfs, &mfs->file, src, size);
+}
+
+int mfs_close(mfs_t * mfs)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode == -1) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_close(mfs, &mfs->file);
+}
+
+int mfs_fopen(mfs_t * mfs, mfs_file_t * file, void * aligned_block_buf, const char * name, mfs_mode_t mode)
+{
+    int res;
+
+    if(mfs->needs_remount) if((res = remount(mfs, false))) return res;
+
+    if(file_is_open(mfs, file)) return MFS_WRONG_MODE_ERROR;
+
+    file->block_buf = aligned_block_buf;
+    file->mode = -1;
+    return file_open(mfs, file, name, mode);
+}
+
+int mfs_fread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_READ) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_read(mfs, file, dst, size);
+}
+
+int mfs_fwrite(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_WRITE) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_write(mfs, file, src, size);
+}
+
+int mfs_fclose(mfs_t * mfs, mfs_file_t * file)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file)) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_close(mfs, file);
+}
+
+int mfs_fseek(mfs_t * mfs, mfs_file_t * file, int offset)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_READ) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_seek(mfs, file, offset);
+}
+
+int mfs_fpread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size, int offset)
+{
+    int res = mfs_fseek(mfs, file, offset);
+    if(res < 0) return res;
+
+    return file_read(mfs, file, dst, size);
+}
+
+int mfs_fskip_index(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_READ
+       || entry_count < 1) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    file->skip_index = entries;
+    file->skip_index_len = entry_count;
+    file->skip_stride = 1;
+    entries[0] = file->first_block;
+    file->skip_index_filled = 1;
+    if(file->block_number) skip_index_note(file);
+
+    return 0;
+}
+
+static int file_compress(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    if(!file->compressed) {
+        /* only a whole file is compressed, before anything is written to it */
+        if(file->continued >= 0 || file->block != file->first_block || file->block_cursor != file->header_size) {
+            return MFS_WRONG_MODE_ERROR;
+        }
+        const mfs_conf_t * conf = mfs->conf;
+        bool crc32c = conf->flags & MFS_FLAG_CRC32C;
+        int32_t prefer_if_older;
+        memcpy(&prefer_if_older, file->block_buf + 4, 4);
+        prefer_if_older ^= PREFER_COMPRESSED_BIT;
+        memcpy(file->block_buf + 4, &prefer_if_older, 4);
+        file->writer_checksum = chain_checksum_update(mfs, crc32c, chain_checksum_init(crc32c), file->block_buf, file->header_size);
+        file->compressed = true;
+    }
+
+    /* the largest power of two */
+    file->match_shift = 32;
+    while(entry_count > 1) {
+        entry_count /= 2;
+        file->match_shift--;
+    }
+    file->match_table = entries;
+    file->match_base = 0;
+
+    return 0;
+}
+
+int mfs_fcompress(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_WRITE
+       || entry_count < 1) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_compress(mfs, file, entries, entry_count);
+}
+
+int mfs_compress(mfs_t * mfs, uint32_t * entries, int entry_count)
+{
+    if(mfs->needs_remount) return MFS_WRONG_MODE_ERROR;
+
+    if(mfs->file.mode != MFS_MODE_WRITE || entry_count < 1) {
+        SET_FILE_CLOSED_THEN_RETURN(mfs, &mfs->file, MFS_WRONG_MODE_ERROR);
+    }
+
+    return file_compress(mfs, &mfs->file, entries, entry_count);
+}
+
+int mfs_freserve(mfs_t * mfs, mfs_file_t * file, int size)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || file->mode != MFS_MODE_WRITE
+       || size < 0) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    return file_reserve(mfs, file, size);
+}
+
+int mfs_fstaging(mfs_t * mfs, mfs_file_t * file, void * aligned_blocks, int block_count)
+{
+    if(mfs->needs_remount || !file_is_open(mfs, file) || block_count < 1) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+    /* mapped blocks need no staging to be read */
+    if(mfs->conf->map_block && file->mode == MFS_MODE_READ) return 0;
+    if(file->block_buf != file->staging || !file->staged_count) {
+        return MFS_WRONG_MODE_ERROR;
+    }
+
+    file_stage(mfs->conf, file, aligned_blocks, block_count);
+    if(file->mode == MFS_MODE_WRITE) file_place_head(mfs, file);
+
+    return 0;
+}
+
+void mfs_write_done(void * done_ctx, int res)
+{
+    mfs_file_t * file = done_ctx;
+
+    if(res && !file->write_error) file->write_error = res;
+    file->writes_done += 1;
+}
+
+#if defined(MFS_STATS) || defined(MFS_TRACE)
+
+#undef mfs_mount
+
+/* the user's callbacks, counted against what the library is doing and traced */
+
+static int shim_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, reads[mfs->stats_purpose], 1);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_BEGIN, block_index, 1);
+    int res = mfs->user_conf->read_block(mfs->user_conf->cb_ctx, block_index, dst);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+static int shim_write_block(void * cb_ctx, int block_index, const void * src)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, writes[mfs->stats_purpose], 1);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_BEGIN, block_index, 1);
+    int res = mfs->user_conf->write_block(mfs->user_conf->cb_ctx, block_index, src);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+static int shim_read_blocks(void * cb_ctx, int block_index, int block_count, void * dst)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, reads[mfs->stats_purpose], block_count);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_BEGIN, block_index, block_count);
+    int res = mfs->user_conf->read_blocks(mfs->user_conf->cb_ctx, block_index, block_count, dst);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+static int shim_write_blocks(void * cb_ctx, int block_index, int block_count, const void * src)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, writes[mfs->stats_purpose], block_count);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_BEGIN, block_index, block_count);
+    int res = mfs->user_conf->write_blocks(mfs->user_conf->cb_ctx, block_index, block_count, src);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+/* only the start is seen */
+static int shim_write_block_start(void * cb_ctx, int block_index, const void * src, void * done_ctx)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, writes[mfs->stats_purpose], 1);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_INSTANT, block_index, 1);
+    return mfs->user_conf->write_block_start(mfs->user_conf->cb_ctx, block_index, src, done_ctx);
+}
+
+static void shim_write_wait(void * cb_ctx)
+{
+    mfs_t * mfs = cb_ctx;
+    mfs->user_conf->write_wait(mfs->user_conf->cb_ctx);
+}
+
+static int shim_read_range(void * cb_ctx, int block_index, int offset, int len, void * dst)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, reads[mfs->stats_purpose], 1);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_BEGIN, block_index, 0);
+    int res = mfs->user_conf->read_range(mfs->user_conf->cb_ctx, block_index, offset, len, dst);
+    TRACE(mfs, MFS_TRACE_READ, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+static const void * shim_map_block(void * cb_ctx, int block_index)
+{
+    mfs_t * mfs = cb_ctx;
+    return mfs->user_conf->map_block(mfs->user_conf->cb_ctx, block_index);
+}
+
+static int shim_write_block_iov(void * cb_ctx, int block_index, const mfs_iov_t * iov, int iov_count)
+{
+    mfs_t * mfs = cb_ctx;
+    STATS_ADD(mfs, writes[mfs->stats_purpose], 1);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_BEGIN, block_index, 1);
+    int res = mfs->user_conf->write_block_iov(mfs->user_conf->cb_ctx, block_index, iov, iov_count);
+    TRACE(mfs, MFS_TRACE_WRITE, MFS_TRACE_END, block_index, res != 0);
+    return res;
+}
+
+#ifdef MFS_STATS
+static void stats_call_done(mfs_t * mfs, mfs_call_t call, uint64_t start)
+{
+    uint64_t cycles = MFS_STATS_CYCLES() - start + 1;
+    int bucket = 0;
+    while(cycles >>= 1) bucket++;
+    if(bucket >= MFS_STATS_LATENCY_BUCKETS) bucket = MFS_STATS_LATENCY_BUCKETS - 1;
+    mfs->stats.calls[call] += 1;
+    mfs->stats.latency[call][bucket] += 1;
+}
+
+#define STATS_CALL(mfs, call, expr) do { \
+    uint64_t start = MFS_STATS_CYCLES(); \
+    int res = (expr); \
+    stats_call_done(mfs, call, start); \
+    return res; \
+} while(0)
+#endif
+
+int mfs_mount(mfs_t * mfs, const mfs_conf_t * conf)
+{
+    /* remounting with mfs->conf keeps the user's */
+    if(conf != &mfs->shim_conf) {
+        mfs->user_conf = conf;
+        mfs->shim_conf = *conf;
+        mfs->shim_conf.cb_ctx = mfs;
+        mfs->shim_conf.read_block = shim_read_block;
+        mfs->shim_conf.write_block = shim_write_block;
+        if(conf->read_blocks) mfs->shim_conf.read_blocks = shim_read_blocks;
+        if(conf->write_blocks) mfs->shim_conf.write_blocks = shim_write_blocks;
+        if(conf->write_block_start) mfs->shim_conf.write_block_start = shim_write_block_start;
+        if(conf->write_wait) mfs->shim_conf.write_wait = shim_write_wait;
+        if(conf->read_range) mfs->shim_conf.read_range = shim_read_range;
+        if(conf->map_block) mfs->shim_conf.map_block = shim_map_block;
+        if(conf->write_block_iov) mfs->shim_conf.write_block_iov = shim_write_block_iov;
+    }
+#ifdef MFS_TRACE
+    mfs->trace_next = 0;
+    mfs->trace_wrapped = false;
+#endif
+#ifdef MFS_STATS
+    mfs_reset_stats(mfs);
+    STATS_CALL(mfs, MFS_CALL_MOUNT, mfs_mount_unwrapped(mfs, &mfs->shim_conf));
+#else
+    return mfs_mount_unwrapped(mfs, &mfs->shim_conf);
+#endif
+}
+
+#ifdef MFS_TRACE
+int mfs_trace_snapshot(const mfs_t * mfs, mfs_trace_entry_t * dst, int entry_count)
+{
+    const mfs_conf_t * user_conf = mfs->user_conf;
+    int recorded = mfs->trace_wrapped ? user_conf->trace_entry_count : mfs->trace_next;
+    int oldest = mfs->trace_wrapped ? mfs->trace_next : 0;
+    /* the newest ones when they do not all fit */
+    int skip = recorded > entry_count ? recorded - entry_count : 0;
+    for(int i = skip; i < recorded; i++) {
+        dst[i - skip] = user_conf->trace_entries[(oldest + i) % user_conf->trace_entry_count];
+    }
+    return recorded - skip;
+}
+#endif
+
+#endif
+
+#ifdef MFS_STATS
+
+#undef mfs_file_count
+#undef mfs_free_space
+#undef mfs_list_files
+#undef mfs_list_files_info
+#undef mfs_stat
+#undef mfs_delete
+#undef mfs_open
+#undef mfs_read
+#undef mfs_seek
+#undef mfs_pread
+#undef mfs_reserve
+#undef mfs_compress
+#undef mfs_write
+#undef mfs_close
+#undef mfs_fopen
+#undef mfs_fread
+#undef mfs_fwrite
+#undef mfs_fclose
+#undef mfs_fseek
+#undef mfs_fpread
+#undef mfs_fskip_index
+#undef mfs_freserve
+#undef mfs_fcompress
+#undef mfs_fstaging
+
+int mfs_file_count(mfs_t * mfs)
+{
+    STATS_CALL(mfs, MFS_CALL_FILE_COUNT, mfs_file_count_unwrapped(mfs));
+}
+
+int mfs_free_space(mfs_t * mfs)
+{
+    STATS_CALL(mfs, MFS_CALL_FREE_SPACE, mfs_free_space_unwrapped(mfs));
+}
+
+int mfs_list_files(mfs_t * mfs, void * list_file_cb_ctx, void (*list_file_cb)(void *, const char *))
+{
+    STATS_CALL(mfs, MFS_CALL_LIST_FILES, mfs_list_files_unwrapped(mfs, list_file_cb_ctx, list_file_cb));
+}
+
+int mfs_list_files_info(mfs_t * mfs, void * list_file_cb_ctx,
+                        void (*list_file_cb)(void *, const char *, const mfs_file_info_t *))
+{
+    STATS_CALL(mfs, MFS_CALL_LIST_FILES, mfs_list_files_info_unwrapped(mfs, list_file_cb_ctx, list_file_cb));
+}
+
+int mfs_stat(mfs_t * mfs, const char * name, mfs_file_info_t * info_dst)
+{
+    STATS_CALL(mfs, MFS_CALL_STAT, mfs_stat_unwrapped(mfs, name, info_dst));
+}
+
+int mfs_delete(mfs_t * mfs, const char * name)
+{
+    STATS_CALL(mfs, MFS_CALL_DELETE, mfs_delete_unwrapped(mfs, name));
+}
+
+int mfs_open(mfs_t * mfs, const char * name, mfs_mode_t mode)
+{
+    STATS_CALL(mfs, MFS_CALL_OPEN, mfs_open_unwrapped(mfs, name, mode));
+}
+
+int mfs_read(mfs_t * mfs, uint8_t * dst, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_READ, mfs_read_unwrapped(mfs, dst, size));
+}
+
+int mfs_seek(mfs_t * mfs, int offset)
+{
+    STATS_CALL(mfs, MFS_CALL_SEEK, mfs_seek_unwrapped(mfs, offset));
+}
+
+int mfs_pread(mfs_t * mfs, uint8_t * dst, int size, int offset)
+{
+    STATS_CALL(mfs, MFS_CALL_READ, mfs_pread_unwrapped(mfs, dst, size, offset));
+}
+
+int mfs_reserve(mfs_t * mfs, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_RESERVE, mfs_reserve_unwrapped(mfs, size));
+}
+
+int mfs_compress(mfs_t * mfs, uint32_t * entries, int entry_count)
+{
+    STATS_CALL(mfs, MFS_CALL_SETUP, mfs_compress_unwrapped(mfs, entries, entry_count));
+}
+
+int mfs_write(mfs_t * mfs, const uint8_t * src, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_WRITE, mfs_write_unwrapped(mfs, src, size));
+}
+
+int mfs_close(mfs_t * mfs)
+{
+    STATS_CALL(mfs, MFS_CALL_CLOSE, mfs_close_unwrapped(mfs));
+}
+
+int mfs_fopen(mfs_t * mfs, mfs_file_t * file, void * aligned_block_buf, const char * name, mfs_mode_t mode)
+{
+    STATS_CALL(mfs, MFS_CALL_OPEN, mfs_fopen_unwrapped(mfs, file, aligned_block_buf, name, mode));
+}
+
+int mfs_fread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_READ, mfs_fread_unwrapped(mfs, file, dst, size));
+}
+
+int mfs_fwrite(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_WRITE, mfs_fwrite_unwrapped(mfs, file, src, size));
+}
+
+int mfs_fclose(mfs_t * mfs, mfs_file_t * file)
+{
+    STATS_CALL(mfs, MFS_CALL_CLOSE, mfs_fclose_unwrapped(mfs, file));
+}
+
+int mfs_fseek(mfs_t * mfs, mfs_file_t * file, int offset)
+{
+    STATS_CALL(mfs, MFS_CALL_SEEK, mfs_fseek_unwrapped(mfs, file, offset));
+}
+
+int mfs_fpread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size, int offset)
+{
+    STATS_CALL(mfs, MFS_CALL_READ, mfs_fpread_unwrapped(mfs, file, dst, size, offset));
+}
+
+int mfs_fskip_index(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    STATS_CALL(mfs, MFS_CALL_SETUP, mfs_fskip_index_unwrapped(mfs, file, entries, entry_count));
+}
+
+int mfs_freserve(mfs_t * mfs, mfs_file_t * file, int size)
+{
+    STATS_CALL(mfs, MFS_CALL_RESERVE, mfs_freserve_unwrapped(mfs, file, size));
+}
+
+int mfs_fcompress(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    STATS_CALL(mfs, MFS_CALL_SETUP, mfs_fcompress_unwrapped(mfs, file, entries, entry_count));
+}
+
+int mfs_fstaging(mfs_t * mfs, mfs_file_t * file, void * aligned_blocks, int block_count)
+{
+    STATS_CALL(mfs, MFS_CALL_SETUP, mfs_fstaging_unwrapped(mfs, file, aligned_blocks, block_count));
+}
+
+void mfs_get_stats(const mfs_t * mfs, mfs_stats_t * dst)
+{
+    *dst = mfs->stats;
+}
+
+void mfs_reset_stats(mfs_t * mfs)
+{
+    memset(&mfs->stats, 0, sizeof(mfs->stats));
+}
+
+#endif
+
+#ifdef MFS_THREAD_SAFE
+
+#undef mfs_mount
+#undef mfs_file_count
+#undef mfs_free_space
+#undef mfs_list_files
+#undef mfs_list_files_info
+#undef mfs_stat
+#undef mfs_delete
+#undef mfs_open
+#undef mfs_read
+#undef mfs_seek
+#undef mfs_pread
+#undef mfs_reserve
+#undef mfs_compress
+#undef mfs_write
+#undef mfs_close
+#undef mfs_fopen
+#undef mfs_fread
+#undef mfs_fwrite
+#undef mfs_fclose
+#undef mfs_fseek
+#undef mfs_fpread
+#undef mfs_fskip_index
+#undef mfs_freserve
+#undef mfs_fcompress
+#undef mfs_fstaging
+
+/*
+
+Locking
+
+Calls that only read the mounted state hold the lock shared. A file
+being written only changes the occupied blocks and the counts of free
+and reserved ones until it is closed, so mfs_fwrite and the like hold
+it shared too, one writer at a time. The rest hold it exclusive, as
+does everything when the block cache is used, since reads change it,
+or a remount is due.
+
+*/
+
+static void lock_exclusive(mfs_t * mfs)
+{
+    pthread_rwlock_wrlock(&mfs->lock);
+    mfs->exclusive = true;
+}
+
+static void unlock_exclusive(mfs_t * mfs)
+{
+    mfs->exclusive = false;
+    pthread_rwlock_unlock(&mfs->lock);
+}
+
+/* with the lock held shared */
+static bool can_share(const mfs_t * mfs)
+{
+    return !mfs->needs_remount && !mfs->conf->block_cache_memory;
+}
+
+/* one of aligned_reader_memory, or -1 if none is free */
+static int reader_buffer_take(mfs_t * mfs)
+{
+    int buffer = -1;
+    STATE_LOCK(mfs);
+    for(int i = 0; i < mfs->conf->reader_buffer_count && mfs->conf->aligned_reader_memory; i++) {
+        if(!(mfs->reader_buffers_busy & 1u << i)) {
+            mfs->reader_buffers_busy |= 1u << i;
+            buffer = i;
+            break;
+        }
+    }
+    STATE_UNLOCK(mfs);
+    return buffer;
+}
+
+static void reader_buffer_give(mfs_t * mfs, int buffer)
+{
+    STATE_LOCK(mfs);
+    mfs->reader_buffers_busy &= ~(1u << buffer);
+    STATE_UNLOCK(mfs);
+}
+
+#define EXCLUSIVE_CALL(mfs, expr) do { \
+    lock_exclusive(mfs); \
+    int res = (expr); \
+    unlock_exclusive(mfs); \
+    return res; \
+} while(0)
+
+/* `expr` holding the lock shared when `shared_ok` holds with it, otherwise
+   or when `expr` would remount holding it exclusive */
+#define SHARED_CALL(mfs, shared_ok, expr) do { \
+    int res = LOCK_UPGRADE_NEEDED; \
+    pthread_rwlock_rdlock(&(mfs)->lock); \
+    if(can_share(mfs) && (shared_ok)) res = (expr); \
+    pthread_rwlock_unlock(&(mfs)->lock); \
+    if(res == LOCK_UPGRADE_NEEDED) EXCLUSIVE_CALL(mfs, expr); \
+    return res; \
+} while(0)
+
+#define WRITER_CALL(mfs, expr) do { \
+    int res = LOCK_UPGRADE_NEEDED; \
+    pthread_rwlock_rdlock(&(mfs)->lock); \
+    if(can_share(mfs)) { \
+        pthread_mutex_lock(&(mfs)->writer_lock); \
+        res = (expr); \
+        pthread_mutex_unlock(&(mfs)->writer_lock); \
+    } \
+    pthread_rwlock_unlock(&(mfs)->lock); \
+    if(res == LOCK_UPGRADE_NEEDED) EXCLUSIVE_CALL(mfs, expr); \
+    return res; \
+} while(0)
+
+int mfs_mount(mfs_t * mfs, const mfs_conf_t * conf)
+{
+    if(!mfs->lock_ready) {
+        pthread_rwlock_init(&mfs->lock, NULL);
+        pthread_mutex_init(&mfs->writer_lock, NULL);
+        pthread_mutex_init(&mfs->state_lock, NULL);
+        mfs->lock_ready = true;
+    }
+    lock_exclusive(mfs);
+    mfs->reader_buffers_busy = 0;
+    int res = mfs_mount_unwrapped(mfs, conf);
+    unlock_exclusive(mfs);
+    return res;
+}
+
+int mfs_file_count(mfs_t * mfs)
+{
+    SHARED_CALL(mfs, mfs->file.mode == -1, mfs_file_count_unwrapped(mfs));
+}
+
+int mfs_free_space(mfs_t * mfs)
+{
+    SHARED_CALL(mfs, true, mfs_free_space_unwrapped(mfs));
+}
+
+int mfs_list_files(mfs_t * mfs, void * list_file_cb_ctx, void (*list_file_cb)(void *, const char *))
+{
+    int res = LOCK_UPGRADE_NEEDED;
+    pthread_rwlock_rdlock(&mfs->lock);
+    int buffer = can_share(mfs) && mfs->file.mode == -1 ? reader_buffer_take(mfs) : -1;
+    if(buffer >= 0) {
+        uint8_t * block_buf = (uint8_t *) mfs->conf->aligned_reader_memory + buffer * mfs->conf->block_size;
+        res = list_files(mfs, block_buf, list_file_cb_ctx, list_file_cb);
+        reader_buffer_give(mfs, buffer);
+    }
+    pthread_rwlock_unlock(&mfs->lock);
+    if(res == LOCK_UPGRADE_NEEDED) EXCLUSIVE_CALL(mfs, mfs_list_files_unwrapped(mfs, list_file_cb_ctx, list_file_cb));
+    return res;
+}
+
+int mfs_list_files_info(mfs_t * mfs, void * list_file_cb_ctx,
+                        void (*list_file_cb)(void *, const char *, const mfs_file_info_t *))
+{
+    EXCLUSIVE_CALL(mfs, mfs_list_files_info_unwrapped(mfs, list_file_cb_ctx, list_file_cb));
+}
+
+int mfs_stat(mfs_t * mfs, const char * name, mfs_file_info_t * info_dst)
+{
+    EXCLUSIVE_CALL(mfs, mfs_stat_unwrapped(mfs, name, info_dst));
+}
+
+int mfs_delete(mfs_t * mfs, const char * name)
+{
+    EXCLUSIVE_CALL(mfs, mfs_delete_unwrapped(mfs, name));
+}
+
+int mfs_open(mfs_t * mfs, const char * name, mfs_mode_t mode)
+{
+    EXCLUSIVE_CALL(mfs, mfs_open_unwrapped(mfs, name, mode));
+}
+
+int mfs_read(mfs_t * mfs, uint8_t * dst, int size)
+{
+    EXCLUSIVE_CALL(mfs, mfs_read_unwrapped(mfs, dst, size));
+}
+
+int mfs_seek(mfs_t * mfs, int offset)
+{
+    EXCLUSIVE_CALL(mfs, mfs_seek_unwrapped(mfs, offset));
+}
+
+int mfs_pread(mfs_t * mfs, uint8_t * dst, int size, int offset)
+{
+    EXCLUSIVE_CALL(mfs, mfs_pread_unwrapped(mfs, dst, size, offset));
+}
+
+int mfs_reserve(mfs_t * mfs, int size)
+{
+    EXCLUSIVE_CALL(mfs, mfs_reserve_unwrapped(mfs, size));
+}
+
+int mfs_compress(mfs_t * mfs, uint32_t * entries, int entry_count)
+{
+    EXCLUSIVE_CALL(mfs, mfs_compress_unwrapped(mfs, entries, entry_count));
+}
+
+int mfs_write(mfs_t * mfs, const uint8_t * src, int size)
+{
+    EXCLUSIVE_CALL(mfs, mfs_write_unwrapped(mfs, src, size));
+}
+
+int mfs_close(mfs_t * mfs)
+{
+    EXCLUSIVE_CALL(mfs, mfs_close_unwrapped(mfs));
+}
+
+int mfs_fopen(mfs_t * mfs, mfs_file_t * file, void * aligned_block_buf, const char * name, mfs_mode_t mode)
+{
+    /* a lazy mount checksums files as they are opened, and the name index may be built */
+    SHARED_CALL(mfs, mode == MFS_MODE_READ && !(mfs->conf->flags & MFS_FLAG_LAZY_VERIFY)
+                     && (!mfs->conf->name_index_aux_memory || mfs->name_index_ready),
+                mfs_fopen_unwrapped(mfs, file, aligned_block_buf, name, mode));
+}
+
+int mfs_fread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size)
+{
+    SHARED_CALL(mfs, true, mfs_fread_unwrapped(mfs, file, dst, size));
+}
+
+int mfs_fwrite(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size)
+{
+    WRITER_CALL(mfs, mfs_fwrite_unwrapped(mfs, file, src, size));
+}
+
+int mfs_fclose(mfs_t * mfs, mfs_file_t * file)
+{
+    SHARED_CALL(mfs, file->mode == MFS_MODE_READ, mfs_fclose_unwrapped(mfs, file));
+}
+
+int mfs_fseek(mfs_t * mfs, mfs_file_t * file, int offset)
+{
+    SHARED_CALL(mfs, true, mfs_fseek_unwrapped(mfs, file, offset));
+}
+
+int mfs_fpread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size, int offset)
+{
+    SHARED_CALL(mfs, true, mfs_fpread_unwrapped(mfs, file, dst, size, offset));
+}
+
+int mfs_fskip_index(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    SHARED_CALL(mfs, true, mfs_fskip_index_unwrapped(mfs, file, entries, entry_count));
+}
+
+int mfs_freserve(mfs_t * mfs, mfs_file_t * file, int size)
+{
+    WRITER_CALL(mfs, mfs_freserve_unwrapped(mfs, file, size));
+}
+
+int mfs_fcompress(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count)
+{
+    WRITER_CALL(mfs, mfs_fcompress_unwrapped(mfs, file, entries, entry_count));
+}
+
+int mfs_fstaging(mfs_t * mfs, mfs_file_t * file, void * aligned_blocks, int block_count)
+{
+    WRITER_CALL(mfs, mfs_fstaging_unwrapped(mfs, file, aligned_blocks, block_count));
+}
+
+#endif
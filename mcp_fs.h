@@ -1,6 +1,13 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#ifdef MFS_THREAD_SAFE
+#include <pthread.h>
+/* changed by one thread while others read it */
+#define MFS_ATOMIC _Atomic
+#else
+#define MFS_ATOMIC
+#endif
 
 #define MFS_BAD_BLOCK_CONFIG_ERROR                      -1000
 #define MFS_WRONG_MODE_ERROR                            -1001
@@ -10,45 +17,341 @@
 #define MFS_INTERNAL_ASSERTION_ERROR                    -1005
 #define MFS_READBACK_ERROR                              -1006
 #define MFS_BIRTHDAY_LIMIT_REACHED_ERROR                -1007
+#define MFS_FILE_BUSY_ERROR                             -1008
 
 #define MFS_BIT_BUF_SIZE_BYTES(block_count) (((block_count) - 1) / 8 + 1)
-#define MFS_ALIGNED_AUX_MEMORY_SIZE(block_size, block_count) ((block_size) + MFS_BIT_BUF_SIZE_BYTES((block_count)) * 4)
+#define MFS_BIT_WORD_COUNT(block_count) (((block_count) - 1) / 64 + 1)
+/* a bit buffer in 64 bit words and its two summaries, a bit for each of its words */
+#define MFS_BIT_BUF_STRIDE(block_count) ((MFS_BIT_WORD_COUNT((block_count)) + ((MFS_BIT_WORD_COUNT((block_count)) - 1) / 64 + 1) * 2) * 8)
+#define MFS_ALIGNED_AUX_MEMORY_SIZE(block_size, block_count) ((block_size) + MFS_BIT_BUF_STRIDE((block_count)) * 6)
+#define MFS_MOUNT_AUX_MEMORY_SIZE(block_count) ((block_count) * 12 + MFS_BIT_BUF_SIZE_BYTES((block_count)) * 7)
+#define MFS_NAME_INDEX_AUX_MEMORY_SIZE(block_count) ((block_count) * 12)
+#define MFS_CHAIN_AUX_MEMORY_SIZE(block_count) ((block_count) * 4)
+#define MFS_FILE_INFO_AUX_MEMORY_SIZE(block_count) ((block_count) * 8)
+#define MFS_BLOCK_CACHE_MEMORY_SIZE(block_size, block_cache_block_count) (((block_size) * (block_cache_block_count) + 3) / 4 * 4 + 8 * (block_cache_block_count) + 12)
+#define MFS_CHECKPOINT_BLOCK_COUNT(block_size, block_count) ((24 + MFS_BIT_BUF_SIZE_BYTES((block_count)) * 5 - 1) / (block_size) + 1)
+
+/* mfs_conf_t flags */
+#define MFS_FLAG_CHECKPOINT (1u << 0) /* keep a checkpoint in the last MFS_CHECKPOINT_BLOCK_COUNT blocks */
+#define MFS_FLAG_LAZY_VERIFY (1u << 1) /* needs mount_aux_memory. checksum files when first opened */
+#define MFS_FLAG_CRC32C (1u << 2) /* checksum new files with CRC32C rather than FNV-1a. either is read */
+/* how mfs_close checks a new file before committing it. by default the whole file is read back and checksummed */
+#define MFS_FLAG_VERIFY_TRAILER (1u << 3) /* only the final block is read back */
+#define MFS_FLAG_VERIFY_WRITES (1u << 4) /* each block is read back as it is written. with write_block_start, as by default */
 
 typedef enum {
     MFS_MODE_READ,
-    MFS_MODE_WRITE
+    MFS_MODE_WRITE,
+    /* writes go on after the end of the file. only what is written and the
+       final few blocks are written again. the file is created if need be */
+    MFS_MODE_APPEND
 } mfs_mode_t;
 
+typedef struct {
+    const void * base;
+    int len;
+} mfs_iov_t;
+
+typedef struct {
+    int size;
+    uint32_t checksum; /* CRC32C of the contents */
+} mfs_file_info_t;
+
+#ifdef MFS_STATS
+/* what device reads and writes were for */
+typedef enum {
+    MFS_IO_MOUNT,
+    MFS_IO_LOOKUP,
+    MFS_IO_DATA,
+    MFS_IO_VERIFY,
+    MFS_IO_COMMIT, /* freeing replaced files, the checkpoint */
+    MFS_IO_PURPOSE_COUNT
+} mfs_io_purpose_t;
+
+/* the API calls. the handle variants count with their mfs_open etc. */
+typedef enum {
+    MFS_CALL_MOUNT,
+    MFS_CALL_FILE_COUNT,
+    MFS_CALL_FREE_SPACE,
+    MFS_CALL_LIST_FILES, /* mfs_list_files_info too */
+    MFS_CALL_STAT,
+    MFS_CALL_DELETE,
+    MFS_CALL_OPEN,
+    MFS_CALL_READ,
+    MFS_CALL_WRITE,
+    MFS_CALL_CLOSE,
+    MFS_CALL_SEEK,
+    MFS_CALL_RESERVE,
+    MFS_CALL_SETUP, /* mfs_fskip_index, mfs_fstaging, mfs_compress */
+    MFS_CALL_COUNT
+} mfs_call_t;
+
+#define MFS_STATS_LATENCY_BUCKETS 32
+
+typedef struct {
+    uint32_t calls[MFS_CALL_COUNT];
+    /* bucket n counts calls that took 2^n - 1 to 2^(n+1) - 2 cycles. the last also the longer */
+    uint32_t latency[MFS_CALL_COUNT][MFS_STATS_LATENCY_BUCKETS];
+    uint32_t reads[MFS_IO_PURPOSE_COUNT]; /* blocks, and ranges of a block */
+    uint32_t writes[MFS_IO_PURPOSE_COUNT];
+    uint64_t bytes_checksummed;
+    uint32_t remounts; /* implicit ones, after an error or a broken file */
+} mfs_stats_t;
+#endif
+
+#ifdef MFS_TRACE
+typedef enum {
+    MFS_TRACE_MOUNT,
+    MFS_TRACE_REMOUNT,
+    MFS_TRACE_READ, /* block_index, count blocks. a range of a block counts 0 */
+    MFS_TRACE_WRITE, /* block_index, count blocks */
+    MFS_TRACE_SCAN_FILE, /* block_index of the first block */
+    MFS_TRACE_ALLOC, /* block_index */
+    MFS_TRACE_CLOSE, /* block_index of the first block */
+    /* the steps of closing a written file, each lasting until the next */
+    MFS_TRACE_CLOSE_INVALIDATE, /* the checkpoint */
+    MFS_TRACE_CLOSE_FLUSH,
+    MFS_TRACE_CLOSE_VERIFY,
+    MFS_TRACE_CLOSE_COMMIT,
+    MFS_TRACE_CLOSE_RELEASE, /* block_index of the replaced file */
+    MFS_TRACE_CLOSE_CHECKPOINT,
+    MFS_TRACE_EVENT_COUNT
+} mfs_trace_event_t;
+
+typedef enum {
+    MFS_TRACE_BEGIN,
+    MFS_TRACE_END, /* count is 1 when it failed */
+    MFS_TRACE_INSTANT
+} mfs_trace_phase_t;
+
+typedef struct {
+    uint32_t time;
+    uint8_t event;
+    uint8_t phase;
+    uint16_t count;
+    int32_t block_index;
+} mfs_trace_entry_t;
+#endif
+
 typedef struct {
     void * aligned_aux_memory;
     int block_size;
+    /* up to 2^27. sizes, offsets and free space are int, so the bytes a
+       volume holds, block_count * (block_size - 8), are at most INT_MAX
+       and a file holds less than that. mfs_mount rejects larger confs,
+       e.g. more than 525314 blocks of 4096 bytes */
     int block_count;
     void * cb_ctx;
     int (*read_block)(void * cb_ctx, int block_index, void * dst);
     int (*write_block)(void * cb_ctx, int block_index, const void * src);
+    /* optional. aligned, MFS_MOUNT_AUX_MEMORY_SIZE bytes. reads each block once at mount */
+    void * mount_aux_memory;
+    uint32_t flags;
+    /* optional. aligned, MFS_NAME_INDEX_AUX_MEMORY_SIZE bytes. files are found by name hash */
+    void * name_index_aux_memory;
+    /* optional. transfer `block_count` consecutive blocks at once */
+    int (*read_blocks)(void * cb_ctx, int block_index, int block_count, void * dst);
+    int (*write_blocks)(void * cb_ctx, int block_index, int block_count, const void * src);
+    /* optional. aligned, block_size * staging_block_count bytes. runs of
+       consecutive blocks are staged here at mount and by mfs_open files */
+    void * aligned_staging_memory;
+    int staging_block_count;
+    /* optional. start writing a block and return. `src` is not touched until
+       mfs_write_done(done_ctx, res) is called for it, which must happen in
+       the order the writes were started. files being written cycle through
+       their staging blocks. write_wait is called in a loop until a write is
+       done and may return early */
+    int (*write_block_start)(void * cb_ctx, int block_index, const void * src, void * done_ctx);
+    void (*write_wait)(void * cb_ctx);
+    /* optional. read `len` bytes at `offset` of a block. used where a whole block is not needed */
+    int (*read_range)(void * cb_ctx, int block_index, int offset, int len, void * dst);
+    /* optional. a block's contents in memory, for memory mapped volumes.
+       used instead of read_block and read_range, and must not fail */
+    const void * (*map_block)(void * cb_ctx, int block_index);
+    /* optional. write a block gathered from `iov_count` pieces. used so
+       that large writes go to the backend without a copy */
+    int (*write_block_iov)(void * cb_ctx, int block_index, const mfs_iov_t * iov, int iov_count);
+    /* optional. aligned, MFS_CHAIN_AUX_MEMORY_SIZE bytes. the blocks of
+       files are remembered so replaced and deleted ones are freed without reads */
+    void * chain_aux_memory;
+    /* optional. aligned, MFS_BLOCK_CACHE_MEMORY_SIZE bytes. the most recently
+       read first blocks and others read whole are kept for reading again */
+    void * block_cache_memory;
+    int block_cache_block_count;
+    /* optional. aligned, MFS_FILE_INFO_AUX_MEMORY_SIZE bytes. the size and
+       checksum of each file are kept once found or written */
+    void * file_info_aux_memory;
+#ifdef MFS_THREAD_SAFE
+    /* optional. aligned, block_size * reader_buffer_count bytes, at most 32
+       buffers. mfs_list_files runs alongside other readers with one of them */
+    void * aligned_reader_memory;
+    int reader_buffer_count;
+#endif
+#ifdef MFS_TRACE
+    /* optional. events are recorded into the last `trace_entry_count`
+       entries, timed with trace_clock */
+    mfs_trace_entry_t * trace_entries;
+    int trace_entry_count;
+    uint32_t (*trace_clock)(void * cb_ctx);
+#endif
 } mfs_conf_t;
 
+typedef struct mfs_file_t {
+    uint8_t * block_buf;
+    int8_t mode;
+    int block_cursor;
+    int32_t match_index;
+    int32_t continued; /* appending, the first block of the file or segment this one goes on after */
+    int32_t absorbed; /* appending, the segment copied into this one */
+    uint32_t writer_checksum;
+    int content_size; /* writing, -1 when the size of the whole file is not known */
+    uint32_t content_checksum;
+    int block;
+    int first_block;
+    uint32_t name_hash;
+    struct mfs_file_t * next_open;
+    int block_number; /* in the segment */
+    int header_size;
+    int segment; /* reading, the first block of the file or segment being read */
+    int segment_offset;
+    bool compressed;
+    int tokens; /* compressed, the end of the tokens not yet read or the start of those written. -1 until known */
+    int token_offset; /* reading compressed, into the current token */
+    int stream_offset; /* reading compressed */
+    uint32_t * match_table; /* writing compressed, block positions plus match_base by hash */
+    int match_shift;
+    uint32_t match_base;
+    int literal_token; /* writing compressed, the literal run going on, or -1 */
+    int unsummed; /* writing compressed, the start of the data not yet checksummed */
+    uint32_t * skip_index;
+    int skip_index_len;
+    int skip_index_filled;
+    int skip_stride;
+    uint8_t * staging;
+    int staging_block_count;
+    int staged_first;
+    int staged_count;
+    int readahead; /* reading, the blocks read ahead when the links are not known */
+    int reserved_blocks;
+    int writes_started;
+    volatile int writes_done;
+    volatile int write_error;
+} mfs_file_t;
+
 typedef struct {
     const mfs_conf_t * conf;
     uint8_t * block_buf;
-    uint8_t * bit_bufs[4];
+    uint8_t * bit_bufs[6];
     int file_count;
     uint32_t youngest;
-    int8_t open_file_mode;
-    bool needs_remount;
-    int open_file_block_cursor;
-    int32_t open_file_match_index;
-    uint32_t writer_checksum;
-    int open_file_block;
-    int open_file_first_block;
+    MFS_ATOMIC bool needs_remount;
+    mfs_file_t file; /* the one used by mfs_open */
+    mfs_file_t * open_files;
+    int checkpoint_block_count;
+    bool checkpoint_clean;
+    uint32_t checkpoint_generation;
+    bool name_index_ready;
+    MFS_ATOMIC int free_block_count;
+    MFS_ATOMIC int reserved_block_count;
+    int free_hint;
+#ifdef MFS_STATS
+    mfs_stats_t stats;
+    mfs_io_purpose_t stats_purpose;
+#endif
+#ifdef MFS_TRACE
+    int trace_next;
+    bool trace_wrapped;
+#endif
+#ifdef MFS_THREAD_SAFE
+    pthread_rwlock_t lock;
+    pthread_mutex_t writer_lock; /* writers hold the lock shared and this */
+    pthread_mutex_t state_lock; /* open_files and reader_buffers_busy */
+    uint32_t reader_buffers_busy;
+    bool exclusive;
+    bool lock_ready;
+#endif
+#if defined(MFS_STATS) || defined(MFS_TRACE)
+    const mfs_conf_t * user_conf;
+    mfs_conf_t shim_conf; /* the user's, with callbacks that count and trace */
+#endif
 } mfs_t;
 
+/* files being written must be closed before remounting with write_block_start.
+   with MFS_THREAD_SAFE, `mfs` is zeroed before it is first mounted. calls
+   that only read hold a lock shared, mfs_fwrite and the like hold it
+   shared one writer at a time, and the rest hold it exclusive. callbacks
+   must not call back into the volume */
 int mfs_mount(mfs_t * mfs, const mfs_conf_t * conf);
 int mfs_file_count(mfs_t * mfs);
+/* bytes that can be written to new files, less the block trailers and
+   what is reserved. a file's name takes some of it too */
+int mfs_free_space(mfs_t * mfs);
 int mfs_list_files(mfs_t * mfs, void * list_file_cb_ctx, void (*list_file_cb)(void *, const char *));
+/* with the size and checksum of each file. a file is read through to
+   find them unless file_info_aux_memory has them from an earlier call or
+   from writing the file since mount */
+int mfs_list_files_info(mfs_t * mfs, void * list_file_cb_ctx,
+                        void (*list_file_cb)(void *, const char *, const mfs_file_info_t *));
+int mfs_stat(mfs_t * mfs, const char * name, mfs_file_info_t * info_dst);
 int mfs_delete(mfs_t * mfs, const char * name);
 int mfs_open(mfs_t * mfs, const char * name, mfs_mode_t mode);
 int mfs_read(mfs_t * mfs, uint8_t * dst, int size);
 int mfs_write(mfs_t * mfs, const uint8_t * src, int size);
 int mfs_close(mfs_t * mfs);
+/* files open for reading. the new offset, clamped to the file length, is returned */
+int mfs_seek(mfs_t * mfs, int offset);
+int mfs_pread(mfs_t * mfs, uint8_t * dst, int size, int offset);
+/* files open for writing. set aside the blocks for `size` more bytes so that
+   writing them cannot fail for lack of space. fails with MFS_NO_SPACE_ERROR
+   and leaves the file open otherwise */
+int mfs_reserve(mfs_t * mfs, int size);
+/* right after mfs_open for writing. like mfs_fcompress */
+int mfs_compress(mfs_t * mfs, uint32_t * entries, int entry_count);
+
+/* any number of files open at once, each with its own aligned block_size
+   byte `aligned_block_buf`. a file can be open for reading by many or for
+   writing by one. a remount closes every file */
+int mfs_fopen(mfs_t * mfs, mfs_file_t * file, void * aligned_block_buf, const char * name, mfs_mode_t mode);
+int mfs_fread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size);
+int mfs_fwrite(mfs_t * mfs, mfs_file_t * file, const uint8_t * src, int size);
+int mfs_fclose(mfs_t * mfs, mfs_file_t * file);
+int mfs_fseek(mfs_t * mfs, mfs_file_t * file, int offset);
+int mfs_fpread(mfs_t * mfs, mfs_file_t * file, uint8_t * dst, int size, int offset);
+/* optional, after mfs_fopen for reading. remembers the block index of every
+   `skip_stride`th block walked so seeking backwards does not restart from
+   the first block. the stride doubles whenever the entries run out */
+int mfs_fskip_index(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count);
+/* optional, right after mfs_fopen. `aligned_blocks` is block_size * `block_count`
+   bytes. reads are done ahead and writes held back in runs of consecutive
+   blocks so read_blocks and write_blocks can be used */
+int mfs_fstaging(mfs_t * mfs, mfs_file_t * file, void * aligned_blocks, int block_count);
+int mfs_freserve(mfs_t * mfs, mfs_file_t * file, int size);
+/* optional, right after mfs_fopen for writing. the file is stored
+   compressed, matches being found with a table of `entry_count` entries.
+   matches copy only from the literal bytes stored earlier in the same
+   block, so each block carries its own literals and text such as logs
+   shrinks to about half, not the third or less of coders whose matches
+   reach back into everything decoded before.
+   appending to a compressed file, the new data is compressed with or
+   without it. fails with MFS_WRONG_MODE_ERROR appending to one that is not */
+int mfs_fcompress(mfs_t * mfs, mfs_file_t * file, uint32_t * entries, int entry_count);
+
+/* with block_cache_memory, the reads found in and missing from the cache
+   since mfs_mount */
+void mfs_block_cache_counts(const mfs_t * mfs, uint32_t * hits_dst, uint32_t * misses_dst);
+
+/* for the backend when a write from write_block_start is done. may be called from an interrupt */
+void mfs_write_done(void * done_ctx, int res);
+
+#ifdef MFS_STATS
+/* mfs_mount resets the statistics. MFS_STATS_CYCLES() may be defined
+   when building mcp_fs.c to count cycles with */
+void mfs_get_stats(const mfs_t * mfs, mfs_stats_t * dst);
+void mfs_reset_stats(mfs_t * mfs);
+#endif
 
+#ifdef MFS_TRACE
+/* copy the recorded events, oldest first, into `dst`. the number copied is
+   returned. mfs_mount clears them */
+int mfs_trace_snapshot(const mfs_t * mfs, mfs_trace_entry_t * dst, int entry_count);
+#endif
@@ -0,0 +1,433 @@
+#include "../mcp_fs.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+
+Each measurement is printed as one JSON object per line:
+
+bench       : mount, open, write, read or close
+backend     : ram, file or sim
+variant     : the configuration measured
+block_size  :
+block_count :
+n           : what the bench sweeps. files, or bytes per call
+calls       : API calls measured
+ns          : total time of the calls
+reads       : device reads during the calls, blocks read as runs included
+writes      : device writes during the calls
+
+usage: bench [ram] [file] [sim] [--read-us N] [--write-us N] [--mbps N] [--image PATH]
+
+*/
+
+typedef enum {
+    BACKEND_RAM,
+    BACKEND_FILE,
+    BACKEND_SIM
+} backend_kind_t;
+
+static const char * backend_names[] = {"ram", "file", "sim"};
+
+/* the simulated device. a flash part by default */
+static uint64_t sim_read_ns = 25000;
+static uint64_t sim_write_ns = 200000;
+static uint64_t sim_bytes_per_sec = 50000000;
+static const char * image_path = "bench.img";
+
+typedef struct {
+    backend_kind_t kind;
+    int block_size;
+    uint8_t * memory;
+    int fd;
+    bool timed; /* the simulated latency is only spent while measuring */
+    int reads;
+    int writes;
+} backend_t;
+
+typedef struct {
+    backend_t backend;
+    mfs_conf_t conf;
+    mfs_t mfs;
+    void * aux_memory;
+    void * mount_aux_memory;
+    void * name_index_aux_memory;
+    void * chain_aux_memory;
+    void * staging_memory;
+} volume_t;
+
+/* the aux memories a volume is given */
+#define VOLUME_GRAPH (1u << 0)
+#define VOLUME_NAME_INDEX (1u << 1)
+#define VOLUME_CHAIN (1u << 2)
+#define VOLUME_RUNS (1u << 3)
+
+#define STAGING_BLOCK_COUNT 8
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void backend_delay(const backend_t * b, uint64_t op_ns, int byte_count)
+{
+    if(b->kind != BACKEND_SIM || !b->timed) return;
+    uint64_t until = now_ns() + op_ns + (uint64_t) byte_count * 1000000000u / sim_bytes_per_sec;
+    while(now_ns() < until);
+}
+
+static int backend_read(backend_t * b, int block_index, int block_count, void * dst)
+{
+    int len = b->block_size * block_count;
+    b->reads += block_count;
+    backend_delay(b, sim_read_ns, len);
+    if(b->kind == BACKEND_FILE) {
+        return pread(b->fd, dst, len, (off_t) block_index * b->block_size) == len ? 0 : -1;
+    }
+    memcpy(dst, b->memory + (size_t) block_index * b->block_size, len);
+    return 0;
+}
+
+static int backend_write(backend_t * b, int block_index, int block_count, const void * src)
+{
+    int len = b->block_size * block_count;
+    b->writes += block_count;
+    backend_delay(b, sim_write_ns, len);
+    if(b->kind == BACKEND_FILE) {
+        return pwrite(b->fd, src, len, (off_t) block_index * b->block_size) == len ? 0 : -1;
+    }
+    memcpy(b->memory + (size_t) block_index * b->block_size, src, len);
+    return 0;
+}
+
+static int read_block(void * cb_ctx, int block_index, void * dst)
+{
+    return backend_read(cb_ctx, block_index, 1, dst);
+}
+
+static int write_block(void * cb_ctx, int block_index, const void * src)
+{
+    return backend_write(cb_ctx, block_index, 1, src);
+}
+
+static int read_blocks(void * cb_ctx, int block_index, int block_count, void * dst)
+{
+    return backend_read(cb_ctx, block_index, block_count, dst);
+}
+
+static int write_blocks(void * cb_ctx, int block_index, int block_count, const void * src)
+{
+    return backend_write(cb_ctx, block_index, block_count, src);
+}
+
+static void * aligned_memory(size_t size)
+{
+    void * memory = aligned_alloc(16, (size + 15) / 16 * 16);
+    if(!memory) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return memory;
+}
+
+static void volume_create(volume_t * v, backend_kind_t kind, int block_size, int block_count,
+                          uint32_t mfs_flags, uint32_t volume_flags)
+{
+    memset(v, 0, sizeof(*v));
+    v->backend.kind = kind;
+    v->backend.block_size = block_size;
+    v->backend.fd = -1;
+    if(kind == BACKEND_FILE) {
+        v->backend.fd = open(image_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(v->backend.fd < 0 || ftruncate(v->backend.fd, (off_t) block_size * block_count)) {
+            fprintf(stderr, "cannot create %s\n", image_path);
+            exit(1);
+        }
+    }
+    else {
+        v->backend.memory = calloc(block_count, block_size);
+    }
+
+    v->aux_memory = aligned_memory(MFS_ALIGNED_AUX_MEMORY_SIZE(block_size, block_count));
+    v->conf.aligned_aux_memory = v->aux_memory;
+    v->conf.block_size = block_size;
+    v->conf.block_count = block_count;
+    v->conf.cb_ctx = &v->backend;
+    v->conf.read_block = read_block;
+    v->conf.write_block = write_block;
+    v->conf.flags = mfs_flags;
+    if(volume_flags & VOLUME_GRAPH) {
+        v->mount_aux_memory = aligned_memory(MFS_MOUNT_AUX_MEMORY_SIZE(block_count));
+        v->conf.mount_aux_memory = v->mount_aux_memory;
+    }
+    if(volume_flags & VOLUME_NAME_INDEX) {
+        v->name_index_aux_memory = aligned_memory(MFS_NAME_INDEX_AUX_MEMORY_SIZE(block_count));
+        v->conf.name_index_aux_memory = v->name_index_aux_memory;
+    }
+    if(volume_flags & VOLUME_CHAIN) {
+        v->chain_aux_memory = aligned_memory(MFS_CHAIN_AUX_MEMORY_SIZE(block_count));
+        v->conf.chain_aux_memory = v->chain_aux_memory;
+    }
+    if(volume_flags & VOLUME_RUNS) {
+        v->staging_memory = aligned_memory((size_t) block_size * STAGING_BLOCK_COUNT);
+        v->conf.read_blocks = read_blocks;
+        v->conf.write_blocks = write_blocks;
+        v->conf.aligned_staging_memory = v->staging_memory;
+        v->conf.staging_block_count = STAGING_BLOCK_COUNT;
+    }
+}
+
+static void volume_destroy(volume_t * v)
+{
+    if(v->backend.fd >= 0) {
+        close(v->backend.fd);
+        unlink(image_path);
+    }
+    free(v->backend.memory);
+    free(v->aux_memory);
+    free(v->mount_aux_memory);
+    free(v->name_index_aux_memory);
+    free(v->chain_aux_memory);
+    free(v->staging_memory);
+}
+
+static void check(int res, const char * what)
+{
+    if(res < 0) {
+        fprintf(stderr, "%s failed with %d\n", what, res);
+        exit(1);
+    }
+}
+
+static void write_file(volume_t * v, const char * name, const uint8_t * data, int size)
+{
+    check(mfs_open(&v->mfs, name, MFS_MODE_WRITE), "mfs_open");
+    check(mfs_write(&v->mfs, data, size), "mfs_write");
+    check(mfs_close(&v->mfs), "mfs_close");
+}
+
+typedef struct {
+    uint64_t start;
+    int reads;
+    int writes;
+} measure_t;
+
+static void measure_start(volume_t * v, measure_t * m)
+{
+    v->backend.timed = true;
+    m->reads = v->backend.reads;
+    m->writes = v->backend.writes;
+    m->start = now_ns();
+}
+
+static void measure_report(volume_t * v, const measure_t * m, const char * bench, const char * variant,
+                           int n, int calls)
+{
+    uint64_t ns = now_ns() - m->start;
+    v->backend.timed = false;
+    printf("{\"bench\":\"%s\",\"backend\":\"%s\",\"variant\":\"%s\",\"block_size\":%d,\"block_count\":%d,"
+           "\"n\":%d,\"calls\":%d,\"ns\":%llu,\"reads\":%d,\"writes\":%d}\n",
+           bench, backend_names[v->backend.kind], variant, v->conf.block_size, v->conf.block_count,
+           n, calls, (unsigned long long) ns, v->backend.reads - m->reads, v->backend.writes - m->writes);
+    fflush(stdout);
+}
+
+static uint8_t data[1 << 18];
+
+/* mount time by block count, for a volume half full of 4 block files */
+static void bench_mount(backend_kind_t kind)
+{
+    static const struct {
+        const char * name;
+        uint32_t mfs_flags;
+        uint32_t volume_flags;
+    } variants[] = {
+        {"scan", 0, 0},
+        {"graph", 0, VOLUME_GRAPH},
+        {"checkpoint", MFS_FLAG_CHECKPOINT, VOLUME_GRAPH},
+        {"lazy", MFS_FLAG_LAZY_VERIFY, VOLUME_GRAPH}
+    };
+    static const int block_counts[] = {256, 1024, 4096};
+    int block_size = 512;
+
+    for(int c = 0; c < sizeof(block_counts) / sizeof(*block_counts); c++) {
+        for(int i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+            volume_t v;
+            volume_create(&v, kind, block_size, block_counts[c], variants[i].mfs_flags, variants[i].volume_flags);
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+            int file_count = block_counts[c] / 8;
+            for(int f = 0; f < file_count; f++) {
+                char name[16];
+                snprintf(name, sizeof(name), "f%d", f);
+                write_file(&v, name, data, 4 * (block_size - 8) - 16);
+            }
+
+            measure_t m;
+            measure_start(&v, &m);
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+            check(mfs_file_count(&v.mfs), "mfs_file_count");
+            measure_report(&v, &m, "mount", variants[i].name, file_count, 1);
+            volume_destroy(&v);
+        }
+    }
+}
+
+/* open latency by file count */
+static void bench_open(backend_kind_t kind)
+{
+    static const struct {
+        const char * name;
+        uint32_t volume_flags;
+    } variants[] = {
+        {"lookup", VOLUME_GRAPH},
+        {"name_index", VOLUME_GRAPH | VOLUME_NAME_INDEX}
+    };
+    static const int file_counts[] = {16, 128, 1024};
+    int opens = 32;
+
+    for(int c = 0; c < sizeof(file_counts) / sizeof(*file_counts); c++) {
+        for(int i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+            volume_t v;
+            volume_create(&v, kind, 512, 2048, 0, variants[i].volume_flags);
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+            for(int f = 0; f < file_counts[c]; f++) {
+                char name[16];
+                snprintf(name, sizeof(name), "f%d", f);
+                write_file(&v, name, data, 100);
+            }
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+
+            measure_t m;
+            measure_start(&v, &m);
+            for(int f = 0; f < opens; f++) {
+                char name[16];
+                snprintf(name, sizeof(name), "f%d", f * file_counts[c] / opens);
+                check(mfs_open(&v.mfs, name, MFS_MODE_READ), "mfs_open");
+                check(mfs_close(&v.mfs), "mfs_close");
+            }
+            measure_report(&v, &m, "open", variants[i].name, file_counts[c], opens);
+            volume_destroy(&v);
+        }
+    }
+}
+
+/* throughput by block size, a 256 KiB file in 4 KiB calls */
+static void bench_write_read(backend_kind_t kind)
+{
+    static const struct {
+        const char * name;
+        uint32_t volume_flags;
+    } variants[] = {
+        {"plain", 0},
+        {"runs", VOLUME_RUNS}
+    };
+    static const int block_sizes[] = {256, 512, 2048, 4096};
+    static uint8_t buf[4096];
+    int size = sizeof(data);
+
+    for(int b = 0; b < sizeof(block_sizes) / sizeof(*block_sizes); b++) {
+        for(int i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+            volume_t v;
+            int block_count = 2 * size / block_sizes[b];
+            volume_create(&v, kind, block_sizes[b], block_count, 0, variants[i].volume_flags);
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+
+            measure_t m;
+            measure_start(&v, &m);
+            check(mfs_open(&v.mfs, "f", MFS_MODE_WRITE), "mfs_open");
+            for(int done = 0; done < size; done += sizeof(buf)) {
+                check(mfs_write(&v.mfs, data + done, sizeof(buf)), "mfs_write");
+            }
+            check(mfs_close(&v.mfs), "mfs_close");
+            measure_report(&v, &m, "write", variants[i].name, sizeof(buf), size / sizeof(buf));
+
+            measure_start(&v, &m);
+            check(mfs_open(&v.mfs, "f", MFS_MODE_READ), "mfs_open");
+            for(int done = 0; done < size; done += sizeof(buf)) {
+                check(mfs_read(&v.mfs, buf, sizeof(buf)), "mfs_read");
+            }
+            check(mfs_close(&v.mfs), "mfs_close");
+            measure_report(&v, &m, "read", variants[i].name, sizeof(buf), size / sizeof(buf));
+            volume_destroy(&v);
+        }
+    }
+}
+
+/* the latency of committing a new version of a file, by verification policy */
+static void bench_close(backend_kind_t kind)
+{
+    static const struct {
+        const char * name;
+        uint32_t mfs_flags;
+        uint32_t volume_flags;
+    } variants[] = {
+        {"full", 0, 0},
+        {"trailer", MFS_FLAG_VERIFY_TRAILER, 0},
+        {"writes", MFS_FLAG_VERIFY_WRITES, 0},
+        {"trailer_chain", MFS_FLAG_VERIFY_TRAILER, VOLUME_CHAIN}
+    };
+    static const int sizes[] = {4096, 65536, 262144};
+
+    for(int s = 0; s < sizeof(sizes) / sizeof(*sizes); s++) {
+        for(int i = 0; i < sizeof(variants) / sizeof(*variants); i++) {
+            volume_t v;
+            volume_create(&v, kind, 512, 2048, variants[i].mfs_flags, variants[i].volume_flags);
+            check(mfs_mount(&v.mfs, &v.conf), "mfs_mount");
+            /* replace an existing file, as is typical */
+            write_file(&v, "f", data, sizes[s]);
+            check(mfs_open(&v.mfs, "f", MFS_MODE_WRITE), "mfs_open");
+            check(mfs_write(&v.mfs, data, sizes[s]), "mfs_write");
+
+            measure_t m;
+            measure_start(&v, &m);
+            check(mfs_close(&v.mfs), "mfs_close");
+            measure_report(&v, &m, "close", variants[i].name, sizes[s], 1);
+            volume_destroy(&v);
+        }
+    }
+}
+
+static int usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [ram] [file] [sim] [--read-us N] [--write-us N] [--mbps N] [--image PATH]\n", name);
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    bool kinds[3] = {false, false, false};
+    bool any_kind = false;
+
+    for(int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if(!strcmp(argv[i], "--read-us") && has_value) sim_read_ns = atoll(argv[++i]) * 1000;
+        else if(!strcmp(argv[i], "--write-us") && has_value) sim_write_ns = atoll(argv[++i]) * 1000;
+        else if(!strcmp(argv[i], "--mbps") && has_value) sim_bytes_per_sec = atoll(argv[++i]) * 1000000;
+        else if(!strcmp(argv[i], "--image") && has_value) image_path = argv[++i];
+        else {
+            int k;
+            for(k = 0; k < 3 && strcmp(argv[i], backend_names[k]); k++);
+            if(k == 3) return usage(argv[0]);
+            kinds[k] = true;
+            any_kind = true;
+        }
+    }
+    if(!sim_bytes_per_sec) return usage(argv[0]);
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = i * 31 + 7;
+
+    for(int k = 0; k < 3; k++) {
+        if(any_kind && !kinds[k]) continue;
+        bench_mount(k);
+        bench_open(k);
+        bench_write_read(k);
+        bench_close(k);
+    }
+}
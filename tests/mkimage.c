@@ -0,0 +1,247 @@
+#include "../mcp_fs.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+/*
+
+Writes the regular files under a directory into a new volume image in
+one pass. Each is named by its path under the directory, with `/`
+between the parts. The volume is built in memory. Files are written in
+name order into a blank volume, so each takes the blocks right after the
+one before, and listing returns them in name order. Closing a file only
+reads back its final block, which is enough for RAM. The image is
+mounted once more before it is saved.
+
+usage: mkimage --block-count N [--block-size N] [--crc32c] [--checkpoint] [--compress] DIR IMAGE
+
+*/
+
+#define STAGING_BLOCK_COUNT 16
+#define MATCH_TABLE_ENTRIES 4096
+
+static int block_size = 2048;
+static int block_count;
+static uint8_t * memory;
+
+typedef struct {
+    char * name;
+    char * path;
+} entry_t;
+
+static entry_t * entries;
+static int entry_count;
+static int entry_capacity;
+
+static int read_block(void * cb_ctx, int block_index, void * dst)
+{
+    memcpy(dst, memory + (size_t) block_index * block_size, block_size);
+    return 0;
+}
+
+static int write_block(void * cb_ctx, int block_index, const void * src)
+{
+    memcpy(memory + (size_t) block_index * block_size, src, block_size);
+    return 0;
+}
+
+static int read_blocks(void * cb_ctx, int block_index, int count, void * dst)
+{
+    memcpy(dst, memory + (size_t) block_index * block_size, (size_t) count * block_size);
+    return 0;
+}
+
+static int write_blocks(void * cb_ctx, int block_index, int count, const void * src)
+{
+    memcpy(memory + (size_t) block_index * block_size, src, (size_t) count * block_size);
+    return 0;
+}
+
+static void * checked(void * memory)
+{
+    if(!memory) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return memory;
+}
+
+static void * aligned_memory(size_t size)
+{
+    return checked(aligned_alloc(16, (size + 15) / 16 * 16));
+}
+
+static void check(int res, const char * what, const char * name)
+{
+    if(res < 0) {
+        fprintf(stderr, "%s %s failed with %d%s\n", what, name, res,
+                res == MFS_NO_SPACE_ERROR ? ", the files do not fit" : "");
+        exit(1);
+    }
+}
+
+static char * join(const char * a, const char * b)
+{
+    char * joined = checked(malloc(strlen(a) + strlen(b) + 2));
+    sprintf(joined, "%s%s%s", a, *a ? "/" : "", b);
+    return joined;
+}
+
+/* every regular file under `path`, named by `name` and what follows */
+static void walk(const char * path, const char * name)
+{
+    DIR * dir = opendir(path);
+    if(!dir) {
+        perror(path);
+        exit(1);
+    }
+    struct dirent * d;
+    while((d = readdir(dir))) {
+        if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")) continue;
+        char * child_path = join(path, d->d_name);
+        char * child_name = join(name, d->d_name);
+        struct stat st;
+        if(stat(child_path, &st)) {
+            perror(child_path);
+            exit(1);
+        }
+        if(S_ISDIR(st.st_mode)) {
+            walk(child_path, child_name);
+            free(child_path);
+            free(child_name);
+            continue;
+        }
+        if(!S_ISREG(st.st_mode)) {
+            fprintf(stderr, "skipping %s, not a regular file\n", child_path);
+            free(child_path);
+            free(child_name);
+            continue;
+        }
+        if(entry_count == entry_capacity) {
+            entry_capacity = entry_capacity ? entry_capacity * 2 : 64;
+            entries = checked(realloc(entries, entry_capacity * sizeof(*entries)));
+        }
+        entries[entry_count].name = child_name;
+        entries[entry_count].path = child_path;
+        entry_count++;
+    }
+    closedir(dir);
+}
+
+static int entry_compare(const void * a, const void * b)
+{
+    return strcmp(((const entry_t *) a)->name, ((const entry_t *) b)->name);
+}
+
+static uint8_t * read_host_file(const char * path, int * size_dst)
+{
+    FILE * f = fopen(path, "rb");
+    if(!f) {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    if(size < 0 || size > (long) block_size * block_count) {
+        fprintf(stderr, "%s is larger than the volume\n", path);
+        exit(1);
+    }
+    uint8_t * data = checked(malloc(size ? size : 1));
+    if(fread(data, 1, size, f) != (size_t) size) {
+        fprintf(stderr, "cannot read %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    *size_dst = size;
+    return data;
+}
+
+static int usage(const char * name)
+{
+    fprintf(stderr, "usage: %s --block-count N [--block-size N] [--crc32c] [--checkpoint] [--compress] DIR IMAGE\n", name);
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    uint32_t flags = MFS_FLAG_VERIFY_TRAILER;
+    bool compress = false;
+    const char * dir_path = NULL;
+    const char * image_path = NULL;
+
+    for(int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if(!strcmp(argv[i], "--block-count") && has_value) block_count = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--block-size") && has_value) block_size = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "--crc32c")) flags |= MFS_FLAG_CRC32C;
+        else if(!strcmp(argv[i], "--checkpoint")) flags |= MFS_FLAG_CHECKPOINT;
+        else if(!strcmp(argv[i], "--compress")) compress = true;
+        else if(!dir_path && argv[i][0] != '-') dir_path = argv[i];
+        else if(!image_path && argv[i][0] != '-') image_path = argv[i];
+        else return usage(argv[0]);
+    }
+    if(!image_path || block_count <= 0 || block_size <= 0) return usage(argv[0]);
+
+    walk(dir_path, "");
+    qsort(entries, entry_count, sizeof(*entries), entry_compare);
+
+    memory = checked(calloc(block_count, block_size));
+    mfs_conf_t conf = {
+        .aligned_aux_memory = aligned_memory(MFS_ALIGNED_AUX_MEMORY_SIZE(block_size, block_count)),
+        .block_size = block_size,
+        .block_count = block_count,
+        .read_block = read_block,
+        .write_block = write_block,
+        .mount_aux_memory = aligned_memory(MFS_MOUNT_AUX_MEMORY_SIZE(block_count)),
+        .flags = flags,
+        .name_index_aux_memory = aligned_memory(MFS_NAME_INDEX_AUX_MEMORY_SIZE(block_count)),
+        .read_blocks = read_blocks,
+        .write_blocks = write_blocks,
+        .aligned_staging_memory = aligned_memory((size_t) block_size * STAGING_BLOCK_COUNT),
+        .staging_block_count = STAGING_BLOCK_COUNT,
+        .chain_aux_memory = aligned_memory(MFS_CHAIN_AUX_MEMORY_SIZE(block_count)),
+        /* so each file keeps its size and CRC32C */
+        .file_info_aux_memory = aligned_memory(MFS_FILE_INFO_AUX_MEMORY_SIZE(block_count))
+    };
+    static mfs_t mfs;
+    static mfs_file_t file;
+    static uint32_t match_table[MATCH_TABLE_ENTRIES];
+    void * block_buf = aligned_memory(block_size);
+    void * staging = aligned_memory((size_t) block_size * STAGING_BLOCK_COUNT);
+    check(mfs_mount(&mfs, &conf), "mounting", "the blank volume");
+
+    long long byte_count = 0;
+    for(int i = 0; i < entry_count; i++) {
+        const char * name = entries[i].name;
+        int size;
+        uint8_t * data = read_host_file(entries[i].path, &size);
+        check(mfs_fopen(&mfs, &file, block_buf, name, MFS_MODE_WRITE), "opening", name);
+        if(compress) check(mfs_fcompress(&mfs, &file, match_table, MATCH_TABLE_ENTRIES), "compressing", name);
+        check(mfs_fstaging(&mfs, &file, staging, STAGING_BLOCK_COUNT), "staging", name);
+        check(mfs_freserve(&mfs, &file, size), "reserving", name);
+        check(mfs_fwrite(&mfs, &file, data, size), "writing", name);
+        check(mfs_fclose(&mfs, &file), "closing", name);
+        byte_count += size;
+        free(data);
+    }
+
+    int free_space = mfs_free_space(&mfs);
+    check(free_space, "finding the free space of", "the volume");
+    check(mfs_mount(&mfs, &conf), "mounting", "the new volume");
+    if(mfs_file_count(&mfs) != entry_count) {
+        fprintf(stderr, "the new volume has %d files instead of %d\n", mfs_file_count(&mfs), entry_count);
+        return 1;
+    }
+
+    FILE * f = fopen(image_path, "wb");
+    if(!f || fwrite(memory, block_size, block_count, f) != block_count || fclose(f)) {
+        fprintf(stderr, "cannot write %s\n", image_path);
+        return 1;
+    }
+    printf("%d files, %lld bytes, %d bytes free\n", entry_count, byte_count, free_space);
+    return 0;
+}
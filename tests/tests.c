@@ -2,6 +2,14 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#ifdef MFS_THREAD_SAFE
+#include <pthread.h>
+/* bumped by the threads of test_25 */
+#define COUNTER _Atomic int
+#else
+#define COUNTER int
+#endif
 
 #define BLOCK_SIZE 2048
 #define BLOCK_COUNT 5
@@ -9,9 +17,11 @@
 #define ASSERT(expr) do { if(!(expr)) {printf("%s:%d failed\n", __func__, __LINE__); return;} } while(0)
 
 static uint8_t memory_blocks[BLOCK_SIZE * BLOCK_COUNT] = {0};
+static COUNTER read_count;
 
 static int read_block(void * cb_ctx, int block_index, void * dst)
 {
+    read_count++;
     memcpy(dst, memory_blocks + (block_index * BLOCK_SIZE), BLOCK_SIZE);
     return 0;
 }
@@ -176,8 +186,2292 @@ static void test_2(void)
     ASSERT(res == 0);
 }
 
+#define SMALL_BLOCK_SIZE 64
+#define SMALL_BLOCK_COUNT 97
+
+static uint8_t small_memory_blocks[SMALL_BLOCK_SIZE * SMALL_BLOCK_COUNT];
+static int small_write_fail_countdown = -1;
+static int small_write_lost_block = -1;
+
+#ifdef MFS_THREAD_SAFE
+/* readahead in test_25 may read a block while it is written. reading a
+   block that counts is not locked, so a race on one is still caught */
+static pthread_mutex_t small_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+#define SMALL_LOCK() pthread_mutex_lock(&small_memory_lock)
+#define SMALL_UNLOCK() pthread_mutex_unlock(&small_memory_lock)
+#else
+#define SMALL_LOCK() ((void) 0)
+#define SMALL_UNLOCK() ((void) 0)
+#endif
+
+static int small_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    read_count++;
+    memcpy(dst, small_memory_blocks + (block_index * SMALL_BLOCK_SIZE), SMALL_BLOCK_SIZE);
+    return 0;
+}
+
+static int small_write_block(void * cb_ctx, int block_index, const void * src)
+{
+    int res = 0;
+    SMALL_LOCK();
+    /* simulate a power failure by dropping a write */
+    if(small_write_fail_countdown >= 0 && small_write_fail_countdown-- == 0) res = -1;
+    /* or a write that silently goes nowhere */
+    else if(block_index != small_write_lost_block) {
+        memcpy(small_memory_blocks + (block_index * SMALL_BLOCK_SIZE), src, SMALL_BLOCK_SIZE);
+    }
+    SMALL_UNLOCK();
+    return res;
+}
+
+static uint32_t rand_state = 1;
+
+static uint32_t test_rand(void)
+{
+    rand_state = rand_state * 1103515245u + 12345u;
+    return rand_state >> 8;
+}
+
+static uint8_t small_aux_memory[MFS_ALIGNED_AUX_MEMORY_SIZE(SMALL_BLOCK_SIZE, SMALL_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t small_mount_aux_memory[MFS_MOUNT_AUX_MEMORY_SIZE(SMALL_BLOCK_COUNT)] __attribute__((aligned));
+static const mfs_conf_t small_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block
+};
+static const mfs_conf_t small_graph_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory
+};
+
+/* random writes, rewrites, deletes and abandoned writes */
+static void small_random_ops(mfs_t * m, int op_count, bool abandon_writes)
+{
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+    uint8_t buf[300];
+
+    for(int op = 0; op < op_count; op++) {
+        const char * name = names[test_rand() % 6];
+        if(test_rand() % 5 == 0) {
+            mfs_delete(m, name);
+            continue;
+        }
+        if(mfs_open(m, name, MFS_MODE_WRITE)) continue;
+        int len = test_rand() % sizeof(buf);
+        for(int i = 0; i < len; i++) buf[i] = test_rand();
+        if(mfs_write(m, buf, len) != len) continue;
+        if(abandon_writes && test_rand() % 4 == 0) {
+            mfs_mount(m, m->conf);
+            continue;
+        }
+        if(abandon_writes && test_rand() % 4 == 0) {
+            small_write_fail_countdown = test_rand() % 3;
+        }
+        mfs_close(m);
+        small_write_fail_countdown = -1;
+    }
+}
+
+static void test_3(void)
+{
+    int res;
+    static uint8_t legacy_bit_bufs[MFS_BIT_BUF_SIZE_BYTES(SMALL_BLOCK_COUNT) * 2];
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 40; round++) {
+        bool abandon_writes = round >= 20;
+
+        res = mfs_mount(&mfs, round % 2 ? &small_graph_conf : &small_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, abandon_writes);
+
+        res = mfs_mount(&mfs, &small_conf);
+        ASSERT(res == 0);
+        int legacy_file_count = mfs.file_count;
+        uint32_t legacy_youngest = mfs.youngest;
+        memcpy(legacy_bit_bufs, mfs.bit_bufs[0], sizeof(legacy_bit_bufs));
+
+        read_count = 0;
+        res = mfs_mount(&mfs, &small_graph_conf);
+        ASSERT(res == 0);
+        if(!abandon_writes) ASSERT(read_count == SMALL_BLOCK_COUNT);
+        ASSERT(mfs.file_count == legacy_file_count);
+        ASSERT(mfs.youngest == legacy_youngest);
+        ASSERT(0 == memcmp(legacy_bit_bufs, mfs.bit_bufs[0], sizeof(legacy_bit_bufs)));
+    }
+}
+
+static const mfs_conf_t small_checkpoint_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .flags = MFS_FLAG_CHECKPOINT
+};
+
+static void test_4(void)
+{
+    int res;
+    static uint8_t scan_bit_buf[MFS_BIT_BUF_SIZE_BYTES(SMALL_BLOCK_COUNT)];
+    int checkpoint_block_count = MFS_CHECKPOINT_BLOCK_COUNT(SMALL_BLOCK_SIZE, SMALL_BLOCK_COUNT);
+    uint8_t * checkpoint = small_memory_blocks + (SMALL_BLOCK_COUNT - checkpoint_block_count) * SMALL_BLOCK_SIZE;
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        res = mfs_mount(&mfs, &small_checkpoint_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, round >= 10);
+        mfs_file_count(&mfs); /* settles a failed last op */
+
+        if(round % 3 == 0) checkpoint[7] ^= 1; /* torn */
+
+        read_count = 0;
+        res = mfs_mount(&mfs, &small_checkpoint_conf);
+        ASSERT(res == 0);
+        if(round % 3) ASSERT(read_count == checkpoint_block_count);
+        else ASSERT(read_count > SMALL_BLOCK_COUNT);
+        int checkpoint_file_count = mfs.file_count;
+        memcpy(scan_bit_buf, mfs.bit_bufs[0], sizeof(scan_bit_buf));
+
+        /* a full scan finds the same files */
+        res = mfs_mount(&mfs, &small_conf);
+        ASSERT(res == 0);
+        ASSERT(mfs.file_count == checkpoint_file_count);
+        ASSERT(0 == memcmp(scan_bit_buf, mfs.bit_bufs[0], sizeof(scan_bit_buf)));
+
+        read_count = 0;
+        res = mfs_mount(&mfs, &small_checkpoint_conf);
+        ASSERT(res == 0);
+        ASSERT(read_count == checkpoint_block_count);
+    }
+}
+
+static uint8_t small_lazy_mount_aux_memory[MFS_MOUNT_AUX_MEMORY_SIZE(SMALL_BLOCK_COUNT)] __attribute__((aligned));
+static const mfs_conf_t small_lazy_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_lazy_mount_aux_memory,
+    .flags = MFS_FLAG_LAZY_VERIFY
+};
+
+static void test_5(void)
+{
+    int res;
+    uint8_t buf[100];
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_lazy_conf);
+    ASSERT(res == 0);
+
+    /* "a" in block 0, "x" in block 1, "y" in blocks 2 and 3 */
+    memset(buf, 0x11, sizeof(buf));
+    static const char * setup_names[] = {"a", "x", "y"};
+    static const int setup_sizes[] = {10, 10, sizeof(buf)};
+    for(int i = 0; i < 3; i++) {
+        res = mfs_open(&mfs, setup_names[i], MFS_MODE_WRITE);
+        ASSERT(res == 0);
+        res = mfs_write(&mfs, buf, setup_sizes[i]);
+        ASSERT(res == setup_sizes[i]);
+        res = mfs_close(&mfs);
+        ASSERT(res == 0);
+    }
+    res = mfs_delete(&mfs, "a");
+    ASSERT(res == 0);
+
+    /* an interrupted replace of "y" in block 0 loses to the old version */
+    res = mfs_open(&mfs, "y", MFS_MODE_WRITE);
+    ASSERT(res == 0);
+    memset(buf, 0x22, sizeof(buf));
+    res = mfs_write(&mfs, buf, sizeof(buf));
+    ASSERT(res == sizeof(buf));
+    small_write_fail_countdown = 1;
+    res = mfs_close(&mfs);
+    small_write_fail_countdown = -1;
+    ASSERT(res != 0);
+
+    /* damage "x" and the old "y" */
+    small_memory_blocks[SMALL_BLOCK_SIZE + 12] ^= 1;
+    small_memory_blocks[SMALL_BLOCK_SIZE * 2 + 20] ^= 1;
+
+    res = mfs_mount(&mfs, &small_lazy_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_file_count(&mfs) == 2);
+    res = mfs_open(&mfs, "y", MFS_MODE_READ);
+    ASSERT(res == 0);
+    memset(buf, 0, sizeof(buf));
+    res = mfs_read(&mfs, buf, sizeof(buf));
+    ASSERT(res == sizeof(buf));
+    ASSERT(buf[0] == 0x22 && buf[sizeof(buf) - 1] == 0x22);
+    res = mfs_close(&mfs);
+    ASSERT(res == 0);
+    ASSERT(mfs_file_count(&mfs) == 1);
+
+    res = mfs_mount(&mfs, &small_lazy_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_file_count(&mfs) == 2);
+    res = mfs_open(&mfs, "x", MFS_MODE_READ);
+    ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+    ASSERT(mfs_file_count(&mfs) == 1);
+
+    /* every name opens to the same contents as after a full mount */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        res = mfs_mount(&mfs, &small_graph_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, round >= 5);
+
+        for(int i = 0; i < 6; i++) {
+            static uint8_t contents[2][400];
+            int lens[2];
+            for(int j = 0; j < 2; j++) {
+                res = mfs_mount(&mfs, j ? &small_lazy_conf : &small_graph_conf);
+                ASSERT(res == 0);
+                res = mfs_open(&mfs, names[i], MFS_MODE_READ);
+                ASSERT(res == 0 || res == MFS_FILE_NOT_FOUND_ERROR);
+                lens[j] = -1;
+                if(res) continue;
+                lens[j] = mfs_read(&mfs, contents[j], sizeof(contents[j]));
+                res = mfs_close(&mfs);
+                ASSERT(res == 0);
+            }
+            ASSERT(lens[0] == lens[1]);
+            if(lens[0] > 0) ASSERT(0 == memcmp(contents[0], contents[1], lens[0]));
+        }
+    }
+}
+
+static uint8_t small_name_index_aux_memory[MFS_NAME_INDEX_AUX_MEMORY_SIZE(SMALL_BLOCK_COUNT)] __attribute__((aligned));
+static const mfs_conf_t small_indexed_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory,
+    .flags = MFS_FLAG_CHECKPOINT,
+    .name_index_aux_memory = small_name_index_aux_memory
+};
+
+typedef struct {
+    const char * fname;
+    int count;
+} name_count_ctx_t;
+
+static void name_count_cb(void * list_file_cb_ctx, const char * fname)
+{
+    name_count_ctx_t * ctx = list_file_cb_ctx;
+    if(0 == strcmp(fname, ctx->fname)) ctx->count++;
+}
+
+static void name_count_cb_ignore(void * list_file_cb_ctx, const char * fname)
+{
+}
+
+static void test_6(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+    static uint8_t buf[2][400];
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        res = mfs_mount(&mfs, &small_indexed_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, round >= 10);
+        mfs_file_count(&mfs);
+
+        /* the first lookup after a checkpoint mount reads every file start */
+        res = mfs_mount(&mfs, &small_indexed_conf);
+        ASSERT(res == 0);
+        read_count = 0;
+        res = mfs_open(&mfs, "nonexistent", MFS_MODE_READ);
+        ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+        ASSERT(read_count == mfs.file_count);
+
+        for(int i = 0; i < 6; i++) {
+            res = mfs_mount(&mfs, &small_conf);
+            ASSERT(res == 0);
+            int len = -1;
+            if(0 == mfs_open(&mfs, names[i], MFS_MODE_READ)) {
+                len = mfs_read(&mfs, buf[0], sizeof(buf[0]));
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+
+            res = mfs_mount(&mfs, &small_indexed_conf);
+            ASSERT(res == 0);
+            mfs_open(&mfs, "nonexistent", MFS_MODE_READ);
+            /* an interrupted replace can leave two files with the same name */
+            name_count_ctx_t count_ctx = {names[i], 0};
+            res = mfs_list_files(&mfs, &count_ctx, name_count_cb);
+            ASSERT(res == 0);
+            read_count = 0;
+            res = mfs_open(&mfs, names[i], MFS_MODE_READ);
+            if(len < 0) {
+                ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+                continue;
+            }
+            ASSERT(res == 0);
+            ASSERT(read_count == count_ctx.count);
+            ASSERT(len == mfs_read(&mfs, buf[1], sizeof(buf[1])));
+            ASSERT(mfs_close(&mfs) == 0);
+            ASSERT(0 == memcmp(buf[0], buf[1], len));
+        }
+    }
+}
+
+static void test_7(void)
+{
+    int res;
+    static mfs_file_t files[3];
+    static uint8_t file_block_bufs[3][SMALL_BLOCK_SIZE] __attribute__((aligned));
+    static uint8_t data[3][300];
+    static uint8_t buf[2][300];
+
+    for(int i = 0; i < 3; i++) for(int j = 0; j < 300; j++) data[i][j] = test_rand();
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_checkpoint_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "a", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data[0], 300) == 300);
+    ASSERT(mfs_close(&mfs) == 0);
+
+    /* two writers interleaved */
+    res = mfs_fopen(&mfs, &files[0], file_block_bufs[0], "bb", MFS_MODE_WRITE);
+    ASSERT(res == 0);
+    res = mfs_fopen(&mfs, &files[1], file_block_bufs[1], "ccc", MFS_MODE_WRITE);
+    ASSERT(res == 0);
+    res = mfs_fopen(&mfs, &files[2], file_block_bufs[2], "bb", MFS_MODE_READ);
+    ASSERT(res == MFS_FILE_BUSY_ERROR);
+    for(int i = 0; i < 300; i += 50) {
+        ASSERT(mfs_fwrite(&mfs, &files[0], data[1] + i, 50) == 50);
+        ASSERT(mfs_fwrite(&mfs, &files[1], data[2] + i, 50) == 50);
+    }
+    /* files being written are not visible yet */
+    ASSERT(mfs_file_count(&mfs) == 1);
+    ASSERT(mfs_fclose(&mfs, &files[1]) == 0);
+    ASSERT(mfs_file_count(&mfs) == 2);
+    ASSERT(mfs_fclose(&mfs, &files[0]) == 0);
+    ASSERT(mfs_fclose(&mfs, &files[0]) == MFS_WRONG_MODE_ERROR);
+
+    /* two readers of one file and the single file API alongside */
+    res = mfs_fopen(&mfs, &files[0], file_block_bufs[0], "a", MFS_MODE_READ);
+    ASSERT(res == 0);
+    res = mfs_fopen(&mfs, &files[1], file_block_bufs[1], "a", MFS_MODE_READ);
+    ASSERT(res == 0);
+    res = mfs_fopen(&mfs, &files[2], file_block_bufs[2], "a", MFS_MODE_WRITE);
+    ASSERT(res == MFS_FILE_BUSY_ERROR);
+    ASSERT(mfs_delete(&mfs, "a") == MFS_FILE_BUSY_ERROR);
+    ASSERT(mfs_open(&mfs, "bb", MFS_MODE_READ) == 0);
+    for(int i = 0; i < 300; i += 30) {
+        ASSERT(mfs_fread(&mfs, &files[0], buf[0] + i, 30) == 30);
+        ASSERT(mfs_fread(&mfs, &files[1], buf[1] + i, 30) == 30);
+    }
+    ASSERT(0 == memcmp(buf[0], data[0], 300));
+    ASSERT(0 == memcmp(buf[1], data[0], 300));
+    ASSERT(mfs_read(&mfs, buf[0], sizeof(buf[0])) == 300);
+    ASSERT(0 == memcmp(buf[0], data[1], 300));
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(mfs_fclose(&mfs, &files[0]) == 0);
+
+    /* a remount closes every file. the last writer saved the checkpoint */
+    read_count = 0;
+    res = mfs_mount(&mfs, &small_checkpoint_conf);
+    ASSERT(res == 0);
+    ASSERT(read_count == MFS_CHECKPOINT_BLOCK_COUNT(SMALL_BLOCK_SIZE, SMALL_BLOCK_COUNT));
+    ASSERT(mfs_fread(&mfs, &files[1], buf[0], 1) == MFS_WRONG_MODE_ERROR);
+    ASSERT(mfs.file_count == 3);
+    ASSERT(mfs_fopen(&mfs, &files[1], file_block_bufs[1], "ccc", MFS_MODE_READ) == 0);
+    ASSERT(mfs_fread(&mfs, &files[1], buf[0], sizeof(buf[0])) == 300);
+    ASSERT(0 == memcmp(buf[0], data[2], 300));
+    ASSERT(mfs_fclose(&mfs, &files[1]) == 0);
+
+    /* the checkpoint matches a full scan */
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs.file_count == 3);
+}
+
+static void test_8(void)
+{
+    int res;
+    static mfs_file_t file;
+    static uint8_t file_block_buf[SMALL_BLOCK_SIZE] __attribute__((aligned));
+    static uint32_t skip_entries[8];
+    static uint8_t data[2000];
+    static uint8_t buf[100];
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+
+    for(int round = 0; round < 10; round++) {
+        /* the first one exactly fills its first block */
+        int len = round == 0 ? SMALL_BLOCK_SIZE - 8 - (8 + 4) : test_rand() % sizeof(data);
+        for(int i = 0; i < len; i++) data[i] = test_rand();
+        ASSERT(mfs_open(&mfs, "log", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_write(&mfs, data, len) == len);
+        ASSERT(mfs_close(&mfs) == 0);
+
+        ASSERT(mfs_open(&mfs, "log", MFS_MODE_READ) == 0);
+        ASSERT(mfs_seek(&mfs, len + 10) == len);
+        ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == 0);
+        int offset = len / 2;
+        ASSERT(mfs_seek(&mfs, offset) == offset);
+        int expect = len - offset < (int) sizeof(buf) ? len - offset : (int) sizeof(buf);
+        ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == expect);
+        ASSERT(0 == memcmp(buf, data + offset, expect));
+        ASSERT(mfs_close(&mfs) == 0);
+
+        res = mfs_fopen(&mfs, &file, file_block_buf, "log", MFS_MODE_READ);
+        ASSERT(res == 0);
+        ASSERT(mfs_fskip_index(&mfs, &file, skip_entries, 8) == 0);
+        ASSERT(mfs_fseek(&mfs, &file, len) == len);
+        for(int i = 0; i < 50; i++) {
+            offset = test_rand() % (len + 1);
+            expect = len - offset < (int) sizeof(buf) ? len - offset : (int) sizeof(buf);
+            read_count = 0;
+            ASSERT(mfs_fseek(&mfs, &file, offset) == offset);
+            /* the whole file has been walked once */
+            ASSERT(read_count <= file.skip_stride);
+            ASSERT(mfs_fpread(&mfs, &file, buf, sizeof(buf), offset) == expect);
+            ASSERT(0 == memcmp(buf, data + offset, expect));
+        }
+        ASSERT(mfs_fclose(&mfs, &file) == 0);
+    }
+}
+
+static COUNTER transfer_count;
+static COUNTER read_blocks_count; /* blocks read by small_read_blocks */
+
+static int small_read_blocks(void * cb_ctx, int block_index, int block_count, void * dst)
+{
+    SMALL_LOCK();
+    transfer_count++;
+    read_blocks_count += block_count;
+    memcpy(dst, small_memory_blocks + (block_index * SMALL_BLOCK_SIZE), SMALL_BLOCK_SIZE * block_count);
+    SMALL_UNLOCK();
+    return 0;
+}
+
+static int small_write_blocks(void * cb_ctx, int block_index, int block_count, const void * src)
+{
+    SMALL_LOCK();
+    transfer_count++;
+    for(int i = 0; i < block_count; i++) {
+        if(block_index + i == small_write_lost_block) continue;
+        memcpy(small_memory_blocks + ((block_index + i) * SMALL_BLOCK_SIZE),
+               (const uint8_t *) src + i * SMALL_BLOCK_SIZE, SMALL_BLOCK_SIZE);
+    }
+    SMALL_UNLOCK();
+    return 0;
+}
+
+static uint8_t small_staging_memory[SMALL_BLOCK_SIZE * 8] __attribute__((aligned));
+static uint32_t small_chain_aux_memory[MFS_CHAIN_AUX_MEMORY_SIZE(SMALL_BLOCK_COUNT) / 4];
+static const mfs_conf_t small_runs_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory,
+    .read_blocks = small_read_blocks,
+    .write_blocks = small_write_blocks,
+    .aligned_staging_memory = small_staging_memory,
+    .staging_block_count = 8
+};
+
+static void test_9(void)
+{
+    int res;
+    static mfs_file_t file;
+    static uint8_t file_staging[SMALL_BLOCK_SIZE * 4] __attribute__((aligned));
+    static uint8_t data[1000];
+    static uint8_t buf[1000];
+
+    for(int i = 0; i < 1000; i++) data[i] = test_rand();
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_runs_conf);
+    ASSERT(res == 0);
+
+    /* 1000 bytes is 19 blocks */
+    transfer_count = 0;
+    ASSERT(mfs_open(&mfs, "big", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, 1000) == 1000);
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(transfer_count == 3);
+
+    ASSERT(mfs_fopen(&mfs, &file, buf, "big", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_fstaging(&mfs, &file, file_staging, 4) == 0);
+    ASSERT(mfs_fwrite(&mfs, &file, data + 1, 999) == 999);
+    ASSERT(mfs_fclose(&mfs, &file) == 0);
+
+    transfer_count = 0;
+    read_count = 0;
+    res = mfs_mount(&mfs, &small_runs_conf);
+    ASSERT(res == 0);
+    ASSERT(transfer_count == (SMALL_BLOCK_COUNT - 1) / 8 + 1);
+    ASSERT(read_count == 0);
+    ASSERT(mfs.file_count == 1);
+
+    transfer_count = 0;
+    ASSERT(mfs_open(&mfs, "big", MFS_MODE_READ) == 0);
+    ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == 999);
+    ASSERT(0 == memcmp(buf, data + 1, 999));
+    /* the first block was read by the lookup */
+    ASSERT(transfer_count == 3);
+    ASSERT(mfs_seek(&mfs, 500) == 500);
+    ASSERT(mfs_read(&mfs, buf, 10) == 10);
+    ASSERT(0 == memcmp(buf, data + 501, 10));
+    ASSERT(mfs_close(&mfs) == 0);
+
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs.file_count == 1);
+
+    /* one block holes at 0, 2, 4, 6 and 8 */
+    static mfs_conf_t chain_runs_conf;
+    chain_runs_conf = small_runs_conf;
+    chain_runs_conf.chain_aux_memory = small_chain_aux_memory;
+    for(int chain = 0; chain < 2; chain++) {
+        const mfs_conf_t * conf = chain ? &chain_runs_conf : &small_runs_conf;
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, conf);
+        ASSERT(res == 0);
+        char name[] = "h0";
+        for(int i = 0; i < 10; i++) {
+            name[1] = '0' + i;
+            ASSERT(mfs_open(&mfs, name, MFS_MODE_WRITE) == 0);
+            ASSERT(mfs_write(&mfs, data, 10) == 10);
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+        for(int i = 0; i < 10; i += 2) {
+            name[1] = '0' + i;
+            ASSERT(mfs_delete(&mfs, name) == 0);
+        }
+
+        /* 600 bytes is 11 blocks, which go after the holes in a row */
+        transfer_count = 0;
+        ASSERT(mfs_fopen(&mfs, &file, buf, "run", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_fstaging(&mfs, &file, file_staging, 4) == 0);
+        ASSERT(mfs_freserve(&mfs, &file, 600) == 0);
+        ASSERT(mfs_fwrite(&mfs, &file, data, 600) == 600);
+        ASSERT(mfs_fclose(&mfs, &file) == 0);
+        ASSERT(transfer_count == 3);
+
+        /* with nothing reserved or staged the holes are filled */
+        ASSERT(mfs_fopen(&mfs, &file, buf, "holes", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_fwrite(&mfs, &file, data, 250) == 250);
+        ASSERT(mfs_fclose(&mfs, &file) == 0);
+
+        /* reading ahead stops at the end of the run, or soon shrinks */
+        read_blocks_count = 0;
+        ASSERT(mfs_fopen(&mfs, &file, buf, "holes", MFS_MODE_READ) == 0);
+        ASSERT(mfs_fstaging(&mfs, &file, file_staging, 4) == 0);
+        ASSERT(mfs_fread(&mfs, &file, buf + SMALL_BLOCK_SIZE, 300) == 250);
+        ASSERT(0 == memcmp(buf + SMALL_BLOCK_SIZE, data, 250));
+        ASSERT(mfs_fclose(&mfs, &file) == 0);
+        ASSERT(read_blocks_count == (chain ? 0 : 2));
+        read_blocks_count = 0;
+        ASSERT(mfs_fopen(&mfs, &file, buf, "run", MFS_MODE_READ) == 0);
+        ASSERT(mfs_fstaging(&mfs, &file, file_staging, 4) == 0);
+        ASSERT(mfs_fread(&mfs, &file, buf + SMALL_BLOCK_SIZE, 700) == 600);
+        ASSERT(0 == memcmp(buf + SMALL_BLOCK_SIZE, data, 600));
+        ASSERT(mfs_fclose(&mfs, &file) == 0);
+        /* without the links the last read goes on past the file */
+        ASSERT(read_blocks_count == (chain ? 10 : 12));
+    }
+}
+
+/* writes complete when waited for, or when the queue is full */
+#define ASYNC_QUEUE_LEN 6
+
+typedef struct {
+    int block_index;
+    const void * src;
+    void * done_ctx;
+} async_write_t;
+
+static async_write_t async_queue[ASYNC_QUEUE_LEN];
+static int async_queue_used;
+static int async_queue_max;
+static int async_fail_countdown = -1;
+
+static void small_write_wait(void * cb_ctx)
+{
+    if(!async_queue_used) return;
+    async_write_t * write = &async_queue[0];
+    int res = 0;
+    if(async_fail_countdown >= 0 && async_fail_countdown-- == 0) res = -1;
+    else memcpy(small_memory_blocks + (write->block_index * SMALL_BLOCK_SIZE), write->src, SMALL_BLOCK_SIZE);
+    mfs_write_done(write->done_ctx, res);
+    async_queue_used--;
+    memmove(async_queue, async_queue + 1, async_queue_used * sizeof(async_write_t));
+}
+
+static int small_write_block_start(void * cb_ctx, int block_index, const void * src, void * done_ctx)
+{
+    if(async_queue_used == ASYNC_QUEUE_LEN) small_write_wait(cb_ctx);
+    async_queue[async_queue_used++] = (async_write_t) {block_index, src, done_ctx};
+    if(async_queue_used > async_queue_max) async_queue_max = async_queue_used;
+    return 0;
+}
+
+static const mfs_conf_t small_async_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .aligned_staging_memory = small_staging_memory,
+    .staging_block_count = 8,
+    .write_block_start = small_write_block_start,
+    .write_wait = small_write_wait
+};
+
+static void test_10(void)
+{
+    int res;
+    static mfs_file_t files[2];
+    static uint8_t file_block_bufs[2][SMALL_BLOCK_SIZE] __attribute__((aligned));
+    static uint8_t file_staging[SMALL_BLOCK_SIZE * 3] __attribute__((aligned));
+    static uint8_t data[3][1000];
+    static uint8_t buf[1000];
+
+    for(int i = 0; i < 3; i++) for(int j = 0; j < 1000; j++) data[i][j] = test_rand();
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_async_conf);
+    ASSERT(res == 0);
+
+    ASSERT(mfs_open(&mfs, "a", MFS_MODE_WRITE) == 0);
+    for(int i = 0; i < 1000; i += 100) ASSERT(mfs_write(&mfs, data[0] + i, 100) == 100);
+    ASSERT(async_queue_max > 1);
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(async_queue_used == 0);
+
+    /* one writer with two blocks in flight, one waiting for each */
+    ASSERT(mfs_fopen(&mfs, &files[0], file_block_bufs[0], "b", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_fstaging(&mfs, &files[0], file_staging, 3) == 0);
+    ASSERT(mfs_fopen(&mfs, &files[1], file_block_bufs[1], "c", MFS_MODE_WRITE) == 0);
+    for(int i = 0; i < 1000; i += 100) {
+        ASSERT(mfs_fwrite(&mfs, &files[0], data[1] + i, 100) == 100);
+        ASSERT(mfs_fwrite(&mfs, &files[1], data[2] + i, 100) == 100);
+    }
+    ASSERT(mfs_fclose(&mfs, &files[1]) == 0);
+    ASSERT(mfs_fclose(&mfs, &files[0]) == 0);
+
+    /* a failed write is reported and the old contents survive */
+    ASSERT(mfs_open(&mfs, "a", MFS_MODE_WRITE) == 0);
+    async_fail_countdown = 3;
+    res = mfs_write(&mfs, data[1], 1000);
+    if(res == 1000) res = mfs_close(&mfs);
+    async_fail_countdown = -1;
+    ASSERT(res == -1);
+    /* the remount waits for the writes still in flight */
+    ASSERT(mfs_file_count(&mfs) == 3);
+    ASSERT(async_queue_used == 0);
+
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs.file_count == 3);
+    for(int i = 0; i < 3; i++) {
+        ASSERT(mfs_open(&mfs, (const char *[]) {"a", "b", "c"}[i], MFS_MODE_READ) == 0);
+        ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == 1000);
+        ASSERT(0 == memcmp(buf, data[i], 1000));
+        ASSERT(mfs_close(&mfs) == 0);
+    }
+}
+
+static int bytes_read;
+
+static int small_read_range(void * cb_ctx, int block_index, int offset, int len, void * dst)
+{
+    bytes_read += len;
+    memcpy(dst, small_memory_blocks + (block_index * SMALL_BLOCK_SIZE) + offset, len);
+    return 0;
+}
+
+static int small_counted_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    bytes_read += SMALL_BLOCK_SIZE;
+    return small_read_block(cb_ctx, block_index, dst);
+}
+
+static const mfs_conf_t small_range_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_counted_read_block,
+    small_write_block,
+    .mount_aux_memory = small_lazy_mount_aux_memory,
+    .flags = MFS_FLAG_LAZY_VERIFY,
+    .read_range = small_read_range
+};
+static const mfs_conf_t small_counted_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_counted_read_block,
+    small_write_block,
+    .mount_aux_memory = small_lazy_mount_aux_memory,
+    .flags = MFS_FLAG_LAZY_VERIFY
+};
+
+static void test_11(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+    static uint8_t buf[2][400];
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        res = mfs_mount(&mfs, round % 2 ? &small_range_conf : &small_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, round >= 10);
+
+        /* the same lazy mount, reading whole blocks */
+        bytes_read = 0;
+        res = mfs_mount(&mfs, &small_counted_conf);
+        ASSERT(res == 0);
+        int full_mount_bytes = bytes_read;
+        int file_count = mfs.file_count;
+        bytes_read = 0;
+        res = mfs_list_files(&mfs, NULL, name_count_cb_ignore);
+        ASSERT(res == 0);
+        int full_list_bytes = bytes_read;
+
+        bytes_read = 0;
+        res = mfs_mount(&mfs, &small_range_conf);
+        ASSERT(res == 0);
+        ASSERT(bytes_read < full_mount_bytes);
+        ASSERT(mfs.file_count == file_count);
+        bytes_read = 0;
+        res = mfs_list_files(&mfs, NULL, name_count_cb_ignore);
+        ASSERT(res == 0);
+        ASSERT(bytes_read < full_list_bytes || file_count == 0);
+
+        for(int i = 0; i < 6; i++) {
+            res = mfs_mount(&mfs, &small_conf);
+            ASSERT(res == 0);
+            int len = -1;
+            if(0 == mfs_open(&mfs, names[i], MFS_MODE_READ)) {
+                len = mfs_read(&mfs, buf[0], sizeof(buf[0]));
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+
+            res = mfs_mount(&mfs, &small_range_conf);
+            ASSERT(res == 0);
+            res = mfs_open(&mfs, names[i], MFS_MODE_READ);
+            if(len < 0) {
+                ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+                continue;
+            }
+            ASSERT(res == 0);
+            /* through block_buf, then straight into the buffer, then seek back */
+            int first = len < 3 ? len : 3;
+            ASSERT(mfs_read(&mfs, buf[1], first) == first);
+            ASSERT(mfs_read(&mfs, buf[1] + first, sizeof(buf[1]) - first) == len - first);
+            ASSERT(0 == memcmp(buf[0], buf[1], len));
+            ASSERT(mfs_pread(&mfs, buf[1], sizeof(buf[1]), len / 2) == len - len / 2);
+            ASSERT(0 == memcmp(buf[0] + len / 2, buf[1], len - len / 2));
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+    }
+}
+
+static const void * small_map_block(void * cb_ctx, int block_index)
+{
+    return small_memory_blocks + (block_index * SMALL_BLOCK_SIZE);
+}
+
+static const mfs_conf_t small_mapped_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory,
+    .flags = MFS_FLAG_CHECKPOINT,
+    .name_index_aux_memory = small_name_index_aux_memory,
+    .map_block = small_map_block
+};
+
+static void test_12(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+    static uint8_t buf[2][400];
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        read_count = 0;
+        res = mfs_mount(&mfs, &small_mapped_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 30, round >= 10);
+        mfs_file_count(&mfs);
+        ASSERT(read_count == 0);
+
+        for(int i = 0; i < 6; i++) {
+            res = mfs_mount(&mfs, &small_indexed_conf);
+            ASSERT(res == 0);
+            int len = -1;
+            if(0 == mfs_open(&mfs, names[i], MFS_MODE_READ)) {
+                len = mfs_read(&mfs, buf[0], sizeof(buf[0]));
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+
+            read_count = 0;
+            res = mfs_mount(&mfs, &small_mapped_conf);
+            ASSERT(res == 0);
+            res = mfs_open(&mfs, names[i], MFS_MODE_READ);
+            if(len < 0) {
+                ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+                continue;
+            }
+            ASSERT(res == 0);
+            ASSERT(mfs_read(&mfs, buf[1], sizeof(buf[1])) == len);
+            ASSERT(0 == memcmp(buf[0], buf[1], len));
+            ASSERT(mfs_pread(&mfs, buf[1], sizeof(buf[1]), len / 3) == len - len / 3);
+            ASSERT(0 == memcmp(buf[0] + len / 3, buf[1], len - len / 3));
+            ASSERT(mfs_close(&mfs) == 0);
+            ASSERT(read_count == 0);
+        }
+    }
+}
+
+static int iov_write_count;
+
+static int small_write_block_iov(void * cb_ctx, int block_index, const mfs_iov_t * iov, int iov_count)
+{
+    uint8_t * dst = small_memory_blocks + (block_index * SMALL_BLOCK_SIZE);
+    if(block_index == small_write_lost_block) return 0;
+    int len = 0;
+    for(int i = 0; i < iov_count; i++) {
+        memcpy(dst + len, iov[i].base, iov[i].len);
+        len += iov[i].len;
+    }
+    if(len != SMALL_BLOCK_SIZE) return -1;
+    iov_write_count++;
+    return 0;
+}
+
+static const mfs_conf_t small_iov_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory,
+    .write_block_iov = small_write_block_iov
+};
+
+static void test_13(void)
+{
+    int res;
+    static uint8_t data[1000];
+    static uint8_t image[sizeof(small_memory_blocks)];
+    static uint8_t buf[sizeof(data)];
+    static const int chunks[] = {1000, 7, 56, 57, 500, 3, 1};
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    /* gathered writes leave the same image as copied ones */
+    for(int pass = 0; pass < 2; pass++) {
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        iov_write_count = 0;
+        res = mfs_mount(&mfs, pass ? &small_iov_conf : &small_graph_conf);
+        ASSERT(res == 0);
+        for(int i = 0; i < sizeof(chunks) / sizeof(*chunks); i++) {
+            res = mfs_open(&mfs, "f", MFS_MODE_WRITE);
+            ASSERT(res == 0);
+            for(int done = 0; done < sizeof(data); ) {
+                int len = sizeof(data) - done < chunks[i] ? sizeof(data) - done : chunks[i];
+                ASSERT(mfs_write(&mfs, data + done, len) == len);
+                done += len;
+            }
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+        if(pass) {
+            ASSERT(iov_write_count > 0);
+            ASSERT(0 == memcmp(image, small_memory_blocks, sizeof(image)));
+        }
+        else {
+            memcpy(image, small_memory_blocks, sizeof(image));
+        }
+    }
+
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    res = mfs_open(&mfs, "f", MFS_MODE_READ);
+    ASSERT(res == 0);
+    ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+    ASSERT(0 == memcmp(buf, data, sizeof(data)));
+    ASSERT(mfs_close(&mfs) == 0);
+}
+
+static void test_14(void)
+{
+    int res;
+    static mfs_file_t files[2];
+    static uint8_t file_bufs[2][SMALL_BLOCK_SIZE] __attribute__((aligned));
+    static uint8_t data[SMALL_BLOCK_SIZE * 40];
+    int data_size = SMALL_BLOCK_SIZE - 8;
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_graph_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_free_space(&mfs) == SMALL_BLOCK_COUNT * data_size);
+
+    /* the count kept while writing and deleting matches a fresh mount */
+    for(int round = 0; round < 10; round++) {
+        small_random_ops(&mfs, 20, round >= 5);
+        int free_space = mfs_free_space(&mfs);
+        res = mfs_mount(&mfs, &small_graph_conf);
+        ASSERT(res == 0);
+        ASSERT(mfs_free_space(&mfs) == free_space);
+    }
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_graph_conf);
+    ASSERT(res == 0);
+
+    /* the name and data of "a" fill exactly 40 blocks */
+    res = mfs_fopen(&mfs, &files[0], file_bufs[0], "a", MFS_MODE_WRITE);
+    ASSERT(res == 0);
+    ASSERT(mfs_freserve(&mfs, &files[0], SMALL_BLOCK_COUNT * data_size) == MFS_NO_SPACE_ERROR);
+    ASSERT(mfs_freserve(&mfs, &files[0], 40 * data_size - 10) == 0);
+    ASSERT(mfs_free_space(&mfs) == (SMALL_BLOCK_COUNT - 40) * data_size);
+
+    /* others cannot take the reserved blocks, and a failed reservation
+       does not close anything */
+    res = mfs_fopen(&mfs, &files[1], file_bufs[1], "b", MFS_MODE_WRITE);
+    ASSERT(res == 0);
+    ASSERT(mfs_freserve(&mfs, &files[1], (SMALL_BLOCK_COUNT - 40) * data_size) == MFS_NO_SPACE_ERROR);
+    ASSERT(mfs_freserve(&mfs, &files[1], (SMALL_BLOCK_COUNT - 41) * data_size) == 0);
+    ASSERT(mfs_free_space(&mfs) == 0);
+    ASSERT(mfs_open(&mfs, "c", MFS_MODE_WRITE) == MFS_NO_SPACE_ERROR);
+
+    ASSERT(mfs_fwrite(&mfs, &files[0], data, 40 * data_size - 10) == 40 * data_size - 10);
+    ASSERT(mfs_fclose(&mfs, &files[0]) == 0);
+    /* closing gives back what was not used */
+    ASSERT(mfs_fclose(&mfs, &files[1]) == 0);
+    ASSERT(mfs_free_space(&mfs) == (SMALL_BLOCK_COUNT - 41) * data_size);
+
+    res = mfs_mount(&mfs, &small_graph_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_free_space(&mfs) == (SMALL_BLOCK_COUNT - 41) * data_size);
+    ASSERT(mfs_delete(&mfs, "a") == 0);
+    ASSERT(mfs_free_space(&mfs) == (SMALL_BLOCK_COUNT - 1) * data_size);
+}
+
+static uint32_t ref_crc32c(uint32_t crc, const uint8_t * data, int len)
+{
+    crc = ~crc;
+    for(int i = 0; i < len; i++) {
+        crc ^= data[i];
+        for(int j = 0; j < 8; j++) crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78u : crc >> 1;
+    }
+    return ~crc;
+}
+
+static const mfs_conf_t small_crc32c_conf = {
+    .aligned_aux_memory = small_aux_memory,
+    SMALL_BLOCK_SIZE,
+    SMALL_BLOCK_COUNT,
+    NULL,
+    small_read_block,
+    small_write_block,
+    .mount_aux_memory = small_mount_aux_memory,
+    .flags = MFS_FLAG_CRC32C
+};
+
+static void test_15(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc", "dddd", "eeeee", "ffffff"};
+    static const mfs_conf_t * confs[] = {&small_conf, &small_graph_conf, &small_lazy_conf, &small_crc32c_conf};
+    static uint8_t buf[4][400];
+
+    ASSERT(ref_crc32c(0, (const uint8_t *) "123456789", 9) == 0xe3069283);
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_crc32c_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "x", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, (const uint8_t *) "hello", 5) == 5);
+    ASSERT(mfs_close(&mfs) == 0);
+    uint32_t checksum;
+    memcpy(&checksum, small_memory_blocks + SMALL_BLOCK_SIZE - 4, 4);
+    ASSERT(checksum == ref_crc32c(0, small_memory_blocks, SMALL_BLOCK_SIZE - 4));
+
+    /* files of both kinds, some of them broken, are found alike by every mount */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    for(int round = 0; round < 20; round++) {
+        res = mfs_mount(&mfs, round % 2 ? &small_crc32c_conf : &small_graph_conf);
+        ASSERT(res == 0);
+        small_random_ops(&mfs, 20, true);
+
+        for(int i = 0; i < 6; i++) {
+            int lens[4];
+            for(int j = 0; j < 4; j++) {
+                res = mfs_mount(&mfs, confs[j]);
+                ASSERT(res == 0);
+                lens[j] = -1;
+                if(0 == mfs_open(&mfs, names[i], MFS_MODE_READ)) {
+                    lens[j] = mfs_read(&mfs, buf[j], sizeof(buf[j]));
+                    ASSERT(mfs_close(&mfs) == 0);
+                }
+                ASSERT(lens[j] == lens[0]);
+                if(lens[0] > 0) ASSERT(0 == memcmp(buf[0], buf[j], lens[0]));
+            }
+        }
+    }
+}
+
+static mfs_conf_t small_verify_conf;
+
+static void test_16(void)
+{
+    int res;
+    static const uint32_t policies[] = {0, MFS_FLAG_VERIFY_TRAILER, MFS_FLAG_VERIFY_WRITES};
+    static const mfs_conf_t * bases[] = {&small_conf, &small_iov_conf, &small_runs_conf};
+    static uint8_t data[300];
+    static uint8_t buf[sizeof(data)];
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    /* "f" takes blocks 0 to 5. a lost write is caught by the full and
+       per-block policies, and by the trailer one when it is the last */
+    for(int p = 0; p < 3; p++) {
+        for(int b = 0; b < 3; b++) {
+            small_verify_conf = *bases[b];
+            small_verify_conf.flags = policies[p];
+            for(int lost = -1; lost < 6; lost++) {
+                memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+                res = mfs_mount(&mfs, &small_verify_conf);
+                ASSERT(res == 0);
+                ASSERT(mfs_open(&mfs, "f", MFS_MODE_WRITE) == 0);
+                small_write_lost_block = lost;
+                res = mfs_write(&mfs, data, sizeof(data));
+                if(res == sizeof(data)) {
+                    read_count = 0;
+                    res = mfs_close(&mfs);
+                    /* all of a run held back in staging is read back at once */
+                    bool whole = !policies[p] || (policies[p] == MFS_FLAG_VERIFY_WRITES && bases[b] == &small_runs_conf);
+                    if(res == 0) ASSERT(read_count == (whole ? 6 : 1));
+                }
+                small_write_lost_block = -1;
+                bool caught = lost >= 0 && (policies[p] != MFS_FLAG_VERIFY_TRAILER || lost == 5);
+                ASSERT(res == (caught ? MFS_READBACK_ERROR : 0));
+
+                res = mfs_mount(&mfs, &small_conf);
+                ASSERT(res == 0);
+                res = mfs_open(&mfs, "f", MFS_MODE_READ);
+                if(lost >= 0) {
+                    ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+                    continue;
+                }
+                ASSERT(res == 0);
+                ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+                ASSERT(0 == memcmp(buf, data, sizeof(data)));
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+        }
+    }
+
+    small_verify_conf = small_conf;
+    small_verify_conf.flags = MFS_FLAG_VERIFY_TRAILER | MFS_FLAG_VERIFY_WRITES;
+    ASSERT(mfs_mount(&mfs, &small_verify_conf) == MFS_BAD_BLOCK_CONFIG_ERROR);
+}
+
+static mfs_conf_t small_chain_conf;
+static mfs_conf_t small_chainless_conf;
+
+static void test_17(void)
+{
+    int res;
+    static const mfs_conf_t * bases[] = {&small_conf, &small_graph_conf, &small_indexed_conf};
+    static uint8_t data[300];
+
+    /* freeing through the remembered chains frees the same blocks */
+    for(int b = 0; b < 3; b++) {
+        small_chain_conf = *bases[b];
+        small_chain_conf.chain_aux_memory = small_chain_aux_memory;
+        small_chainless_conf = *bases[b];
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, &small_chain_conf);
+        ASSERT(res == 0);
+        for(int round = 0; round < 10; round++) {
+            small_random_ops(&mfs, 20, true);
+            int free_space = mfs_free_space(&mfs);
+            int file_count = mfs_file_count(&mfs);
+            res = mfs_mount(&mfs, &small_chainless_conf);
+            ASSERT(res == 0);
+            ASSERT(mfs_free_space(&mfs) == free_space);
+            ASSERT(mfs_file_count(&mfs) == file_count);
+            res = mfs_mount(&mfs, &small_chain_conf);
+            ASSERT(res == 0);
+        }
+    }
+
+    /* "f" takes 6 blocks. the name index finds it with one read and
+       the clobbered first block is read back */
+    for(int chain = 0; chain < 2; chain++) {
+        small_chain_conf = small_graph_conf;
+        small_chain_conf.name_index_aux_memory = small_name_index_aux_memory;
+        small_chain_conf.chain_aux_memory = chain ? small_chain_aux_memory : NULL;
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, &small_chain_conf);
+        ASSERT(res == 0);
+        ASSERT(mfs_open(&mfs, "f", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+        ASSERT(mfs_close(&mfs) == 0);
+
+        res = mfs_mount(&mfs, &small_chain_conf);
+        ASSERT(res == 0);
+        read_count = 0;
+        ASSERT(mfs_delete(&mfs, "f") == 0);
+        ASSERT(read_count == (chain ? 2 : 8));
+    }
+}
+
+#ifdef MFS_STATS
+static void test_18(void)
+{
+    int res;
+    mfs_stats_t stats;
+    static uint8_t data[300];
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    mfs_get_stats(&mfs, &stats);
+    ASSERT(stats.calls[MFS_CALL_MOUNT] == 1);
+    ASSERT(stats.reads[MFS_IO_MOUNT] == small_conf.block_count);
+
+    /* "f" takes 6 blocks, all read back at close */
+    mfs_reset_stats(&mfs);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == 0);
+    mfs_get_stats(&mfs, &stats);
+    ASSERT(stats.calls[MFS_CALL_OPEN] == 1);
+    ASSERT(stats.calls[MFS_CALL_WRITE] == 1);
+    ASSERT(stats.calls[MFS_CALL_CLOSE] == 1);
+    ASSERT(stats.writes[MFS_IO_DATA] == 6);
+    ASSERT(stats.reads[MFS_IO_VERIFY] == 6);
+    ASSERT(stats.bytes_checksummed > 0);
+    ASSERT(stats.remounts == 0);
+    for(int call = 0; call < MFS_CALL_COUNT; call++) {
+        uint32_t sum = 0;
+        for(int bucket = 0; bucket < MFS_STATS_LATENCY_BUCKETS; bucket++) sum += stats.latency[call][bucket];
+        ASSERT(sum == stats.calls[call]);
+    }
+
+    /* a lost write fails the close and the next call remounts */
+    ASSERT(mfs_open(&mfs, "g", MFS_MODE_WRITE) == 0);
+    small_write_lost_block = 6;
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == MFS_READBACK_ERROR);
+    small_write_lost_block = -1;
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_READ) == 0);
+    ASSERT(mfs_close(&mfs) == 0);
+    mfs_get_stats(&mfs, &stats);
+    ASSERT(stats.remounts == 1);
+    ASSERT(stats.calls[MFS_CALL_OPEN] == 3);
+}
+#endif
+
+#ifdef MFS_TRACE
+static uint32_t trace_time;
+
+static uint32_t small_trace_clock(void * cb_ctx)
+{
+    return trace_time++;
+}
+
+static mfs_trace_entry_t small_trace_entries[1024];
+static mfs_trace_entry_t trace_snapshot[1024];
+static mfs_conf_t small_trace_conf;
+
+static void test_19(void)
+{
+    int res;
+    static uint8_t data[300];
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    small_trace_conf = small_conf;
+    small_trace_conf.trace_entries = small_trace_entries;
+    small_trace_conf.trace_entry_count = 1024;
+    small_trace_conf.trace_clock = small_trace_clock;
+
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_trace_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+
+    /* the newest ones, then the close */
+    int n = mfs_trace_snapshot(&mfs, trace_snapshot, 64);
+    ASSERT(n == 64);
+    ASSERT(trace_snapshot[63].time == trace_time - 1);
+    ASSERT(mfs_close(&mfs) == 0);
+    n = mfs_trace_snapshot(&mfs, trace_snapshot, 64);
+    ASSERT(n == 64);
+    int close = -1;
+    for(int i = 0; i < n; i++) {
+        if(i) ASSERT(trace_snapshot[i].time == trace_snapshot[i - 1].time + 1);
+        if(trace_snapshot[i].event == MFS_TRACE_CLOSE && trace_snapshot[i].phase == MFS_TRACE_BEGIN) close = i;
+    }
+    ASSERT(close >= 0);
+    ASSERT(trace_snapshot[close].block_index == 0);
+
+    /* the steps in order, the final block written when flushing and the
+       whole file read back when verifying */
+    static const uint8_t steps[] = {MFS_TRACE_CLOSE_INVALIDATE, MFS_TRACE_CLOSE_FLUSH, MFS_TRACE_CLOSE_VERIFY,
+                                    MFS_TRACE_CLOSE_COMMIT, MFS_TRACE_CLOSE_CHECKPOINT};
+    int step = 0;
+    int writes = 0;
+    int reads = 0;
+    bool scanned = false;
+    for(int i = close + 1; i < n - 1; i++) {
+        mfs_trace_entry_t * e = &trace_snapshot[i];
+        if(e->phase == MFS_TRACE_INSTANT) {
+            ASSERT(step < sizeof(steps) && e->event == steps[step]);
+            step++;
+        }
+        else if(e->event == MFS_TRACE_WRITE && e->phase == MFS_TRACE_BEGIN) {
+            ASSERT(steps[step - 1] == MFS_TRACE_CLOSE_FLUSH);
+            ASSERT(e->block_index == 5);
+            writes++;
+        }
+        else if(e->event == MFS_TRACE_READ && e->phase == MFS_TRACE_BEGIN) {
+            ASSERT(steps[step - 1] == MFS_TRACE_CLOSE_VERIFY);
+            ASSERT(e->block_index == reads);
+            reads++;
+        }
+        else if(e->event == MFS_TRACE_SCAN_FILE && e->phase == MFS_TRACE_END) {
+            ASSERT(e->count == 0);
+            scanned = true;
+        }
+    }
+    ASSERT(step == sizeof(steps));
+    ASSERT(writes == 1);
+    ASSERT(reads == 6);
+    ASSERT(scanned);
+    ASSERT(trace_snapshot[n - 1].event == MFS_TRACE_CLOSE && trace_snapshot[n - 1].phase == MFS_TRACE_END);
+    ASSERT(trace_snapshot[n - 1].count == 0);
+
+    /* a remount is traced and starts no new trace */
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_READ) == 0);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_READ) == MFS_WRONG_MODE_ERROR);
+    mfs.needs_remount = true;
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_READ) == 0);
+    n = mfs_trace_snapshot(&mfs, trace_snapshot, 1024);
+    bool remounted = false;
+    for(int i = 0; i < n; i++) {
+        if(trace_snapshot[i].event == MFS_TRACE_REMOUNT && trace_snapshot[i].phase == MFS_TRACE_END) {
+            ASSERT(trace_snapshot[i - 1].event == MFS_TRACE_MOUNT);
+            remounted = true;
+        }
+    }
+    ASSERT(remounted);
+    ASSERT(mfs_close(&mfs) == 0);
+
+    /* a new mount starts over. each block is read by its own scan */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_trace_conf);
+    ASSERT(res == 0);
+    n = mfs_trace_snapshot(&mfs, trace_snapshot, 1024);
+    ASSERT(n == 2 + SMALL_BLOCK_COUNT * 4);
+    ASSERT(trace_snapshot[0].event == MFS_TRACE_MOUNT && trace_snapshot[0].phase == MFS_TRACE_BEGIN);
+    ASSERT(trace_snapshot[n - 1].event == MFS_TRACE_MOUNT && trace_snapshot[n - 1].phase == MFS_TRACE_END);
+    ASSERT(trace_snapshot[n - 1].time == trace_time - 1);
+
+    /* only the last ones are kept */
+    small_trace_conf.trace_entry_count = 8;
+    res = mfs_mount(&mfs, &small_trace_conf);
+    ASSERT(res == 0);
+    n = mfs_trace_snapshot(&mfs, trace_snapshot, 1024);
+    ASSERT(n == 8);
+    for(int i = 0; i < n; i++) ASSERT(trace_snapshot[i].time == trace_time - 8 + i);
+    ASSERT(trace_snapshot[n - 1].event == MFS_TRACE_MOUNT && trace_snapshot[n - 1].phase == MFS_TRACE_END);
+}
+#endif
+
+static uint8_t small_block_cache_memory[MFS_BLOCK_CACHE_MEMORY_SIZE(SMALL_BLOCK_SIZE, 16)] __attribute__((aligned(8)));
+static mfs_conf_t small_cache_conf;
+
+static void test_20(void)
+{
+    int res;
+    static uint8_t data[100];
+    static uint8_t buf[sizeof(data)];
+    static const char * names[] = {"a", "b", "c", "d", "e", "f", "g", "h"};
+    int reads[2];
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    /* looking files up again is done from the cache */
+    for(int cached = 0; cached < 2; cached++) {
+        small_cache_conf = small_conf;
+        small_cache_conf.block_cache_memory = cached ? small_block_cache_memory : NULL;
+        small_cache_conf.block_cache_block_count = 16;
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, &small_cache_conf);
+        ASSERT(res == 0);
+        for(int i = 0; i < 8; i++) {
+            ASSERT(mfs_open(&mfs, names[i], MFS_MODE_WRITE) == 0);
+            ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+
+        read_count = 0;
+        for(int round = 0; round < 4; round++) {
+            name_count_ctx_t count_ctx = {"a", 0};
+            ASSERT(mfs_list_files(&mfs, &count_ctx, name_count_cb) == 0);
+            ASSERT(count_ctx.count == 1);
+            for(int i = 0; i < 8; i++) {
+                ASSERT(mfs_open(&mfs, names[i], MFS_MODE_READ) == 0);
+                ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+                ASSERT(0 == memcmp(buf, data, sizeof(data)));
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+        }
+        reads[cached] = read_count;
+
+        /* a replaced file is not read from the cache, and its new blocks
+           are read back from the device */
+        ASSERT(mfs_open(&mfs, "a", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_write(&mfs, data + 1, sizeof(data) - 1) == sizeof(data) - 1);
+        ASSERT(mfs_close(&mfs) == 0);
+        ASSERT(mfs_open(&mfs, "a", MFS_MODE_READ) == 0);
+        ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data) - 1);
+        ASSERT(0 == memcmp(buf, data + 1, sizeof(data) - 1));
+        ASSERT(mfs_close(&mfs) == 0);
+
+        ASSERT(mfs_open(&mfs, "b", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+        small_write_lost_block = mfs.file.block;
+        ASSERT(mfs_close(&mfs) == MFS_READBACK_ERROR);
+        small_write_lost_block = -1;
+        ASSERT(mfs_open(&mfs, "b", MFS_MODE_READ) == 0);
+        ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+        ASSERT(0 == memcmp(buf, data, sizeof(data)));
+        ASSERT(mfs_close(&mfs) == 0);
+
+        ASSERT(mfs_delete(&mfs, "c") == 0);
+        ASSERT(mfs_open(&mfs, "c", MFS_MODE_READ) == MFS_FILE_NOT_FOUND_ERROR);
+        ASSERT(mfs_file_count(&mfs) == 7);
+    }
+    ASSERT(reads[1] * 4 < reads[0]);
+
+    uint32_t hits, misses;
+    mfs_block_cache_counts(&mfs, &hits, &misses);
+    ASSERT(hits > misses);
+
+    /* the cache memory is laid out for any block size */
+    ASSERT(MFS_BLOCK_CACHE_MEMORY_SIZE(63, 3) == 192 + 8 * 3 + 12);
+
+    /* nothing is counted without a cache */
+    ASSERT(mfs_mount(&mfs, &small_conf) == 0);
+    mfs_block_cache_counts(&mfs, &hits, &misses);
+    ASSERT(hits == 0 && misses == 0);
+
+    small_cache_conf.block_cache_block_count = 0;
+    ASSERT(mfs_mount(&mfs, &small_cache_conf) == MFS_BAD_BLOCK_CONFIG_ERROR);
+}
+
+/* enough blocks for several words of each bit buffer's summaries */
+#define LARGE_BLOCK_SIZE 32
+#define LARGE_BLOCK_COUNT (64 * 64 * 3 + 5)
+
+static uint8_t large_memory_blocks[LARGE_BLOCK_SIZE * LARGE_BLOCK_COUNT];
+
+static int large_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    memcpy(dst, large_memory_blocks + (block_index * LARGE_BLOCK_SIZE), LARGE_BLOCK_SIZE);
+    return 0;
+}
+
+static int large_write_block(void * cb_ctx, int block_index, const void * src)
+{
+    memcpy(large_memory_blocks + (block_index * LARGE_BLOCK_SIZE), src, LARGE_BLOCK_SIZE);
+    return 0;
+}
+
+/* the most blocks of this size whose bytes fit in an int. every block
+   is erased and writes go nowhere */
+#define HUGE_BLOCK_SIZE 4096
+#define HUGE_BLOCK_COUNT (INT_MAX / (HUGE_BLOCK_SIZE - 8))
+
+static uint8_t huge_erased_block[HUGE_BLOCK_SIZE];
+
+static int huge_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    memset(dst, 0xff, HUGE_BLOCK_SIZE);
+    return 0;
+}
+
+static int huge_write_block(void * cb_ctx, int block_index, const void * src)
+{
+    return 0;
+}
+
+static const void * huge_map_block(void * cb_ctx, int block_index)
+{
+    return huge_erased_block;
+}
+
+static uint8_t huge_aux_memory[MFS_ALIGNED_AUX_MEMORY_SIZE(HUGE_BLOCK_SIZE, HUGE_BLOCK_COUNT)] __attribute__((aligned));
+static mfs_conf_t huge_conf = {
+    .aligned_aux_memory = huge_aux_memory,
+    .block_size = HUGE_BLOCK_SIZE,
+    .block_count = HUGE_BLOCK_COUNT,
+    .read_block = huge_read_block,
+    .write_block = huge_write_block,
+    .map_block = huge_map_block
+};
+
+static uint8_t large_aux_memory[MFS_ALIGNED_AUX_MEMORY_SIZE(LARGE_BLOCK_SIZE, LARGE_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t large_mount_aux_memory[MFS_MOUNT_AUX_MEMORY_SIZE(LARGE_BLOCK_COUNT)] __attribute__((aligned));
+static mfs_conf_t large_conf;
+
+static void test_21(void)
+{
+    int res;
+    static uint8_t data[(LARGE_BLOCK_SIZE - 8) * 1000];
+    static const char * names[] = {"a", "b", "c"};
+
+    for(int i = 0; i < sizeof(data); i++) data[i] = test_rand();
+
+    for(int variant = 0; variant < 3; variant++) {
+        memset(&large_conf, 0, sizeof(large_conf));
+        large_conf.aligned_aux_memory = large_aux_memory;
+        large_conf.block_size = LARGE_BLOCK_SIZE;
+        large_conf.block_count = LARGE_BLOCK_COUNT;
+        large_conf.read_block = large_read_block;
+        large_conf.write_block = large_write_block;
+        if(variant == 1) large_conf.mount_aux_memory = large_mount_aux_memory;
+        if(variant == 2) large_conf.flags = MFS_FLAG_CHECKPOINT;
+
+        memset(large_memory_blocks, 0, sizeof(large_memory_blocks));
+        res = mfs_mount(&mfs, &large_conf);
+        ASSERT(res == 0);
+        int empty = mfs_free_space(&mfs);
+
+        /* files spanning many summary words, then small ones in what is left */
+        for(int i = 0; i < 2; i++) {
+            ASSERT(mfs_open(&mfs, names[i], MFS_MODE_WRITE) == 0);
+            ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+        char name[12];
+        int small_count = 0;
+        while(1) {
+            sprintf(name, "s%d", small_count);
+            ASSERT(mfs_open(&mfs, name, MFS_MODE_WRITE) == 0);
+            res = mfs_write(&mfs, data, 400);
+            if(res != 400) break;
+            ASSERT(mfs_close(&mfs) == 0);
+            small_count++;
+        }
+        ASSERT(res == MFS_NO_SPACE_ERROR);
+        ASSERT(small_count > 300);
+        ASSERT(mfs_file_count(&mfs) == 2 + small_count);
+
+        /* the freed blocks are found again from wherever allocation is */
+        ASSERT(mfs_delete(&mfs, "a") == 0);
+        for(int i = 0; i < small_count; i += 7) {
+            sprintf(name, "s%d", i);
+            ASSERT(mfs_delete(&mfs, name) == 0);
+        }
+        int free_space = mfs_free_space(&mfs);
+        ASSERT(mfs_open(&mfs, "c", MFS_MODE_WRITE) == 0);
+        ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+        ASSERT(mfs_close(&mfs) == 0);
+        ASSERT(mfs_free_space(&mfs) < free_space - (int) sizeof(data));
+        int file_count = mfs_file_count(&mfs);
+        free_space = mfs_free_space(&mfs);
+
+        res = mfs_mount(&mfs, &large_conf);
+        ASSERT(res == 0);
+        ASSERT(mfs_file_count(&mfs) == file_count);
+        ASSERT(mfs_free_space(&mfs) == free_space);
+        name_count_ctx_t count_ctx = {"s1", 0};
+        ASSERT(mfs_list_files(&mfs, &count_ctx, name_count_cb) == 0);
+        ASSERT(count_ctx.count == 1);
+        ASSERT(mfs_open(&mfs, "s7", MFS_MODE_READ) == MFS_FILE_NOT_FOUND_ERROR);
+        for(int i = 1; i < 3; i++) {
+            static uint8_t buf[sizeof(data)];
+            ASSERT(mfs_open(&mfs, names[i], MFS_MODE_READ) == 0);
+            ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+            ASSERT(0 == memcmp(buf, data, sizeof(data)));
+            ASSERT(mfs_close(&mfs) == 0);
+        }
+        ASSERT(empty > free_space);
+    }
+
+    /* a volume holds at most INT_MAX bytes, so that sizes and offsets fit */
+    memset(huge_erased_block, 0xff, sizeof(huge_erased_block));
+    huge_conf.block_count = HUGE_BLOCK_COUNT;
+    ASSERT(mfs_mount(&mfs, &huge_conf) == 0);
+    ASSERT(mfs_free_space(&mfs) == HUGE_BLOCK_COUNT * (HUGE_BLOCK_SIZE - 8));
+    huge_conf.block_count = HUGE_BLOCK_COUNT + 1;
+    ASSERT(mfs_mount(&mfs, &huge_conf) == MFS_BAD_BLOCK_CONFIG_ERROR);
+}
+
+/* read all of a file in random pieces and from a random offset */
+static bool segment_read_matches(mfs_t * m, const uint8_t * data, int len)
+{
+    static uint8_t buf[1000];
+
+    int have = 0;
+    while(1) {
+        int res = mfs_read(m, buf + have, test_rand() % 200 + 1);
+        if(res < 0) return false;
+        if(!res) break;
+        have += res;
+    }
+    if(have != len || memcmp(buf, data, len)) return false;
+    int offset = test_rand() % (len + 1);
+    if(mfs_seek(m, offset) != offset) return false;
+    if(mfs_read(m, buf, sizeof(buf)) != len - offset || memcmp(buf, data + offset, len - offset)) return false;
+    if(offset && mfs_seek(m, offset - 1) != offset - 1) return false;
+    return mfs_seek(m, len + 5) == len;
+}
+
+static bool segment_check(mfs_t * m, const char * name, const uint8_t * data, int len)
+{
+    if(len < 0) return mfs_open(m, name, MFS_MODE_READ) == MFS_FILE_NOT_FOUND_ERROR;
+    if(mfs_open(m, name, MFS_MODE_READ)) return false;
+    bool matches = segment_read_matches(m, data, len);
+    return mfs_close(m) == 0 && matches;
+}
+
+static void test_22(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc"};
+    static uint8_t model[3][900];
+    static uint8_t old[900];
+    static uint8_t data[300];
+    static uint8_t bit_bufs[4][MFS_BIT_BUF_SIZE_BYTES(SMALL_BLOCK_COUNT)];
+    int model_len[3];
+
+    small_chain_conf = small_graph_conf;
+    small_chain_conf.chain_aux_memory = small_chain_aux_memory;
+    small_chainless_conf = small_conf;
+    small_chainless_conf.chain_aux_memory = small_chain_aux_memory;
+    const mfs_conf_t * confs[] = {&small_conf, &small_graph_conf, &small_checkpoint_conf, &small_lazy_conf,
+                                  &small_range_conf, &small_mapped_conf, &small_runs_conf, &small_chain_conf,
+                                  &small_chainless_conf};
+
+    /* random appends, rewrites and deletes, some cut short by a power failure */
+    for(int c = 0; c < sizeof(confs) / sizeof(*confs); c++) {
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, confs[c]);
+        ASSERT(res == 0);
+        int empty = mfs_free_space(&mfs);
+        for(int i = 0; i < 3; i++) model_len[i] = -1;
+
+        for(int op = 0; op < 300; op++) {
+            int n = test_rand() % 3;
+            int kind = test_rand() % 10;
+            int len = test_rand() % (kind == 1 ? 300 : 100);
+            for(int i = 0; i < len; i++) data[i] = test_rand();
+            if(kind == 0 || (model_len[n] > 0 && model_len[n] + len > sizeof(model[n]))) {
+                ASSERT(mfs_delete(&mfs, names[n]) == (model_len[n] < 0 ? MFS_FILE_NOT_FOUND_ERROR : 0));
+                model_len[n] = -1;
+                continue;
+            }
+
+            int old_len = model_len[n];
+            if(old_len > 0) memcpy(old, model[n], old_len);
+            if(kind == 1 || model_len[n] < 0) model_len[n] = 0;
+            memcpy(model[n] + model_len[n], data, len);
+            model_len[n] += len;
+
+            ASSERT(mfs_open(&mfs, names[n], kind == 1 ? MFS_MODE_WRITE : MFS_MODE_APPEND) == 0);
+            ASSERT(mfs_write(&mfs, data, len) == len);
+            /* a rewrite cut short before the old file is clobbered leaves a
+               file that a later rewrite could bring back, so only appends */
+            bool fail = kind != 1 && test_rand() % 6 == 0;
+            if(fail) small_write_fail_countdown = test_rand() % 4;
+            res = mfs_close(&mfs);
+            small_write_fail_countdown = -1;
+            if(fail) {
+                /* all or nothing */
+                res = mfs_mount(&mfs, confs[c]);
+                ASSERT(res == 0);
+                if(!segment_check(&mfs, names[n], model[n], model_len[n])) {
+                    model_len[n] = old_len;
+                    memcpy(model[n], old, old_len > 0 ? old_len : 0);
+                }
+            }
+            else ASSERT(res == 0);
+            ASSERT(segment_check(&mfs, names[n], model[n], model_len[n]));
+
+            if(op % 20 == 19) {
+                int free_space = mfs_free_space(&mfs);
+                res = mfs_mount(&mfs, confs[c]);
+                ASSERT(res == 0);
+                ASSERT(mfs_free_space(&mfs) == free_space);
+                for(int i = 0; i < 3; i++) ASSERT(segment_check(&mfs, names[i], model[i], model_len[i]));
+            }
+        }
+
+        /* a scan and a single pass mount agree */
+        res = mfs_mount(&mfs, &small_conf);
+        ASSERT(res == 0);
+        uint32_t youngest = mfs.youngest;
+        for(int i = 0; i < 4; i++) memcpy(bit_bufs[i], mfs.bit_bufs[i], sizeof(bit_bufs[i]));
+        res = mfs_mount(&mfs, &small_graph_conf);
+        ASSERT(res == 0);
+        ASSERT(mfs.youngest == youngest);
+        for(int i = 0; i < 4; i++) ASSERT(0 == memcmp(bit_bufs[i], mfs.bit_bufs[i], sizeof(bit_bufs[i])));
+
+        res = mfs_mount(&mfs, confs[c]);
+        ASSERT(res == 0);
+        for(int i = 0; i < 3; i++) {
+            ASSERT(segment_check(&mfs, names[i], model[i], model_len[i]));
+            if(model_len[i] >= 0) ASSERT(mfs_delete(&mfs, names[i]) == 0);
+        }
+        ASSERT(mfs_free_space(&mfs) == empty);
+        ASSERT(mfs_file_count(&mfs) == 0);
+    }
+
+    /* appending to a long file writes a block, then copies that one */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_APPEND) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == 0);
+    int free_space = mfs_free_space(&mfs);
+    for(int i = 0; i < 3; i++) {
+        ASSERT(mfs_open(&mfs, "f", MFS_MODE_APPEND) == 0);
+        ASSERT(mfs_write(&mfs, data, 10) == 10);
+        ASSERT(mfs_close(&mfs) == 0);
+        ASSERT(mfs_free_space(&mfs) == free_space - (SMALL_BLOCK_SIZE - 8));
+    }
+    ASSERT(mfs_file_count(&mfs) == 1);
+    memcpy(old, data, sizeof(data));
+    for(int i = 0; i < 3; i++) memcpy(old + sizeof(data) + i * 10, data, 10);
+    ASSERT(segment_check(&mfs, "f", old, sizeof(data) + 30));
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    ASSERT(mfs_free_space(&mfs) == free_space - (SMALL_BLOCK_SIZE - 8));
+    ASSERT(segment_check(&mfs, "f", old, sizeof(data) + 30));
+}
+
+static uint32_t small_file_info_aux_memory[MFS_FILE_INFO_AUX_MEMORY_SIZE(SMALL_BLOCK_COUNT) / 4];
+static mfs_conf_t small_info_confs[6];
+static const char * info_names[] = {"a", "bb", "ccc"};
+static mfs_file_info_t listed_info[3];
+static int listed_count;
+
+static void list_info_cb(void * ctx, const char * name, const mfs_file_info_t * info)
+{
+    for(int i = 0; i < 3; i++) {
+        if(!strcmp(name, info_names[i])) listed_info[i] = *info;
+    }
+    listed_count++;
+}
+
+static bool info_matches(const mfs_file_info_t * info, const uint8_t * data, int len)
+{
+    return info->size == len && info->checksum == ref_crc32c(0, data, len);
+}
+
+static void test_23(void)
+{
+    int res;
+    static uint8_t model[3][900];
+    static uint8_t data[300];
+    int model_len[3];
+
+    small_info_confs[0] = small_conf;
+    small_info_confs[1] = small_graph_conf;
+    small_info_confs[2] = small_iov_conf;
+    small_info_confs[3] = small_counted_conf;
+    /* the info kept in final blocks is found through the links */
+    small_info_confs[4] = small_graph_conf;
+    small_info_confs[4].chain_aux_memory = small_chain_aux_memory;
+    small_info_confs[5] = small_counted_conf;
+    small_info_confs[5].flags = 0;
+    small_info_confs[5].chain_aux_memory = small_chain_aux_memory;
+    for(int c = 0; c < 6; c++) small_info_confs[c].file_info_aux_memory = small_file_info_aux_memory;
+    const mfs_conf_t * confs[] = {&small_conf, &small_lazy_conf, &small_chain_conf, &small_info_confs[0],
+                                  &small_info_confs[1], &small_info_confs[2], &small_info_confs[3],
+                                  &small_info_confs[4]};
+
+    /* the size and checksum through writes, appends and deletes */
+    for(int c = 0; c < sizeof(confs) / sizeof(*confs); c++) {
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, confs[c]);
+        ASSERT(res == 0);
+        for(int i = 0; i < 3; i++) model_len[i] = -1;
+
+        for(int op = 0; op < 200; op++) {
+            int n = test_rand() % 3;
+            int kind = test_rand() % 10;
+            int len = test_rand() % (kind == 1 ? 300 : 100);
+            for(int i = 0; i < len; i++) data[i] = test_rand();
+            if(kind == 0 || (model_len[n] > 0 && model_len[n] + len > sizeof(model[n]))) {
+                ASSERT(mfs_delete(&mfs, info_names[n]) == (model_len[n] < 0 ? MFS_FILE_NOT_FOUND_ERROR : 0));
+                model_len[n] = -1;
+            }
+            else {
+                if(kind == 1 || model_len[n] < 0) model_len[n] = 0;
+                memcpy(model[n] + model_len[n], data, len);
+                model_len[n] += len;
+                ASSERT(mfs_open(&mfs, info_names[n], kind == 1 ? MFS_MODE_WRITE : MFS_MODE_APPEND) == 0);
+                ASSERT(mfs_write(&mfs, data, len) == len);
+                ASSERT(mfs_close(&mfs) == 0);
+            }
+
+            if(op % 30 == 29) {
+                res = mfs_mount(&mfs, confs[c]);
+                ASSERT(res == 0);
+            }
+
+            mfs_file_info_t info;
+            if(test_rand() % 2) {
+                int i = test_rand() % 3;
+                res = mfs_stat(&mfs, info_names[i], &info);
+                if(model_len[i] < 0) ASSERT(res == MFS_FILE_NOT_FOUND_ERROR);
+                else ASSERT(res == 0 && info_matches(&info, model[i], model_len[i]));
+            }
+            else {
+                memset(listed_info, 0xff, sizeof(listed_info));
+                listed_count = 0;
+                ASSERT(mfs_list_files_info(&mfs, NULL, list_info_cb) == 0);
+                ASSERT(listed_count == mfs_file_count(&mfs));
+                for(int i = 0; i < 3; i++) {
+                    if(model_len[i] < 0) ASSERT(listed_info[i].size == -1);
+                    else ASSERT(info_matches(&listed_info[i], model[i], model_len[i]));
+                }
+            }
+        }
+    }
+
+    /* once known, asking again or after writing reads nothing */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_info_confs[3]);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_APPEND) == 0);
+    ASSERT(mfs_write(&mfs, data, 10) == 10);
+    ASSERT(mfs_close(&mfs) == 0);
+    memcpy(model[0], data, sizeof(data));
+    memcpy(model[0] + sizeof(data), data, 10);
+    mfs_file_info_t info;
+    bytes_read = 0;
+    ASSERT(mfs_stat(&mfs, "f", &info) == 0);
+    int name_read = bytes_read;
+    ASSERT(info_matches(&info, model[0], sizeof(data) + 10));
+    res = mfs_mount(&mfs, &small_info_confs[3]);
+    ASSERT(res == 0);
+    bytes_read = 0;
+    ASSERT(mfs_stat(&mfs, "f", &info) == 0);
+    ASSERT(info_matches(&info, model[0], sizeof(data) + 10));
+    ASSERT(bytes_read > name_read);
+    bytes_read = 0;
+    ASSERT(mfs_stat(&mfs, "f", &info) == 0);
+    ASSERT(bytes_read == name_read);
+    ASSERT(info_matches(&info, model[0], sizeof(data) + 10));
+
+    ASSERT(mfs_open(&mfs, "f", MFS_MODE_READ) == 0);
+    ASSERT(mfs_stat(&mfs, "f", &info) == MFS_WRONG_MODE_ERROR);
+    ASSERT(mfs_stat(&mfs, "", &info) == MFS_FILE_NAME_BAD_LEN_ERROR);
+
+    /* after a mount that learned the links, listing reads the first and
+       final blocks of the last segments, and the names */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_info_confs[5]);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "a", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(mfs_open(&mfs, "a", MFS_MODE_APPEND) == 0);
+    ASSERT(mfs_write(&mfs, data, 10) == 10);
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(mfs_open(&mfs, "bb", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_close(&mfs) == 0);
+    res = mfs_mount(&mfs, &small_info_confs[5]);
+    ASSERT(res == 0);
+    bytes_read = 0;
+    memset(listed_info, 0xff, sizeof(listed_info));
+    ASSERT(mfs_list_files_info(&mfs, NULL, list_info_cb) == 0);
+    ASSERT(bytes_read == 5 * SMALL_BLOCK_SIZE);
+    ASSERT(info_matches(&listed_info[0], model[0], sizeof(data) + 10));
+    ASSERT(info_matches(&listed_info[1], data, sizeof(data)));
+
+    /* an append after a mount goes on from the kept info */
+    res = mfs_mount(&mfs, &small_info_confs[5]);
+    ASSERT(res == 0);
+    ASSERT(mfs_open(&mfs, "bb", MFS_MODE_APPEND) == 0);
+    ASSERT(mfs_write(&mfs, data, 10) == 10);
+    ASSERT(mfs_close(&mfs) == 0);
+    res = mfs_mount(&mfs, &small_info_confs[5]);
+    ASSERT(res == 0);
+    bytes_read = 0;
+    ASSERT(mfs_list_files_info(&mfs, NULL, list_info_cb) == 0);
+    /* both last segments are a block */
+    ASSERT(bytes_read == 4 * SMALL_BLOCK_SIZE);
+    ASSERT(info_matches(&listed_info[1], model[0], sizeof(data) + 10));
+}
+
+/* log lines with a few fields that change */
+static void compressible_fill(uint8_t * dst, int len)
+{
+    int i = 0;
+    while(i < len) {
+        char line[100];
+        int line_len = snprintf(line, sizeof(line), "{\"sensor\": \"temp%d\", \"value\": %d.%d, \"status\": \"ok\"}\n",
+                                (int) (test_rand() % 4), (int) (20 + test_rand() % 5), (int) (test_rand() % 10));
+        for(int j = 0; j < line_len && i < len; j++) dst[i++] = line[j];
+    }
+}
+
+static void test_24(void)
+{
+    int res;
+    static const char * names[] = {"a", "bb", "ccc"};
+    static mfs_file_t file;
+    static uint8_t file_block_buf[BLOCK_SIZE] __attribute__((aligned));
+    static uint32_t match_table[256];
+    static uint8_t model[3][900];
+    static uint8_t data[8000];
+    static uint8_t buf[8000];
+    int model_len[3];
+    bool compressed[3];
+
+    const mfs_conf_t * confs[] = {&small_conf, &small_graph_conf, &small_checkpoint_conf, &small_lazy_conf,
+                                  &small_range_conf, &small_mapped_conf, &small_runs_conf, &small_chain_conf,
+                                  &small_iov_conf, &small_crc32c_conf, &small_async_conf, &small_info_confs[0]};
+
+    /* compressed and plain files, rewritten, appended to and deleted */
+    for(int c = 0; c < sizeof(confs) / sizeof(*confs); c++) {
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        res = mfs_mount(&mfs, confs[c]);
+        ASSERT(res == 0);
+        int empty = mfs_free_space(&mfs);
+        for(int i = 0; i < 3; i++) model_len[i] = -1;
+
+        for(int op = 0; op < 150; op++) {
+            int n = test_rand() % 3;
+            int kind = test_rand() % 10;
+            int len = test_rand() % (kind == 1 ? 300 : 100);
+            if(test_rand() % 4) compressible_fill(data, len);
+            else for(int i = 0; i < len; i++) data[i] = test_rand();
+            if(kind == 0 || (model_len[n] > 0 && model_len[n] + len > sizeof(model[n]))) {
+                ASSERT(mfs_delete(&mfs, names[n]) == (model_len[n] < 0 ? MFS_FILE_NOT_FOUND_ERROR : 0));
+                model_len[n] = -1;
+                continue;
+            }
+
+            bool create = kind == 1 || model_len[n] < 0;
+            ASSERT(mfs_fopen(&mfs, &file, file_block_buf, names[n], kind == 1 ? MFS_MODE_WRITE : MFS_MODE_APPEND) == 0);
+            if(create) {
+                model_len[n] = 0;
+                compressed[n] = test_rand() % 2;
+                if(compressed[n]) ASSERT(mfs_fcompress(&mfs, &file, match_table, 1 + test_rand() % 256) == 0);
+            }
+            else if(test_rand() % 2) {
+                res = mfs_fcompress(&mfs, &file, match_table, 256);
+                ASSERT(res == (compressed[n] ? 0 : MFS_WRONG_MODE_ERROR));
+            }
+            memcpy(model[n] + model_len[n], data, len);
+            model_len[n] += len;
+            for(int i = 0; i < len; ) {
+                int chunk = test_rand() % 40 + 1;
+                if(chunk > len - i) chunk = len - i;
+                ASSERT(mfs_fwrite(&mfs, &file, data + i, chunk) == chunk);
+                i += chunk;
+            }
+            ASSERT(mfs_fclose(&mfs, &file) == 0);
+
+            ASSERT(segment_check(&mfs, names[n], model[n], model_len[n]));
+            mfs_file_info_t info;
+            ASSERT(mfs_stat(&mfs, names[n], &info) == 0);
+            ASSERT(info_matches(&info, model[n], model_len[n]));
+
+            if(op % 20 == 19) {
+                int free_space = mfs_free_space(&mfs);
+                res = mfs_mount(&mfs, confs[c]);
+                ASSERT(res == 0);
+                ASSERT(mfs_free_space(&mfs) == free_space);
+                for(int i = 0; i < 3; i++) ASSERT(segment_check(&mfs, names[i], model[i], model_len[i]));
+            }
+        }
+
+        for(int i = 0; i < 3; i++) {
+            if(model_len[i] >= 0) ASSERT(mfs_delete(&mfs, names[i]) == 0);
+        }
+        ASSERT(mfs_free_space(&mfs) == empty);
+    }
+
+    /* a reserved size can be written even when nothing compresses */
+    memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+    res = mfs_mount(&mfs, &small_conf);
+    ASSERT(res == 0);
+    int free_space = mfs_free_space(&mfs);
+    ASSERT(mfs_fopen(&mfs, &file, file_block_buf, "r", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_fcompress(&mfs, &file, match_table, 256) == 0);
+    ASSERT(mfs_freserve(&mfs, &file, free_space * 9 / 10) == 0);
+    ASSERT(mfs_freserve(&mfs, &file, free_space) == MFS_NO_SPACE_ERROR);
+    for(int i = 0; i < free_space * 9 / 10; i++) data[i] = test_rand();
+    ASSERT(mfs_fwrite(&mfs, &file, data, free_space * 9 / 10) == free_space * 9 / 10);
+    ASSERT(mfs_fclose(&mfs, &file) == 0);
+
+    /* 8000 bytes of logs take 2 blocks rather than 4 */
+    memset(memory_blocks, 0, sizeof(memory_blocks));
+    res = mfs_mount(&mfs, &conf);
+    ASSERT(res == 0);
+    free_space = mfs_free_space(&mfs);
+    compressible_fill(data, sizeof(data));
+    ASSERT(mfs_fopen(&mfs, &file, file_block_buf, "log", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_fcompress(&mfs, &file, match_table, 256) == 0);
+    ASSERT(mfs_fwrite(&mfs, &file, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_fclose(&mfs, &file) == 0);
+    ASSERT(free_space - mfs_free_space(&mfs) == 2 * (BLOCK_SIZE - 8));
+    ASSERT(mfs_open(&mfs, "log", MFS_MODE_READ) == 0);
+    ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+    ASSERT(0 == memcmp(buf, data, sizeof(data)));
+    ASSERT(mfs_pread(&mfs, buf, 100, 5000) == 100);
+    ASSERT(0 == memcmp(buf, data + 5000, 100));
+    ASSERT(mfs_pread(&mfs, buf, 100, 2000) == 100);
+    ASSERT(0 == memcmp(buf, data + 2000, 100));
+    ASSERT(mfs_close(&mfs) == 0);
+
+    /* the same with mfs_open, which cannot compress once written to */
+    ASSERT(mfs_delete(&mfs, "log") == 0);
+    ASSERT(mfs_open(&mfs, "log", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_compress(&mfs, match_table, 256) == 0);
+    ASSERT(mfs_write(&mfs, data, sizeof(data)) == sizeof(data));
+    ASSERT(mfs_compress(&mfs, match_table, 256) == 0);
+    ASSERT(mfs_close(&mfs) == 0);
+    ASSERT(free_space - mfs_free_space(&mfs) == 2 * (BLOCK_SIZE - 8));
+    ASSERT(mfs_open(&mfs, "log", MFS_MODE_READ) == 0);
+    ASSERT(mfs_read(&mfs, buf, sizeof(buf)) == sizeof(data));
+    ASSERT(0 == memcmp(buf, data, sizeof(data)));
+    ASSERT(mfs_compress(&mfs, match_table, 256) == MFS_WRONG_MODE_ERROR);
+    ASSERT(mfs_open(&mfs, "plain", MFS_MODE_WRITE) == 0);
+    ASSERT(mfs_write(&mfs, data, 10) == 10);
+    ASSERT(mfs_compress(&mfs, match_table, 256) == MFS_WRONG_MODE_ERROR);
+    ASSERT(mfs_close(&mfs) == 0);
+}
+
+#ifdef MFS_THREAD_SAFE
+#define THREAD_BLOCK_SIZE 512
+#define THREAD_BLOCK_COUNT 512
+#define THREAD_READERS 4
+#define THREAD_ROUNDS 300
+
+static uint8_t thread_memory_blocks[THREAD_BLOCK_SIZE * THREAD_BLOCK_COUNT];
+
+static int thread_read_block(void * cb_ctx, int block_index, void * dst)
+{
+    memcpy(dst, thread_memory_blocks + (block_index * THREAD_BLOCK_SIZE), THREAD_BLOCK_SIZE);
+    return 0;
+}
+
+static int thread_write_block(void * cb_ctx, int block_index, const void * src)
+{
+    memcpy(thread_memory_blocks + (block_index * THREAD_BLOCK_SIZE), src, THREAD_BLOCK_SIZE);
+    return 0;
+}
+
+static uint8_t thread_aux_memory[MFS_ALIGNED_AUX_MEMORY_SIZE(THREAD_BLOCK_SIZE, THREAD_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t thread_mount_aux_memory[MFS_MOUNT_AUX_MEMORY_SIZE(THREAD_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t thread_name_index_aux_memory[MFS_NAME_INDEX_AUX_MEMORY_SIZE(THREAD_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t thread_chain_aux_memory[MFS_CHAIN_AUX_MEMORY_SIZE(THREAD_BLOCK_COUNT)] __attribute__((aligned));
+static uint8_t thread_reader_memory[THREAD_BLOCK_SIZE * 2] __attribute__((aligned));
+static const mfs_conf_t thread_conf = {
+    .aligned_aux_memory = thread_aux_memory,
+    .block_size = THREAD_BLOCK_SIZE,
+    .block_count = THREAD_BLOCK_COUNT,
+    .read_block = thread_read_block,
+    .write_block = thread_write_block,
+    .mount_aux_memory = thread_mount_aux_memory,
+    .name_index_aux_memory = thread_name_index_aux_memory,
+    .chain_aux_memory = thread_chain_aux_memory,
+    .aligned_reader_memory = thread_reader_memory,
+    .reader_buffer_count = 2
+};
+static mfs_conf_t thread_crc32c_conf;
+
+typedef struct {
+    mfs_t mfs;
+    const mfs_conf_t * conf;
+    bool compress;
+    /* readers stage runs of blocks read with read_blocks */
+    bool staging;
+    uint32_t match_table[256];
+} thread_volume_t;
+
+/* run alongside each other */
+static thread_volume_t thread_volumes[2];
+static const char * thread_names[] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7"};
+
+static uint8_t thread_byte(int file, int offset)
+{
+    return offset * 7 + file * 13;
+}
+
+/* up to 5895 bytes on thread_conf */
+static int thread_size(const thread_volume_t * volume, int file)
+{
+    return volume->conf->block_size * volume->conf->block_count / 400 * (2 + file);
+}
+
+static uint32_t thread_rand(uint32_t * state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void thread_list_cb(void * ctx, const char * name)
+{
+    if(name[0] == 'r') *(int *) ctx += 1;
+}
+
+/* the number of things that went wrong */
+static void * thread_reader(void * arg)
+{
+    static _Thread_local uint8_t block_buf[THREAD_BLOCK_SIZE] __attribute__((aligned));
+    static _Thread_local uint8_t staging[SMALL_BLOCK_SIZE * 4] __attribute__((aligned));
+    static _Thread_local uint8_t buf[THREAD_BLOCK_SIZE * 3];
+    thread_volume_t * volume = &thread_volumes[(intptr_t) arg / THREAD_READERS];
+    mfs_t * mfs = &volume->mfs;
+    uint32_t state = (uintptr_t) arg * 2654435761u + 1;
+    intptr_t errors = 0;
+    mfs_file_t file;
+
+    for(int round = 0; round < THREAD_ROUNDS; round++) {
+        if(thread_rand(&state) % 8 == 0) {
+            int listed = 0;
+            if(mfs_list_files(mfs, &listed, thread_list_cb) || listed != 8) errors++;
+            if(mfs_file_count(mfs) < 8) errors++;
+            continue;
+        }
+        int f = thread_rand(&state) % 8;
+        if(mfs_fopen(mfs, &file, block_buf, thread_names[f], MFS_MODE_READ)) {
+            errors++;
+            continue;
+        }
+        if(volume->staging && mfs_fstaging(mfs, &file, staging, 4)) errors++;
+        int size = thread_size(volume, f);
+        int offset = thread_rand(&state) % size;
+        int len = thread_rand(&state) % (volume->conf->block_size * 3);
+        int expected = offset + len > size ? size - offset : len;
+        if(mfs_fpread(mfs, &file, buf, len, offset) != expected) errors++;
+        for(int i = 0; i < expected; i++) {
+            if(buf[i] != thread_byte(f, offset + i)) {
+                errors++;
+                break;
+            }
+        }
+        if(mfs_fclose(mfs, &file)) errors++;
+    }
+    return (void *) errors;
+}
+
+static void * thread_writer(void * arg)
+{
+    static _Thread_local uint8_t block_buf[THREAD_BLOCK_SIZE] __attribute__((aligned));
+    static _Thread_local uint8_t data[3000];
+    thread_volume_t * volume = &thread_volumes[(intptr_t) arg];
+    mfs_t * mfs = &volume->mfs;
+    int max_size = volume->conf->block_size * volume->conf->block_count / 16;
+    if(max_size > sizeof(data)) max_size = sizeof(data);
+    uint32_t state = 12345;
+    intptr_t errors = 0;
+    mfs_file_t file;
+
+    for(int round = 0; round < THREAD_ROUNDS / 3; round++) {
+        const char * name = round % 3 ? "w" : "v";
+        int size = thread_rand(&state) % max_size;
+        for(int i = 0; i < size; i++) data[i] = round + i;
+        if(mfs_fopen(mfs, &file, block_buf, name, round % 4 == 3 ? MFS_MODE_APPEND : MFS_MODE_WRITE)) {
+            errors++;
+            continue;
+        }
+        if(volume->compress && mfs_fcompress(mfs, &file, volume->match_table, 256)) errors++;
+        if(mfs_freserve(mfs, &file, size)) errors++;
+        for(int done = 0; done < size; done += 100) {
+            int len = size - done < 100 ? size - done : 100;
+            if(mfs_fwrite(mfs, &file, data + done, len) != len) errors++;
+        }
+        if(mfs_fclose(mfs, &file)) errors++;
+        if(round % 10 == 9 && mfs_delete(mfs, "v")) errors++;
+    }
+    return (void *) errors;
+}
+
+/* mounts a volume and writes the files the readers read */
+static void * thread_setup(void * arg)
+{
+    static _Thread_local uint8_t data[1000 + 7 * 700];
+    thread_volume_t * volume = &thread_volumes[(intptr_t) arg];
+    mfs_t * mfs = &volume->mfs;
+    intptr_t errors = 0;
+
+    if(mfs_mount(mfs, volume->conf)) return (void *) 1;
+    for(int f = 0; f < 8; f++) {
+        int size = thread_size(volume, f);
+        for(int i = 0; i < size; i++) data[i] = thread_byte(f, i);
+        if(mfs_open(mfs, thread_names[f], MFS_MODE_WRITE)) errors++;
+        if(volume->compress && mfs_compress(mfs, volume->match_table, 256)) errors++;
+        if(mfs_write(mfs, data, size) != size) errors++;
+        if(mfs_close(mfs)) errors++;
+    }
+    return (void *) errors;
+}
+
+/* readers open, read and list alongside a writer, on two volumes at once
+   and then on a volume with each of a few features */
+static void test_25(void)
+{
+    int res;
+    static uint8_t data[1000 + 7 * 700];
+    static const struct {
+        const mfs_conf_t * confs[2];
+        bool compress;
+        bool staging;
+    } cases[] = {
+        /* set up alongside each other, the first to compute a CRC32C */
+        {{&thread_crc32c_conf, &small_crc32c_conf}, .compress = true},
+        {{&thread_conf}},
+        {{&thread_conf}, .compress = true},
+        {{&small_crc32c_conf}},
+        {{&small_runs_conf}, .staging = true},
+        {{&small_mapped_conf}}
+    };
+
+    thread_crc32c_conf = thread_conf;
+    thread_crc32c_conf.flags = MFS_FLAG_CRC32C;
+
+    for(int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        int volume_count = cases[c].confs[1] ? 2 : 1;
+        memset(thread_memory_blocks, 0, sizeof(thread_memory_blocks));
+        memset(small_memory_blocks, 0, sizeof(small_memory_blocks));
+        pthread_t readers[2][THREAD_READERS];
+        pthread_t writers[2];
+        intptr_t errors = 0;
+        void * thread_errors;
+        for(intptr_t v = 0; v < volume_count; v++) {
+            thread_volumes[v].conf = cases[c].confs[v];
+            thread_volumes[v].compress = cases[c].compress;
+            thread_volumes[v].staging = cases[c].staging;
+            ASSERT(pthread_create(&writers[v], NULL, thread_setup, (void *) v) == 0);
+        }
+        for(int v = 0; v < volume_count; v++) {
+            pthread_join(writers[v], &thread_errors);
+            errors += (intptr_t) thread_errors;
+        }
+        ASSERT(errors == 0);
+
+        for(intptr_t v = 0; v < volume_count; v++) {
+            for(intptr_t i = 0; i < THREAD_READERS; i++) {
+                ASSERT(pthread_create(&readers[v][i], NULL, thread_reader, (void *) (v * THREAD_READERS + i)) == 0);
+            }
+            ASSERT(pthread_create(&writers[v], NULL, thread_writer, (void *) v) == 0);
+        }
+        for(int v = 0; v < volume_count; v++) {
+            for(int i = 0; i < THREAD_READERS; i++) {
+                pthread_join(readers[v][i], &thread_errors);
+                errors += (intptr_t) thread_errors;
+            }
+            pthread_join(writers[v], &thread_errors);
+            errors += (intptr_t) thread_errors;
+        }
+        ASSERT(errors == 0);
+
+        /* what the threads left mounts as it was */
+        for(int v = 0; v < volume_count; v++) {
+            thread_volume_t * volume = &thread_volumes[v];
+            int file_count = mfs_file_count(&volume->mfs);
+            res = mfs_mount(&volume->mfs, volume->conf);
+            ASSERT(res == 0);
+            ASSERT(mfs_file_count(&volume->mfs) == file_count);
+            ASSERT(mfs_open(&volume->mfs, "r7", MFS_MODE_READ) == 0);
+            ASSERT(mfs_read(&volume->mfs, data, sizeof(data)) == thread_size(volume, 7));
+            for(int i = 0; i < thread_size(volume, 7); i++) ASSERT(data[i] == thread_byte(7, i));
+            ASSERT(mfs_close(&volume->mfs) == 0);
+        }
+    }
+}
+#endif
+
 int main()
 {
+#ifdef MFS_THREAD_SAFE
+    /* first, so its threads are the first to use the CRC32C tables */
+    test_25();
+#endif
     test_1();
     test_2();
+    test_3();
+    test_4();
+    test_5();
+    test_6();
+    test_7();
+    test_8();
+    test_9();
+    test_10();
+    test_11();
+    test_12();
+    test_13();
+    test_14();
+    test_15();
+    test_16();
+    test_17();
+#ifdef MFS_STATS
+    test_18();
+#endif
+#ifdef MFS_TRACE
+    test_19();
+#endif
+    test_20();
+    test_21();
+    test_22();
+    test_23();
+    test_24();
 }
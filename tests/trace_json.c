@@ -0,0 +1,115 @@
+#define MFS_TRACE
+#include "../mcp_fs.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+
+Converts the entries of mfs_trace_snapshot, dumped as they are in memory
+by a little endian target, to the Chrome trace JSON that chrome://tracing
+and Perfetto open. The steps of closing a file become slices lasting
+until the next step or the end of the close.
+
+usage: trace_json [--ticks-per-us N] [DUMP] > trace.json
+
+*/
+
+static const char * event_names[MFS_TRACE_EVENT_COUNT] = {
+    "mount",
+    "remount",
+    "read",
+    "write",
+    "scan_file",
+    "alloc",
+    "close",
+    "invalidate",
+    "flush",
+    "verify",
+    "commit",
+    "release",
+    "checkpoint"
+};
+
+static double ticks_per_us = 1;
+static uint64_t elapsed; /* the clock may wrap */
+static uint32_t last_time;
+static bool first_event = true;
+
+static uint32_t le32(const uint8_t * p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static void emit(const char * name, char phase, uint32_t time, int32_t block_index, int count)
+{
+    if(first_event) last_time = time;
+    elapsed += (uint32_t) (time - last_time);
+    last_time = time;
+
+    printf("%s\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": 1, \"tid\": 1",
+           first_event ? "" : ",", name, phase, elapsed / ticks_per_us);
+    if(phase == 'i') printf(", \"s\": \"t\"");
+    printf(", \"args\": {");
+    if(block_index >= 0) printf("\"block_index\": %d%s", block_index, phase == 'E' ? ", " : "");
+    if(phase == 'E' && count >= 0) printf("\"failed\": %s", count ? "true" : "false");
+    else if(block_index >= 0 && count) printf(", \"count\": %d", count);
+    printf("}}");
+    first_event = false;
+}
+
+static int usage(const char * name)
+{
+    fprintf(stderr, "usage: %s [--ticks-per-us N] [DUMP] > trace.json\n", name);
+    return 1;
+}
+
+int main(int argc, char ** argv)
+{
+    const char * dump_path = NULL;
+    for(int i = 1; i < argc; i++) {
+        if(!strcmp(argv[i], "--ticks-per-us") && i + 1 < argc) ticks_per_us = atof(argv[++i]);
+        else if(!dump_path && argv[i][0] != '-') dump_path = argv[i];
+        else return usage(argv[0]);
+    }
+    if(ticks_per_us <= 0) return usage(argv[0]);
+
+    FILE * f = dump_path ? fopen(dump_path, "rb") : stdin;
+    if(!f) {
+        perror(dump_path);
+        return 1;
+    }
+
+    printf("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    uint8_t raw[sizeof(mfs_trace_entry_t)];
+    int step = -1;
+    uint32_t time = 0;
+    while(fread(raw, sizeof(raw), 1, f) == 1) {
+        time = le32(raw);
+        int event = raw[4];
+        int phase = raw[5];
+        int count = raw[6] | raw[7] << 8;
+        int32_t block_index = le32(raw + 8);
+        if(event >= MFS_TRACE_EVENT_COUNT || phase > MFS_TRACE_INSTANT) {
+            fprintf(stderr, "not a trace dump\n");
+            return 1;
+        }
+
+        bool is_step = event > MFS_TRACE_CLOSE;
+        if(step != -1 && (is_step || event == MFS_TRACE_CLOSE)) {
+            emit(event_names[step], 'E', time, -1, -1);
+            step = -1;
+        }
+        if(is_step) {
+            step = event;
+            emit(event_names[event], 'B', time, block_index, 0);
+        }
+        else emit(event_names[event], "BEi"[phase], time, block_index, count);
+    }
+    if(step != -1) emit(event_names[step], 'E', time, -1, -1);
+    printf("\n]}\n");
+
+    if(f != stdin) fclose(f);
+    return 0;
+}